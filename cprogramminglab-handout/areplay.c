@@ -0,0 +1,258 @@
+/*
+  Replay an allocation trace recorded by qtest's alloctrace command
+  against the allocators behind test_malloc, without running the queue
+  code.  Each allocator runs in a child process of its own, so that its
+  peak resident set size isn't mixed up with the others'.
+*/
+
+#define _XOPEN_SOURCE 700
+
+#define INTERNAL 1
+
+#include "harness.h"
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/* One decoded trace record.  Timestamps aren't needed to replay */
+typedef struct {
+    atrace_op_t op;
+    uint32_t id;
+    size_t size;
+} event_t;
+
+typedef struct {
+    event_t *events;
+    size_t nevents;
+    size_t nblocks; /* Block numbers are below this */
+} trace_t;
+
+/* Read an unsigned LEB128 number, advancing *pos.  False if malformed */
+static bool get_leb128(const uint8_t *buf, size_t len, size_t *pos,
+                       uint64_t *v) {
+    *v = 0;
+    for (unsigned shift = 0; shift < 64; shift += 7) {
+        if (*pos >= len)
+            return false;
+        uint8_t b = buf[(*pos)++];
+        *v |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80))
+            return true;
+    }
+    return false;
+}
+
+/* Decode the trace at path.  Report why and return false if it is bad */
+static bool load_trace(const char *path, trace_t *tr) {
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        fprintf(stderr, "Could not open '%s'\n", path);
+        return false;
+    }
+    size_t cap = 1 << 16, len = 0;
+    uint8_t *buf = malloc(cap);
+    size_t n;
+    while (buf && (n = fread(buf + len, 1, cap - len, fp)) > 0) {
+        len += n;
+        if (len == cap) {
+            uint8_t *b = realloc(buf, 2 * cap);
+            if (!b)
+                free(buf);
+            buf = b;
+            cap *= 2;
+        }
+    }
+    fclose(fp);
+    if (!buf) {
+        fprintf(stderr, "Out of memory reading '%s'\n", path);
+        return false;
+    }
+    if (len < 8 || memcmp(buf, ATRACE_MAGIC, 8) != 0) {
+        fprintf(stderr, "'%s' is not an allocation trace\n", path);
+        free(buf);
+        return false;
+    }
+
+    /* Records are at least 3 bytes */
+    tr->events = malloc((len / 3 + 1) * sizeof(event_t));
+    tr->nevents = 0;
+    tr->nblocks = 0;
+    if (!tr->events) {
+        fprintf(stderr, "Out of memory reading '%s'\n", path);
+        free(buf);
+        return false;
+    }
+    bool ok = true;
+    size_t pos = 8;
+    while (ok && pos < len) {
+        event_t *e = &tr->events[tr->nevents];
+        uint8_t op = buf[pos++];
+        uint64_t delta, id, size = 0;
+        ok = op <= ATRACE_FREE && get_leb128(buf, len, &pos, &delta) &&
+             get_leb128(buf, len, &pos, &id) && id < UINT32_MAX &&
+             (op == ATRACE_FREE || get_leb128(buf, len, &pos, &size)) &&
+             size <= SIZE_MAX / 2;
+        if (!ok)
+            break;
+        e->op = (atrace_op_t)op;
+        e->id = (uint32_t)id;
+        e->size = (size_t)size;
+        if (id >= tr->nblocks)
+            tr->nblocks = (size_t)id + 1;
+        tr->nevents++;
+    }
+    if (!ok)
+        fprintf(stderr, "'%s' is corrupt at byte %zu\n", path, pos);
+    free(buf);
+    return ok;
+}
+
+/* Resident set size in KB, from /proc */
+static long resident_kb(void) {
+    long pages = 0, rss = 0;
+    FILE *fp = fopen("/proc/self/statm", "r");
+    if (fp) {
+        if (fscanf(fp, "%ld %ld", &pages, &rss) != 2)
+            rss = 0;
+        fclose(fp);
+    }
+    return rss * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + 1.0E-9 * (double)ts.tv_nsec;
+}
+
+/*
+  Replay the trace reps times with one allocator and print a line of
+  results.  Blocks still live at the end of a pass are freed untimed.
+  Fragmentation is the share of the memory the replay added to the
+  resident set that didn't hold live payload at the peak.
+*/
+static bool replay(const trace_t *tr, alloc_kind_t kind, int reps) {
+    if (!set_allocator(kind)) {
+        fprintf(stderr, "Could not switch to the %s allocator\n",
+                allocator_names[kind]);
+        return false;
+    }
+    void **blocks = calloc(tr->nblocks ? tr->nblocks : 1, sizeof(void *));
+    if (!blocks) {
+        fprintf(stderr, "Out of memory\n");
+        return false;
+    }
+    long base_kb = resident_kb();
+    double secs = 0;
+    bool ok = true;
+    for (int r = 0; ok && r < reps; r++) {
+        double start = now();
+        for (size_t i = 0; ok && i < tr->nevents; i++) {
+            const event_t *e = &tr->events[i];
+            if (e->op == ATRACE_FREE) {
+                test_free(blocks[e->id]);
+                blocks[e->id] = NULL;
+                continue;
+            }
+            blocks[e->id] = e->op == ATRACE_CALLOC ? test_calloc(1, e->size)
+                                                   : test_malloc(e->size);
+            ok = blocks[e->id] != NULL || e->size == 0;
+        }
+        secs += now() - start;
+        for (size_t b = 0; b < tr->nblocks; b++) {
+            test_free(blocks[b]);
+            blocks[b] = NULL;
+        }
+    }
+    free(blocks);
+    if (!ok) {
+        fprintf(stderr, "Allocation failed replaying with %s\n",
+                allocator_names[kind]);
+        return false;
+    }
+
+    alloc_stats_t st;
+    allocation_stats(&st);
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    double added = (double)(ru.ru_maxrss - base_kb) * 1024;
+    double frag = added > 0 ? 1 - (double)st.peak_bytes / added : 0;
+    printf("%-10s %12.2f %12.1f %12.1f %9.1f%%\n", allocator_names[kind],
+           (double)tr->nevents * reps / secs / 1e6,
+           (double)ru.ru_maxrss / 1024, added / (1 << 20),
+           frag > 0 ? 100 * frag : 0);
+    return true;
+}
+
+static void usage(char *cmd) {
+    printf("Usage: %s [-h] [-a ALLOC] [-r REPS] TRACE\n", cmd);
+    printf("\t-h       Print this information\n");
+    printf("\t-a ALLOC Allocator to replay with:");
+    for (size_t i = 0; i < ALLOC_KINDS; i++)
+        printf(" %s", allocator_names[i]);
+    printf(" (default: all)\n");
+    printf("\t-r REPS  Times to replay the trace (default: 1)\n");
+    exit(0);
+}
+
+int main(int argc, char *argv[]) {
+    int first = 0, last = ALLOC_KINDS - 1;
+    int reps = 1;
+    int c;
+    while ((c = getopt(argc, argv, "ha:r:")) != -1) {
+        switch (c) {
+        case 'a':
+            for (first = 0; first < ALLOC_KINDS; first++)
+                if (strcmp(optarg, allocator_names[first]) == 0)
+                    break;
+            if (first == ALLOC_KINDS) {
+                fprintf(stderr, "Unknown allocator '%s'\n", optarg);
+                usage(argv[0]);
+            }
+            last = first;
+            break;
+        case 'r':
+            reps = atoi(optarg);
+            if (reps < 1) {
+                fprintf(stderr, "Invalid number of replays '%s'\n", optarg);
+                usage(argv[0]);
+            }
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1)
+        usage(argv[0]);
+
+    trace_t tr;
+    if (!load_trace(argv[optind], &tr))
+        return 1;
+    printf("%zu events on up to %zu blocks, replayed %d time%s\n",
+           tr.nevents, tr.nblocks, reps, reps == 1 ? "" : "s");
+    printf("%-10s %12s %12s %12s %10s\n", "allocator", "Mevents/s",
+           "peak RSS MB", "added MB", "frag");
+    fflush(stdout);
+
+    bool ok = true;
+    for (int k = first; k <= last; k++) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            fprintf(stderr, "Could not fork\n");
+            return 1;
+        }
+        if (pid == 0)
+            exit(replay(&tr, (alloc_kind_t)k, reps) ? 0 : 1);
+        int status;
+        ok = waitpid(pid, &status, 0) == pid && WIFEXITED(status) &&
+             WEXITSTATUS(status) == 0 && ok;
+    }
+    free(tr.events);
+    return ok ? 0 : 1;
+}
@@ -6,10 +6,14 @@
 #include "report.h"
 
 #include <ctype.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 /* A few functions in this file intentionally don't use their
@@ -32,6 +36,7 @@ static double last_time;
 /*
   Implement buffered I/O using variant of RIO package from CS:APP
   Must create stack of buffers to handle I/O with nested source commands.
+  Regular files are mapped instead, and their lines are used in place.
 */
 
 #define RIO_BUFSIZE 8192
@@ -42,9 +47,18 @@ struct RIO_ELE {
     ssize_t cnt;           /* Unread bytes in internal buffer */
     char *bufptr;          /* Next unread byte in internal buffer */
     char buf[RIO_BUFSIZE]; /* Internal buffer */
+    char *map;             /* Whole file if mapped, else NULL */
+    size_t map_len;
+    size_t map_pos;        /* Start of next line in map */
     rio_ptr prev;          /* Next element in stack */
 };
 
+/* Line of input, not NUL-terminated.  Includes its newline, if any */
+typedef struct {
+    const char *p;
+    size_t len;
+} line_t;
+
 rio_ptr buf_stack;
 char linebuf[RIO_BUFSIZE];
 
@@ -67,6 +81,9 @@ static const char *prompt = "cmd> ";
 static cmd_function quit_helpers[MAXQUIT];
 static int quit_helper_cnt = 0;
 
+/* Optional function to call while waiting for input */
+static idle_function idle_helper = NULL;
+
 bool do_quit_cmd(int argc, char *argv[]);
 bool do_help_cmd(int argc, char *argv[]);
 bool do_option_cmd(int argc, char *argv[]);
@@ -74,13 +91,14 @@ bool do_source_cmd(int argc, char *argv[]);
 bool do_log_cmd(int argc, char *argv[]);
 bool do_time_cmd(int argc, char *argv[]);
 bool do_comment_cmd(int argc, char *argv[]);
+bool do_repeat_cmd(int argc, char *argv[]);
 
 static void init_in(void);
 
 static bool push_file(char *fname);
 static void pop_file(void);
+static bool readline(line_t *line);
 
-static bool interpret_cmda(int argc, char *argv[]);
 
 /* Initialize interpreter */
 void init_cmd(void) {
@@ -97,6 +115,8 @@ void init_cmd(void) {
     add_cmd("log", do_log_cmd, " file           | Copy output to file");
     add_cmd("time", do_time_cmd, " cmd arg ...    | Time command execution");
     add_cmd("#", do_comment_cmd, " ...            | Display comment");
+    add_cmd("repeat", do_repeat_cmd,
+            " N [var] {      | Repeat lines up to '}' N times, $var from 0");
     add_param("verbose", &verblevel, "Verbosity level", NULL);
     add_param("error", &err_limit, "Number of errors until exit", NULL);
     add_param("echo", &echo, "Do/don't echo commands", NULL);
@@ -125,6 +145,12 @@ void add_cmd(const char *name, cmd_function operation,
 /* Add a new parameter */
 void add_param(const char *name, int *valp, const char *documentation,
                setter_function setter) {
+    add_param_choices(name, valp, documentation, setter, NULL);
+}
+
+/* Add a new parameter with named values */
+void add_param_choices(const char *name, int *valp, const char *documentation,
+                       setter_function setter, const char *const *choices) {
     param_ptr next_param = param_list;
     param_ptr *last_loc = &param_list;
     while (next_param && strcmp(name, next_param->name) > 0) {
@@ -136,25 +162,26 @@ void add_param(const char *name, int *valp, const char *documentation,
     ele->valp = valp;
     ele->documentation = documentation;
     ele->setter = setter;
+    ele->choices = choices;
     ele->next = next_param;
     *last_loc = ele;
 }
 
-/* Parse a string into a command line */
-static char **parse_args(char *line, int *argcp) {
+/* Parse len characters of a line into a command line */
+static char **parse_args(const char *line, size_t len, int *argcp) {
     /*
       Must first determine how many arguments there are.
       Replace all white space with null characters
     */
-    size_t len = strlen(line);
     /* First copy into buffer with each substring null-terminated */
     char *buf = malloc_or_fail(len + 1, "parse_args");
-    char *src = line;
+    const char *src = line;
     char *dst = buf;
     bool skipping = true;
     char c = 0;
     int argc = 0;
-    while ((c = *src++) != '\0') {
+    for (const char *end = line + len; src < end;) {
+        c = *src++;
         if (isspace(c)) {
             if (!skipping) {
                 /* Hit end of word */
@@ -170,12 +197,14 @@ static char **parse_args(char *line, int *argcp) {
             *dst++ = c;
         }
     }
+    /* The last word needn't be followed by white space */
+    *dst = '\0';
     /* Now assemble into array of strings */
     char **argv = calloc_or_fail((size_t)argc, sizeof(char *), "parse_args");
-    src = buf;
+    char *word = buf;
     for (int i = 0; i < argc; i++) {
-        argv[i] = strsave_or_fail(src, "parse_args");
-        src += strlen(argv[i]) + 1;
+        argv[i] = strsave_or_fail(word, "parse_args");
+        word += strlen(argv[i]) + 1;
     }
     free(buf);
     *argcp = argc;
@@ -190,19 +219,20 @@ static void record_error(void) {
     }
 }
 
-/* Execute a command that has already been split into arguments */
-static bool interpret_cmda(int argc, char *argv[]) {
-    if (argc == 0) {
-        return true;
-    }
-    /* Try to find matching command */
+/* Find a command by name.  NULL if there is none */
+static cmd_ptr find_cmd(const char *name) {
     cmd_ptr next_cmd = cmd_list;
-    bool ok = true;
-    while (next_cmd && strcmp(argv[0], next_cmd->name) != 0) {
+    while (next_cmd && strcmp(name, next_cmd->name) != 0) {
         next_cmd = next_cmd->next;
     }
-    if (next_cmd) {
-        ok = next_cmd->operation(argc, argv);
+    return next_cmd;
+}
+
+/* Execute the operation of command argv[0], or NULL if it is unknown */
+static bool run_operation(cmd_function operation, int argc, char *argv[]) {
+    bool ok = true;
+    if (operation) {
+        ok = operation(argc, argv);
         if (!ok) {
             record_error();
         }
@@ -214,17 +244,356 @@ static bool interpret_cmda(int argc, char *argv[]) {
     return ok;
 }
 
-/* Execute a command from a command line */
-bool interpret_cmd(char *cmdline) {
+/* Execute a command that has already been split into arguments */
+bool interpret_cmda(int argc, char *argv[]) {
+    if (argc == 0) {
+        return true;
+    }
+    cmd_ptr c = find_cmd(argv[0]);
+    return run_operation(c ? c->operation : NULL, argc, argv);
+}
+
+/*
+  Repeat blocks.  "repeat N [var] {" starts a block that ends at the
+  matching "}"; blocks nest.  Lines are read into a block as they come,
+  split into arguments and with their commands looked up once, and the
+  block runs when its last "}" is read.  In a block, $var or ${var} in an
+  argument is replaced by the iteration of the enclosing loop with that
+  variable, counting from 0, and $$ by $.
+*/
+
+#define MAXDEPTH 16
+
+/* Where the value of a loop variable goes in an argument */
+typedef struct {
+    size_t at;   /* Offset in the argument's text */
+    size_t loop; /* Depth of the loop */
+} ref_t;
+
+/* Argument of a line in a repeat block */
+typedef struct {
+    char *text; /* With any variable references taken out */
+    ref_t *refs;
+    size_t nrefs;
+    char *buf; /* Room for the argument with values put in, or text */
+} targ_t;
+
+/*
+  Line of a repeat block.  A loop's only argument is its count, and its
+  body is the ops up to end.  end is 0 for a command
+*/
+typedef struct {
+    cmd_function operation;
+    int argc;
+    targ_t *args;
+    char **argv; /* Arguments passed to operation */
+    size_t end;
+} op_t;
+
+typedef struct {
+    op_t *ops;
+    size_t nops;
+    size_t cap;
+    size_t open[MAXDEPTH];   /* Loops whose '}' hasn't been read yet */
+    char *vars[MAXDEPTH];    /* Their variables, or NULL */
+    size_t depth;            /* Number of open loops */
+    uint64_t vals[MAXDEPTH]; /* Iteration of each loop while running */
+    bool bad;                /* Whether any line of it was in error */
+} block_t;
+
+/* Repeat block being read, if any */
+static block_t *repeat_block = NULL;
+
+static bool interpret_line(const char *cmdline, size_t len);
+
+static bool collecting(void) {
+    return repeat_block != NULL;
+}
+
+/* Length of the variable name at the start of s.  0 if there is none */
+static size_t name_len(const char *s) {
+    size_t n = 0;
+    if (isdigit((unsigned char)s[0]))
+        return 0;
+    while (isalnum((unsigned char)s[n]) || s[n] == '_')
+        n++;
+    return n;
+}
+
+/* Extract a repeat count from text */
+static bool get_count(const char *text, uint64_t *loc) {
+    char *end = NULL;
+    if (!isdigit((unsigned char)text[0]))
+        return false;
+    errno = 0;
+    unsigned long long v = strtoull(text, &end, 0);
+    if (errno != 0 || *end != '\0')
+        return false;
+    *loc = v;
+    return true;
+}
+
+/* Write v in decimal, without a NUL.  Return the number of digits */
+static size_t put_uint(char *dst, uint64_t v) {
+    char digits[20];
+    size_t n = 0;
+    do {
+        digits[n++] = (char)('0' + v % 10);
+        v /= 10;
+    } while (v);
+    for (size_t i = 0; i < n; i++)
+        dst[i] = digits[n - 1 - i];
+    return n;
+}
+
+static void free_arg(targ_t *a) {
+    if (a->buf != a->text)
+        free(a->buf);
+    free(a->text);
+    free(a->refs);
+}
+
+/* Split src into text and references to the loops open in b */
+static bool make_arg(const block_t *b, const char *src, targ_t *a) {
+    a->text = malloc_or_fail(strlen(src) + 1, "make_arg");
+    a->refs = NULL;
+    a->nrefs = 0;
+    size_t n = 0;
+    const char *s = src;
+    while (*s) {
+        if (s[0] != '$' || s[1] == '$') {
+            a->text[n++] = *s;
+            s += s[0] == '$' ? 2 : 1;
+            continue;
+        }
+        bool braced = s[1] == '{';
+        const char *name = s + 1 + braced;
+        size_t len = name_len(name);
+        if (len == 0 || (braced && name[len] != '}')) {
+            report(1, "Bad variable reference in '%s'", src);
+            free_arg(a);
+            return false;
+        }
+        size_t d = b->depth;
+        while (d > 0 && !(b->vars[d - 1] && strlen(b->vars[d - 1]) == len &&
+                          strncmp(b->vars[d - 1], name, len) == 0))
+            d--;
+        if (d == 0) {
+            report(1, "Unknown loop variable '%.*s'", (int)len, name);
+            free_arg(a);
+            return false;
+        }
+        a->refs = realloc_or_fail(a->refs, (a->nrefs + 1) * sizeof(ref_t),
+                                  "make_arg");
+        a->refs[a->nrefs].at = n;
+        a->refs[a->nrefs].loop = d - 1;
+        a->nrefs++;
+        s = name + len + braced;
+    }
+    a->text[n] = '\0';
+    a->buf = a->text;
+    if (a->nrefs)
+        a->buf = malloc_or_fail(n + 20 * a->nrefs + 1, "make_arg");
+    return true;
+}
+
+/* The argument with the current values of its variables put in */
+static char *expand_arg(targ_t *a, const uint64_t *vals) {
+    if (a->nrefs == 0)
+        return a->text;
+    char *dst = a->buf;
+    size_t from = 0;
+    for (size_t i = 0; i < a->nrefs; i++) {
+        memcpy(dst, a->text + from, a->refs[i].at - from);
+        dst += a->refs[i].at - from;
+        from = a->refs[i].at;
+        dst += put_uint(dst, vals[a->refs[i].loop]);
+    }
+    strcpy(dst, a->text + from);
+    return a->buf;
+}
+
+/* Split argv into the arguments of op.  False if any is in error */
+static bool make_op(const block_t *b, int argc, char *argv[], op_t *op) {
+    op->args = calloc_or_fail((size_t)argc, sizeof(targ_t), "make_op");
+    op->argv = calloc_or_fail((size_t)argc, sizeof(char *), "make_op");
+    for (; op->argc < argc; op->argc++) {
+        if (!make_arg(b, argv[op->argc], &op->args[op->argc]))
+            return false;
+    }
+    return true;
+}
+
+static void add_op(block_t *b, const op_t *op) {
+    if (b->nops == b->cap) {
+        b->cap = b->cap ? 2 * b->cap : 16;
+        b->ops = realloc_or_fail(b->ops, b->cap * sizeof(op_t), "add_op");
+    }
+    b->ops[b->nops++] = *op;
+}
+
+static void free_op(op_t *op) {
+    for (int i = 0; i < op->argc; i++)
+        free_arg(&op->args[i]);
+    free(op->args);
+    free(op->argv);
+}
+
+/*
+  Add the loop of a "repeat N [var] {" line to b.  If the line ends with
+  '{', a loop is opened even if the line is in error, so that the
+  '}' lines still pair up
+*/
+static bool add_loop(block_t *b, int argc, char *argv[]) {
+    bool opens = strcmp(argv[argc - 1], "{") == 0;
+    if (opens && b->depth == MAXDEPTH) {
+        report(1, "Repeat blocks nested more than %d deep", MAXDEPTH);
+        return false;
+    }
+    op_t op = {NULL, 0, NULL, NULL, 0};
+    uint64_t count;
+    bool ok = opens && (argc == 3 || argc == 4);
+    if (!ok) {
+        report(1, "Usage: repeat N [var] {");
+    } else if (argc == 4 &&
+               (name_len(argv[2]) == 0 || argv[2][name_len(argv[2])])) {
+        report(1, "Invalid loop variable '%s'", argv[2]);
+        ok = false;
+    } else {
+        ok = make_op(b, 1, argv + 1, &op);
+        if (ok && op.args[0].nrefs == 0 && !get_count(argv[1], &count)) {
+            report(1, "Invalid repeat count '%s'", argv[1]);
+            ok = false;
+        }
+    }
+    if (!opens) {
+        free_op(&op);
+        return false;
+    }
+    b->open[b->depth] = b->nops;
+    b->vars[b->depth] = argc == 4 ? strsave_or_fail(argv[2], "add_loop") : NULL;
+    b->depth++;
+    add_op(b, &op);
+    return ok;
+}
+
+/* Add a command line to b, looking up its command */
+static bool add_command(block_t *b, int argc, char *argv[]) {
+    op_t op = {NULL, 0, NULL, NULL, 0};
+    cmd_ptr c = find_cmd(argv[0]);
+    if (!c) {
+        report(1, "Unknown command '%s'", argv[0]);
+        return false;
+    }
+    op.operation = c->operation;
+    if (!make_op(b, argc, argv, &op)) {
+        free_op(&op);
+        return false;
+    }
+    add_op(b, &op);
+    return true;
+}
+
+static void free_block(block_t *b) {
+    for (size_t i = 0; i < b->nops; i++)
+        free_op(&b->ops[i]);
+    free(b->ops);
+    for (size_t d = 0; d < b->depth; d++)
+        free(b->vars[d]);
+    free(b);
+}
+
+/* Run ops begin up to end of b, in loops nested depth deep */
+static bool run_ops(block_t *b, size_t begin, size_t end, size_t depth) {
+    bool ok = true;
+    for (size_t i = begin; i < end && !quit_flag;) {
+        op_t *op = &b->ops[i];
+        for (int a = 0; a < op->argc; a++)
+            op->argv[a] = expand_arg(&op->args[a], b->vals);
+        if (op->end == 0) {
+            /* Run any file it sources before going on */
+            rio_ptr base = buf_stack;
+            ok = run_operation(op->operation, op->argc, op->argv) && ok;
+            line_t line;
+            while (buf_stack != base && !quit_flag) {
+                if (readline(&line))
+                    interpret_line(line.p, line.len);
+            }
+            i++;
+            continue;
+        }
+        uint64_t count;
+        if (!get_count(op->argv[0], &count)) {
+            report(1, "Invalid repeat count '%s'", op->argv[0]);
+            record_error();
+            ok = false;
+            count = 0;
+        }
+        for (uint64_t v = 0; v < count && !quit_flag; v++) {
+            b->vals[depth] = v;
+            ok = run_ops(b, i + 1, op->end, depth + 1) && ok;
+        }
+        i = op->end;
+    }
+    return ok;
+}
+
+/* Read a line into the repeat block, and run the block once it ends */
+static bool collect_line(int argc, char *argv[]) {
+    block_t *b = repeat_block;
+    if (argc == 0)
+        return true;
+    if (argc > 1 || strcmp(argv[0], "}") != 0) {
+        bool ok = strcmp(argv[0], "repeat") == 0 ? add_loop(b, argc, argv)
+                                                 : add_command(b, argc, argv);
+        if (!ok) {
+            b->bad = true;
+            record_error();
+        }
+        return ok;
+    }
+    b->depth--;
+    b->ops[b->open[b->depth]].end = b->nops;
+    free(b->vars[b->depth]);
+    b->vars[b->depth] = NULL;
+    if (b->depth > 0)
+        return true;
+
+    /* Commands it runs may start a block of their own */
+    repeat_block = NULL;
+    bool ok = false;
+    if (b->bad)
+        report(1, "Not running repeat block with errors");
+    else
+        ok = run_ops(b, 0, b->nops, 0);
+    free_block(b);
+    return ok;
+}
+
+bool do_repeat_cmd(int argc, char *argv[]) {
+    repeat_block = calloc_or_fail(1, sizeof(block_t), "do_repeat_cmd");
+    bool ok = add_loop(repeat_block, argc, argv);
+    if (repeat_block->depth == 0) {
+        free_block(repeat_block);
+        repeat_block = NULL;
+    } else {
+        repeat_block->bad = !ok;
+    }
+    return ok;
+}
+
+/* Execute a command from len characters of a line */
+static bool interpret_line(const char *cmdline, size_t len) {
     int argc = 0;
     if (quit_flag) {
         return false;
     }
 #if RPT >= 6
-    report(6, "Interpreting command '%s'\n", cmdline);
+    report(6, "Interpreting command '%.*s'\n", (int)len, cmdline);
 #endif
-    char **argv = parse_args(cmdline, &argc);
-    bool ok = interpret_cmda(argc, argv);
+    char **argv = parse_args(cmdline, len, &argc);
+    bool ok = collecting() ? collect_line(argc, argv)
+                           : interpret_cmda(argc, argv);
     for (int i = 0; i < argc; i++) {
         free(argv[i]);
     }
@@ -232,6 +601,11 @@ bool interpret_cmd(char *cmdline) {
     return ok;
 }
 
+/* Execute a command from a command line */
+bool interpret_cmd(char *cmdline) {
+    return interpret_line(cmdline, strlen(cmdline));
+}
+
 /* Set function to be executed as part of program exit */
 void add_quit_helper(cmd_function qf) {
     if (quit_helper_cnt < MAXQUIT) {
@@ -241,6 +615,11 @@ void add_quit_helper(cmd_function qf) {
     }
 }
 
+/* Set function to be called while waiting for input */
+void set_idle_helper(idle_function idle) {
+    idle_helper = idle;
+}
+
 /* Set prompt string */
 void set_prompt(char *p) {
     prompt = p;
@@ -269,6 +648,12 @@ bool do_quit_cmd(int argc, char *argv[]) {
     while (buf_stack) {
         pop_file();
     }
+    if (collecting()) {
+        report(1, "ERROR: Missing '}' at end of repeat block");
+        free_block(repeat_block);
+        repeat_block = NULL;
+        ok = false;
+    }
     for (int i = 0; i < quit_helper_cnt; i++) {
         ok = ok && quit_helpers[i](argc, argv);
     }
@@ -276,6 +661,29 @@ bool do_quit_cmd(int argc, char *argv[]) {
     return ok;
 }
 
+/* Show a parameter's value, by name if it has one */
+static void report_param(param_ptr p) {
+    int n = 0;
+    while (p->choices && p->choices[n])
+        n++;
+    if (*p->valp >= 0 && *p->valp < n)
+        report(1, "\t%s\t%s\t%s", p->name, p->choices[*p->valp],
+               p->documentation);
+    else
+        report(1, "\t%s\t%d\t%s", p->name, *p->valp, p->documentation);
+}
+
+/* Parse a parameter value: an integer, or one of the parameter's names */
+static bool get_param_value(param_ptr p, char *text, int *loc) {
+    for (int i = 0; p->choices && p->choices[i]; i++) {
+        if (strcmp(text, p->choices[i]) == 0) {
+            *loc = i;
+            return true;
+        }
+    }
+    return get_int(text, loc);
+}
+
 bool do_help_cmd(int argc UNUSED, char *argv[] UNUSED) {
     cmd_ptr clist = cmd_list;
     report(1, "Commands:", NULL);
@@ -286,8 +694,7 @@ bool do_help_cmd(int argc UNUSED, char *argv[] UNUSED) {
     param_ptr plist = param_list;
     report(1, "Options:");
     while (plist) {
-        report(1, "\t%s\t%d\t%s", plist->name, *plist->valp,
-               plist->documentation);
+        report_param(plist);
         plist = plist->next;
     }
     return true;
@@ -323,8 +730,7 @@ bool do_option_cmd(int argc, char *argv[]) {
         param_ptr plist = param_list;
         report(1, "Options:");
         while (plist) {
-            report(1, "\t%s\t%d\t%s", plist->name, *plist->valp,
-                   plist->documentation);
+            report_param(plist);
             plist = plist->next;
         }
         return true;
@@ -338,14 +744,15 @@ bool do_option_cmd(int argc, char *argv[]) {
             report(1, "No value given for parameter %s", name);
             return false;
         }
-        if (!get_int(argv[++i], &value)) {
-            report(1, "Cannot parse '%s' as integer", argv[i]);
-            return false;
-        }
+        i++;
         /* Find parameter in list */
         param_ptr plist = param_list;
         while (!found && plist) {
             if (strcmp(plist->name, name) == 0) {
+                if (!get_param_value(plist, argv[i], &value)) {
+                    report(1, "Cannot parse '%s' as integer", argv[i]);
+                    return false;
+                }
                 int oldval = *plist->valp;
                 *plist->valp = value;
                 if (plist->setter) {
@@ -423,6 +830,21 @@ static bool push_file(char *fname) {
     rnew->fd = fd;
     rnew->cnt = 0;
     rnew->bufptr = rnew->buf;
+    /* Standard input, pipes and empty files are read as before */
+    rnew->map = NULL;
+    rnew->map_len = 0;
+    rnew->map_pos = 0;
+    struct stat st;
+    if (fname && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+        st.st_size > 0 && (uintmax_t)st.st_size <= SIZE_MAX) {
+        size_t len = (size_t)st.st_size;
+        void *map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            posix_madvise(map, len, POSIX_MADV_SEQUENTIAL);
+            rnew->map = map;
+            rnew->map_len = len;
+        }
+    }
     rnew->prev = buf_stack;
     buf_stack = rnew;
     return true;
@@ -435,6 +857,8 @@ static void pop_file(void) {
     if (buf_stack) {
         rio_ptr rsave = buf_stack;
         buf_stack = rsave->prev;
+        if (rsave->map)
+            munmap(rsave->map, rsave->map_len);
         close(rsave->fd);
         free(rsave);
     }
@@ -445,15 +869,43 @@ static void init_in(void) {
     buf_stack = NULL;
 }
 
+/* Echo a line of input */
+static void echo_line(const line_t *line) {
+    if (echo) {
+        report_noreturn(1, prompt);
+        report_noreturn(1, "%.*s", (int)line->len, line->p);
+        if (line->len == 0 || line->p[line->len - 1] != '\n')
+            report_noreturn(1, "\n");
+    }
+}
+
+/* Next line of a mapped file, found with memchr.  False at EOF */
+static bool map_readline(line_t *line) {
+    size_t left = buf_stack->map_len - buf_stack->map_pos;
+    if (left == 0) {
+        pop_file();
+        return false;
+    }
+    line->p = buf_stack->map + buf_stack->map_pos;
+    const char *nl = memchr(line->p, '\n', left);
+    line->len = nl ? (size_t)(nl - line->p) + 1 : left;
+    buf_stack->map_pos += line->len;
+    echo_line(line);
+    return true;
+}
+
 /* Read command from input file.
-   When hit EOF, close that file and return NULL
+   When hit EOF, close that file and return false
 */
-static char *readline(void) {
+static bool readline(line_t *line) {
     char c = 0;
     char *lptr = linebuf;
 
     if (buf_stack == NULL) {
-        return NULL;
+        return false;
+    }
+    if (buf_stack->map) {
+        return map_readline(line);
     }
 
     for (int cnt = 0; cnt < RIO_BUFSIZE - 2; cnt++) {
@@ -468,14 +920,12 @@ static char *readline(void) {
                     /* Last line of file did not terminate with newline. */
                     /*  Terminate line & return it */
                     *lptr++ = '\n';
-                    *lptr++ = '\0';
-                    if (echo) {
-                        report_noreturn(1, prompt);
-                        report_noreturn(1, linebuf);
-                    }
-                    return linebuf;
+                    line->p = linebuf;
+                    line->len = (size_t)(lptr - linebuf);
+                    echo_line(line);
+                    return true;
                 }
-                return NULL;
+                return false;
             }
         }
         /* Have text in buffer */
@@ -490,12 +940,10 @@ static char *readline(void) {
         /* Hit buffer limit.  Artificially terminate line */
         *lptr++ = '\n';
     }
-    *lptr++ = '\0';
-    if (echo) {
-        report_noreturn(1, prompt);
-        report_noreturn(1, linebuf);
-    }
-    return linebuf;
+    line->p = linebuf;
+    line->len = (size_t)(lptr - linebuf);
+    echo_line(line);
+    return true;
 }
 
 void block_console(void) {
@@ -513,12 +961,11 @@ void unblock_console(void) {
 
 /* Determine if there is a complete command line in input buffer */
 static bool read_ready(void) {
-    for (int i = 0; buf_stack && i < buf_stack->cnt; i++) {
-        if (buf_stack->bufptr[i] == '\n') {
-            return true;
-        }
+    if (buf_stack && buf_stack->map) {
+        return buf_stack->map_pos < buf_stack->map_len;
     }
-    return false;
+    return buf_stack && buf_stack->cnt > 0 &&
+           memchr(buf_stack->bufptr, '\n', (size_t)buf_stack->cnt) != NULL;
 }
 
 /*
@@ -533,12 +980,13 @@ static bool read_ready(void) {
 
 int cmd_select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds,
                struct timeval *timeout) {
-    char *cmdline = NULL;
+    line_t line;
     int infd = 0;
     fd_set local_readset;
     while (!block_flag && read_ready()) {
-        cmdline = readline();
-        interpret_cmd(cmdline);
+        if (readline(&line)) {
+            interpret_line(line.p, line.len);
+        }
         prompt_flag = true;
     }
     if (cmd_done()) {
@@ -564,7 +1012,32 @@ int cmd_select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds,
     if (nfds == 0) {
         return 0;
     }
-    int result = select(nfds, readfds, writefds, exceptfds, timeout);
+    /*
+      Without a timeout of the caller's, wake up whenever the idle helper
+      is due, and wait again with the original sets once it has run.
+    */
+    fd_set rset, wset, eset;
+    if (readfds)
+        rset = *readfds;
+    if (writefds)
+        wset = *writefds;
+    if (exceptfds)
+        eset = *exceptfds;
+    int result;
+    for (;;) {
+        long wait_us = idle_helper && !timeout ? idle_helper() : -1;
+        struct timeval idle_time = {wait_us / 1000000, wait_us % 1000000};
+        result = select(nfds, readfds, writefds, exceptfds,
+                        wait_us >= 0 ? &idle_time : timeout);
+        if (result != 0 || wait_us < 0)
+            break;
+        if (readfds)
+            *readfds = rset;
+        if (writefds)
+            *writefds = wset;
+        if (exceptfds)
+            *exceptfds = eset;
+    }
     if (result <= 0) {
         return result;
     }
@@ -573,9 +1046,8 @@ int cmd_select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds,
         /* Commandline input available */
         FD_CLR(infd, readfds);
         result--;
-        cmdline = readline();
-        if (cmdline) {
-            interpret_cmd(cmdline);
+        if (readline(&line)) {
+            interpret_line(line.p, line.len);
         }
     }
     return result;
@@ -602,7 +1074,322 @@ bool finish_cmd(void) {
     return ok && err_cnt == 0;
 }
 
+/*
+  Compiled traces.  A compiled trace is the magic number, then unsigned
+  LEB128 numbers: the count and names of the commands used, the count and
+  text of the distinct arguments, and the count of lines, each as a
+  command number + 1, the number of arguments and their numbers, or as 0
+  for a blank line.
+  Every name and text is its length followed by its bytes.  Running one
+  looks up each command name once and then calls through a table, with
+  no parsing or allocation per command.
+*/
+
+/* Identifies a compiled trace file */
+static const char compiled_magic[8] = {'Q', 'T', 'R', 'A', 'C', 'E', 'C', '1'};
+
+/* Growable byte buffer */
+typedef struct {
+    uint8_t *p;
+    size_t len;
+    size_t cap;
+} bytes_t;
+
+static void put_bytes(bytes_t *b, const void *src, size_t n) {
+    if (b->len + n > b->cap) {
+        size_t cap = b->cap ? b->cap : 4096;
+        while (cap < b->len + n)
+            cap *= 2;
+        b->p = realloc_or_fail(b->p, cap, "put_bytes");
+        b->cap = cap;
+    }
+    memcpy(b->p + b->len, src, n);
+    b->len += n;
+}
+
+static void put_leb128(bytes_t *b, uint64_t v) {
+    uint8_t buf[10];
+    size_t n = 0;
+    while (v >= 0x80) {
+        buf[n++] = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    buf[n++] = (uint8_t)v;
+    put_bytes(b, buf, n);
+}
+
+/* Read an unsigned LEB128 number, advancing *pos.  False if malformed */
+static bool get_leb128(const uint8_t *p, size_t len, size_t *pos,
+                       uint64_t *v) {
+    *v = 0;
+    for (unsigned shift = 0; shift < 64; shift += 7) {
+        if (*pos >= len)
+            return false;
+        uint8_t c = p[(*pos)++];
+        *v |= (uint64_t)(c & 0x7f) << shift;
+        if (!(c & 0x80))
+            return true;
+    }
+    return false;
+}
+
+/* Distinct strings, numbered in order of first appearance */
+typedef struct {
+    char **strs;
+    size_t nstrs;
+    size_t cap;
+    uint32_t *index; /* Open addressing: string number + 1, 0 if empty */
+    size_t slots;    /* Always a power of two */
+} intern_t;
+
+/* FNV-1a */
+static uint64_t str_hash(const char *s) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    while (*s)
+        h = (h ^ (uint8_t)*s++) * 0x100000001b3ULL;
+    return h;
+}
+
+static size_t intern_slot(const intern_t *t, const char *s) {
+    size_t i = (size_t)str_hash(s) & (t->slots - 1);
+    while (t->index[i] && strcmp(t->strs[t->index[i] - 1], s) != 0)
+        i = (i + 1) & (t->slots - 1);
+    return i;
+}
+
+/* Number of string s, adding a copy of it if new */
+static uint32_t intern(intern_t *t, const char *s) {
+    if (2 * (t->nstrs + 1) > t->slots) {
+        size_t slots = t->slots ? 2 * t->slots : 256;
+        free(t->index);
+        t->index = calloc_or_fail(slots, sizeof(uint32_t), "intern");
+        t->slots = slots;
+        for (size_t i = 0; i < t->nstrs; i++)
+            t->index[intern_slot(t, t->strs[i])] = (uint32_t)(i + 1);
+    }
+    size_t slot = intern_slot(t, s);
+    if (t->index[slot])
+        return t->index[slot] - 1;
+    if (t->nstrs == t->cap) {
+        t->cap = t->cap ? 2 * t->cap : 256;
+        t->strs = realloc_or_fail(t->strs, t->cap * sizeof(char *), "intern");
+    }
+    t->strs[t->nstrs] = strsave_or_fail(s, "intern");
+    t->index[slot] = (uint32_t)++t->nstrs;
+    return t->index[slot] - 1;
+}
+
+/* Append the strings of t to b, and free them */
+static void put_strings(bytes_t *b, intern_t *t) {
+    put_leb128(b, t->nstrs);
+    for (size_t i = 0; i < t->nstrs; i++) {
+        size_t len = strlen(t->strs[i]);
+        put_leb128(b, len);
+        put_bytes(b, t->strs[i], len);
+        free(t->strs[i]);
+    }
+    free(t->strs);
+    free(t->index);
+}
+
+bool compile_cmd_file(const char *in_name, const char *out_name) {
+    FILE *in = fopen(in_name, "r");
+    if (!in) {
+        report(1, "Could not open source file '%s'", in_name);
+        return false;
+    }
+    intern_t cmds = {NULL, 0, 0, NULL, 0};
+    intern_t args = {NULL, 0, 0, NULL, 0};
+    bytes_t code = {NULL, 0, 0};
+    size_t ncode = 0;
+    char *line = NULL;
+    size_t line_cap = 0;
+    ssize_t len;
+    while ((len = getline(&line, &line_cap, in)) >= 0) {
+        int argc = 0;
+        char **argv = parse_args(line, (size_t)len, &argc);
+        if (argc > 0) {
+            if (strcmp(argv[0], "}") != 0 && !find_cmd(argv[0]))
+                report(1, "Warning: unknown command '%s'", argv[0]);
+            put_leb128(&code, (uint64_t)intern(&cmds, argv[0]) + 1);
+            put_leb128(&code, (uint64_t)(argc - 1));
+            for (int i = 1; i < argc; i++)
+                put_leb128(&code, intern(&args, argv[i]));
+        } else {
+            put_leb128(&code, 0);
+        }
+        ncode++;
+        for (int i = 0; i < argc; i++)
+            free(argv[i]);
+        free(argv);
+    }
+    free(line);
+    fclose(in);
+
+    bytes_t out = {NULL, 0, 0};
+    put_bytes(&out, compiled_magic, sizeof(compiled_magic));
+    put_strings(&out, &cmds);
+    put_strings(&out, &args);
+    put_leb128(&out, ncode);
+    put_bytes(&out, code.p, code.len);
+    free(code.p);
+
+    FILE *fp = fopen(out_name, "wb");
+    bool ok = fp && fwrite(out.p, 1, out.len, fp) == out.len;
+    ok = fp && fclose(fp) == 0 && ok;
+    free(out.p);
+    if (!ok)
+        report(1, "Could not write compiled trace '%s'", out_name);
+    else
+        report(2, "Compiled %zu lines to '%s'", ncode, out_name);
+    return ok;
+}
+
+/* Is the file at path a compiled trace? */
+static bool is_compiled(const char *path) {
+    char magic[sizeof(compiled_magic)];
+    FILE *fp = path ? fopen(path, "rb") : NULL;
+    bool compiled = fp &&
+                    fread(magic, 1, sizeof(magic), fp) == sizeof(magic) &&
+                    memcmp(magic, compiled_magic, sizeof(magic)) == 0;
+    if (fp)
+        fclose(fp);
+    return compiled;
+}
+
+/* Decode count strings from p into NUL-terminated copies in *strsp */
+static bool get_strings(const uint8_t *p, size_t len, size_t *pos,
+                        char ***strsp, size_t *countp) {
+    uint64_t count;
+    if (!get_leb128(p, len, pos, &count) || count > len)
+        return false;
+    char **strs =
+        calloc_or_fail(count ? count : 1, sizeof(char *), "get_strings");
+    *strsp = strs;
+    *countp = 0;
+    for (size_t i = 0; i < count; i++) {
+        uint64_t n;
+        if (!get_leb128(p, len, pos, &n) || n > len - *pos)
+            return false;
+        strs[i] = malloc_or_fail(n + 1, "get_strings");
+        memcpy(strs[i], p + *pos, n);
+        strs[i][n] = '\0';
+        *pos += n;
+        *countp = i + 1;
+    }
+    return true;
+}
+
+static void free_strings(char **strs, size_t count) {
+    for (size_t i = 0; i < count; i++)
+        free(strs[i]);
+    free(strs);
+}
+
+/* Echo a command as if it had been read from a trace file */
+static void echo_cmd(int argc, char *argv[]) {
+    report_noreturn(1, prompt);
+    for (int i = 0; i < argc; i++)
+        report_noreturn(1, i + 1 < argc ? "%s " : "%s", argv[i]);
+    report_noreturn(1, "\n");
+}
+
+/*
+  Run a compiled trace.  Files pushed by its source commands are run as
+  usual before the next compiled command.
+*/
+static bool run_compiled(const char *path) {
+    FILE *fp = fopen(path, "rb");
+    bytes_t file = {NULL, 0, 0};
+    uint8_t chunk[65536];
+    size_t n;
+    while (fp && (n = fread(chunk, 1, sizeof(chunk), fp)) > 0)
+        put_bytes(&file, chunk, n);
+    if (fp)
+        fclose(fp);
+
+    char **names = NULL, **strs = NULL;
+    size_t nnames = 0, nstrs = 0;
+    uint64_t ncode = 0;
+    size_t pos = sizeof(compiled_magic);
+    bool ok = fp && file.len >= pos &&
+              get_strings(file.p, file.len, &pos, &names, &nnames) &&
+              get_strings(file.p, file.len, &pos, &strs, &nstrs) &&
+              get_leb128(file.p, file.len, &pos, &ncode);
+    if (!ok) {
+        report(1, "ERROR: Could not read compiled trace '%s'", path);
+        free_strings(names, nnames);
+        free_strings(strs, nstrs);
+        free(file.p);
+        return false;
+    }
+
+    /* Resolve every command once */
+    cmd_function *dispatch = calloc_or_fail(
+        nnames ? nnames : 1, sizeof(cmd_function), "run_compiled");
+    for (size_t i = 0; i < nnames; i++) {
+        cmd_ptr c = find_cmd(names[i]);
+        dispatch[i] = c ? c->operation : NULL;
+    }
+
+    size_t argv_cap = 16;
+    char **argv = malloc_or_fail(argv_cap * sizeof(char *), "run_compiled");
+    for (uint64_t k = 0; k < ncode && !quit_flag; k++) {
+        uint64_t cmd, nargs, arg;
+        if (!get_leb128(file.p, file.len, &pos, &cmd) || cmd > nnames) {
+            report(1, "ERROR: Compiled trace '%s' is corrupt", path);
+            record_error();
+            break;
+        }
+        if (cmd == 0) {
+            if (echo)
+                echo_cmd(0, NULL);
+            continue;
+        }
+        cmd--;
+        if (!get_leb128(file.p, file.len, &pos, &nargs) ||
+            nargs > file.len - pos) {
+            report(1, "ERROR: Compiled trace '%s' is corrupt", path);
+            record_error();
+            break;
+        }
+        if (nargs + 1 > argv_cap) {
+            argv_cap = (size_t)nargs + 1;
+            argv = realloc_or_fail(argv, argv_cap * sizeof(char *),
+                                   "run_compiled");
+        }
+        argv[0] = names[cmd];
+        bool valid = true;
+        for (size_t i = 1; valid && i <= nargs; i++) {
+            valid = get_leb128(file.p, file.len, &pos, &arg) && arg < nstrs;
+            argv[i] = valid ? strs[arg] : NULL;
+        }
+        if (!valid) {
+            report(1, "ERROR: Compiled trace '%s' is corrupt", path);
+            record_error();
+            break;
+        }
+        int argc = (int)nargs + 1;
+        if (echo)
+            echo_cmd(argc, argv);
+        if (collecting())
+            collect_line(argc, argv);
+        else
+            run_operation(dispatch[cmd], argc, argv);
+        while (!cmd_done())
+            cmd_select(0, NULL, NULL, NULL, NULL);
+    }
+    free(argv);
+    free(dispatch);
+    free_strings(names, nnames);
+    free_strings(strs, nstrs);
+    free(file.p);
+    return err_cnt == 0;
+}
+
 bool run_console(char *infile_name) {
+    if (is_compiled(infile_name))
+        return run_compiled(infile_name);
     if (!push_file(infile_name)) {
         report(1, "ERROR: Could not open source file '%s'", infile_name);
         return false;
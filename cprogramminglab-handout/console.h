@@ -36,6 +36,8 @@ struct PELE {
     const char *documentation;
     /* Function that gets called whenever parameter changes */
     setter_function setter;
+    /* Names for values 0, 1, ..., ending with NULL, or NULL for none */
+    const char *const *choices;
     param_ptr next;
 };
 
@@ -50,9 +52,19 @@ void add_cmd(const char *name, cmd_function operation,
 void add_param(const char *name, int *valp, const char *documentation,
                setter_function setter);
 
+/*
+  Add a new parameter that can also be set by name.  choices lists the
+  names of values 0, 1, ... and ends with NULL.
+*/
+void add_param_choices(const char *name, int *valp, const char *documentation,
+                       setter_function setter, const char *const *choices);
+
 /* Execute a command from a command line */
 bool interpret_cmd(char *cmdline);
 
+/* Execute a command already split into arguments */
+bool interpret_cmda(int argc, char *argv[]);
+
 /* Execute a sequence of commands read from a file */
 bool interpret_file(FILE *fp);
 
@@ -62,6 +74,16 @@ bool get_int(char *vname, int *loc);
 /* Add function to be executed as part of program exit */
 void add_quit_helper(cmd_function qf);
 
+/*
+  Function called while the console waits for input.  Returns the number
+  of microseconds it may wait before the function must be called again,
+  or a negative number if it has nothing to wait for.
+*/
+typedef long (*idle_function)(void);
+
+/* Set function to be called while waiting for input (NULL: none) */
+void set_idle_helper(idle_function idle);
+
 /* Set prompt */
 void set_prompt(char *prompt);
 
@@ -107,7 +129,16 @@ int cmd_select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds,
                struct timeval *timeout);
 
 /* Run command loop.  Non-null infile_name implies read commands from that file
+   (a trace file, or one compiled by compile_cmd_file)
  */
 bool run_console(char *infile_name);
 
+/*
+  Compile the commands of a trace file into a compact bytecode file:
+  command names are looked up once per run rather than once per command,
+  and arguments are stored once however often they recur.  Return false
+  if a file can't be read or written.
+*/
+bool compile_cmd_file(const char *in_name, const char *out_name);
+
 #endif /* console.h */
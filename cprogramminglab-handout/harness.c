@@ -1,16 +1,29 @@
 /* Test support code */
 
 #define _XOPEN_SOURCE 700
+/* For dladdr */
+#define _GNU_SOURCE
 /* Our program needs to use regular malloc/free */
 #define INTERNAL 1
 
 #include "harness.h"
 #include "report.h"
 
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <time.h>
 #include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
 /* A few functions in this file intentionally don't use their
    arguments.  */
@@ -18,61 +31,1217 @@
 
 /** Special values **/
 
+/* Value at start of every allocated block */
+#define MAGICHEADER 0xdeadbeefU
+/* Value at start of an allocated block that ends at a guard page */
+#define MAGICGUARD 0xdeadfeedU
+/* Value written into header when block is freed */
+#define MAGICFREE 0xffffffffU
+/* Value at end of every block */
+#define MAGICFOOTER 0xbeefdeadU
+
 /* Byte to fill newly malloced space with */
 #define FILLCHAR 0x55
+/* Byte to fill freed space with */
+#define FREECHAR 0x66
+/* Byte to fill the gap between a guarded block and its guard page with */
+#define GAPCHAR 0x77
+
+/* Slots in the live-block table when first allocated */
+#define MIN_TABLE 1024
+
+/* Seed used until set_fail_seed is called */
+#define DEFAULT_SEED 0x2545F4914F6CDD1DULL
+
+/* Magic number starting a failure bitmap file */
+#define BITMAP_MAGIC 0x504D544D4C494146ULL
+
+/* Return addresses each thread remembers the site of */
+#define SITE_CACHE 64
+/* Sites whose live blocks are counted; later sites count as unknown */
+#define MAX_SITES 1024
+/* Sites listed by report_leaks */
+#define LEAK_SITES 10
+
+/* Memory the arena and slab allocators map at a time */
+#define CHUNK_BYTES (1 << 20)
+/* Size of a huge page, and of the chunks of the hugepage allocator */
+#define HUGE_PAGE_BYTES (2 << 20)
+/* Blocks up to this size come from slab size classes, 16 bytes apart */
+#define SLAB_MAX 1024
+#define SLAB_CLASSES (SLAB_MAX / 16)
 
 /** Data structures used by our code **/
 
-static size_t allocated_count = 0;
+/*
+  Each allocated block is laid out as
+      [ block_hdr_t ][ payload of size bytes ][ uint32 footer ]
+  The header keeps the payload 16-byte aligned.  A guarded block has its
+  own mapping and is laid out as
+      [ block_hdr_t ][ payload ][ gap of 0-15 bytes ][ PROT_NONE page ]
+  so that a write past the payload faults, or at least spoils the gap.
+*/
+typedef struct {
+    size_t size;    /* Bytes requested by the caller */
+    uint32_t magic; /* MAGICHEADER (MAGICGUARD if guarded) while allocated */
+    uint32_t site;  /* Where it was allocated, or 0 if unknown */
+} block_hdr_t;
+
+/*
+  Allocation sites: the return address of test_malloc, optionally with
+  the return addresses of a few frames further up.  Each distinct site
+  is stored once and numbered from 1, so blocks only keep the number.
+  Threads remember the numbers of recent return addresses, so the table
+  and its lock are only needed for a new site or a deeper backtrace.
+  Each thread also counts the live blocks and bytes of every site, which
+  is all report_leaks needs.
+*/
+typedef struct {
+    void *frames[SITE_FRAMES]; /* Innermost first */
+    size_t depth;
+} alloc_site_t;
+
+/* Site number i is sites[i - 1].  Guarded by site_lock */
+static alloc_site_t *sites = NULL;
+static size_t nsites = 0;
+static size_t sites_cap = 0;
+/* Open-addressing index of sites by their frames.  0 is an empty slot */
+static uint32_t *site_index = NULL;
+static size_t site_slots = 0;
+static pthread_mutex_t site_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Frames recorded per site */
+static size_t site_depth = 1;
+
+/*
+  Live blocks, grouped by the page holding their payload address.  Each
+  entry of an open-addressing table (linear probing) keeps one bit for
+  every 16-byte unit of its page; payloads are 16-byte aligned, so each
+  live block sets exactly one bit.  Grouping keeps the table small and
+  lets blocks allocated together share a cache line, so lookups stay O(1)
+  and cheap however many blocks are live.
+
+  Threads update the table without a lock.  A page is claimed for an
+  empty slot with compare-and-swap and bits are set and cleared with
+  atomic or/and, so of two threads freeing the same block only one sees
+  its bit set.  Entries are never deleted while threads are using the
+  table; entries whose pages have no live blocks are dropped when the
+  table is rebuilt, which a thread does once half the slots are claimed.
+  A rebuild waits until no thread is inside the table (see table_enter).
+*/
+#define PAGE_SHIFT 12
+#define UNIT_SHIFT 4
+#define UNITS_PER_PAGE (1 << (PAGE_SHIFT - UNIT_SHIFT))
+
+typedef struct {
+    _Atomic uintptr_t page; /* Page number, or 0 for an empty slot */
+    _Atomic uint64_t bits[UNITS_PER_PAGE / 64];
+} live_page_t;
+
+/* Only changed by a rebuild, while no thread is inside the table */
+static live_page_t *live_table = NULL;
+static size_t live_slots = 0; /* Always a power of two */
+
+static atomic_size_t live_pages = 0; /* Slots claimed */
+static atomic_bool rebuilding = false;
+/* Held for the whole of a rebuild */
+static pthread_mutex_t rebuild_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+  Everything a thread changes as it allocates and frees.  Each thread
+  only writes its own state, so the allocation functions need no lock;
+  queries add up the states of every thread.  A thread's state is handed
+  on to the next new thread once it exits, so its counts are kept.
+*/
+typedef struct thread_state {
+    alloc_stats_t stats;
+    lat_hist_t lat_hists[LAT_OPS]; /* Filled while latency_mode is set */
+    uint64_t rng_state; /* State of the xorshift generator for failures */
+    struct {
+        void *ra;
+        uint32_t site;
+    } site_cache[SITE_CACHE]; /* Sites of recent return addresses */
+    /*
+      Live blocks and bytes by site number, 0 for unknown.  A block freed
+      by another thread is taken off that thread's counts, so only the
+      sums over all threads mean anything.
+    */
+    size_t site_blocks[MAX_SITES];
+    size_t site_bytes[MAX_SITES];
+    atomic_bool error;    /* Error since last error_check */
+    atomic_bool in_table; /* Inside the live-block table */
+    /* Memory carved up by the arena, slab and hugepage allocators */
+    char *bump; /* Next free byte of the current chunk */
+    char *bump_end;
+    void *slab_free[SLAB_CLASSES]; /* Freed blocks of each size class */
+    size_t since_guard;            /* Allocations since the last guarded */
+    bool in_use;          /* Owned by a running thread */
+    struct thread_state *next;
+} thread_state_t;
+
+/* Every thread state, guarded by registry_lock */
+static thread_state_t *threads = NULL;
+static size_t nthreads = 0;
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+/*
+  Set after a thread's error flag, so error_check finds no errors
+  without taking the lock or visiting each thread
+*/
+static atomic_bool any_error = false;
+
+/* This thread's state, or NULL before its first allocation */
+static _Thread_local thread_state_t *self = NULL;
+/* Key whose destructor releases the state of an exiting thread */
+static pthread_key_t state_key;
+static pthread_once_t state_key_once = PTHREAD_ONCE_INIT;
+
+static bool latency_mode = false;
+/* Cycle counter and clock when latency_mode was last set */
+static uint64_t lat_start_cycles = 0;
+static uint64_t lat_start_ns = 0;
 /* Percent probability of malloc failure */
 int fail_probability = 0;
+/* Blocks are entered in the live-block table only in cautious mode */
 static bool cautious_mode = true;
 static bool noallocate_mode = false;
-static bool error_occurred = false;
-static const unsigned int time_limit = 1;
+
+/*
+  Time budgets of tested operations.  Operations are only timed by the
+  main thread, so none of this needs a lock.  The message printed when a
+  budget runs out is built when the budget is set, as the signal handler
+  can't format it.
+*/
+static unsigned time_budget[TIME_CLASSES] = {
+    DEFAULT_BUDGET_MS, DEFAULT_BUDGET_MS, DEFAULT_BUDGET_MS,
+    DEFAULT_BUDGET_MS, DEFAULT_BUDGET_MS, DEFAULT_BUDGET_MS};
+static char budget_message[TIME_CLASSES][80];
+static unsigned time_warning = 0; /* Percent of budget that warns, or 0 */
+static bool time_reports = false;  /* Report every operation's share */
+static time_usage_t time_usage_of[TIME_CLASSES];
+static timer_t op_timer;
+static bool op_timer_made = false;
+static volatile sig_atomic_t timed_class = TIME_ALLOC;
+static uint64_t timed_start_ns = 0;
+
+const char *const time_class_names[TIME_CLASSES + 1] = {
+    "alloc", "insert", "remove", "reverse", "size", "search", NULL};
+
+/*
+  Byte budget for live blocks, or 0 for none.  Bytes charged against it
+  are only counted while there is a budget, in one shared counter.
+*/
+static size_t mem_budget = 0;
+static bool mem_pressure = false;
+static atomic_size_t budget_used = 0;
+
+/* Every guard_interval-th allocation of a thread is guarded, 0 for none */
+static size_t guard_interval = 0;
+
+/*
+  Allocation trace being recorded, guarded by trace_lock.  It is only
+  written to when trace_active is set.  trace_ids maps the address of
+  each live block recorded to its number, with linear probing; numbers
+  of freed blocks are kept on trace_free_ids for reuse.
+*/
+typedef struct {
+    const void *p; /* NULL for an empty slot */
+    uint32_t id;
+} trace_id_t;
+
+static atomic_bool trace_active = false;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *trace_fp = NULL;
+static bool trace_ok = false;    /* Nothing lost so far */
+static uint64_t trace_last_ns = 0;
+static size_t trace_events = 0;
+static trace_id_t *trace_ids = NULL;
+static size_t trace_slots = 0;   /* Always a power of two */
+static size_t trace_live = 0;    /* Slots in use */
+static uint32_t *trace_free_ids = NULL;
+static size_t trace_nfree = 0;
+static size_t trace_free_cap = 0;
+static uint32_t trace_next_id = 0;
+
+/* Seed of the first thread's generator; later threads derive theirs */
+static uint64_t fail_seed = DEFAULT_SEED;
+
+/*
+  Failure schedules are shared by all threads and guarded by
+  schedule_lock.  They are only consulted when schedule_active is set.
+*/
+static atomic_bool schedule_active = false;
+static pthread_mutex_t schedule_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t fail_nth = 0;   /* Allocations left until forced failure */
+static size_t fail_above = 0; /* Size limit, or 0 */
+
+/* Bitmap of failure decisions being recorded or replayed */
+static uint8_t *bitmap = NULL;
+static size_t bitmap_bits = 0; /* Bits recorded, or bits to replay */
+static size_t bitmap_cap = 0;  /* Bytes allocated for bitmap */
+static size_t replay_pos = 0;
+static bool recording = false;
+static bool replaying = false;
 
 /*
   Internal functions
  */
+/* Generator seed of the nth thread to use the harness */
+static uint64_t thread_seed(size_t n) {
+    if (n == 0)
+        return fail_seed;
+    /* splitmix64 spreads consecutive seeds over the whole state */
+    uint64_t z = fail_seed + n * 0x9E3779B97F4A7C15ULL;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    z ^= z >> 31;
+    return z ? z : DEFAULT_SEED;
+}
+
+/* Destructor of state_key: let a new thread take over the state */
+static void release_state(void *arg) {
+    thread_state_t *t = arg;
+    pthread_mutex_lock(&registry_lock);
+    t->in_use = false;
+    pthread_mutex_unlock(&registry_lock);
+}
+
+static void make_state_key(void) {
+    pthread_key_create(&state_key, release_state);
+}
+
+/* Give the calling thread a state: a released one, or a new one */
+static thread_state_t *register_thread(void) {
+    pthread_once(&state_key_once, make_state_key);
+    pthread_mutex_lock(&registry_lock);
+    thread_state_t *t = threads;
+    while (t && t->in_use)
+        t = t->next;
+    if (!t) {
+        t = calloc(1, sizeof(thread_state_t));
+        if (!t) {
+            pthread_mutex_unlock(&registry_lock);
+            report_event(MSG_FATAL, "Couldn't allocate any more memory");
+            exit(1);
+        }
+        t->rng_state = thread_seed(nthreads++);
+        t->next = threads;
+        threads = t;
+    }
+    t->in_use = true;
+    pthread_mutex_unlock(&registry_lock);
+    pthread_setspecific(state_key, t);
+    self = t;
+    return t;
+}
+
+/* State of the calling thread */
+static thread_state_t *state(void) {
+    thread_state_t *t = self;
+    if (__builtin_expect(t == NULL, 0))
+        t = register_thread();
+    return t;
+}
+
+/* Next number from a thread's xorshift64* generator */
+static uint64_t next_random(thread_state_t *t) {
+    t->rng_state ^= t->rng_state >> 12;
+    t->rng_state ^= t->rng_state << 25;
+    t->rng_state ^= t->rng_state >> 27;
+    return t->rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+/*
+  Random failure decision.  The generator only advances while failures
+  are on, so turning them off does not shift a replayed sequence.
+  fail_probability is kept within 0..100 by whoever sets it.
+*/
+static bool random_failure(thread_state_t *t) {
+    int percent = fail_probability;
+    if (__builtin_expect(percent <= 0, 1))
+        return false;
+    /* Percent scaled to the generator's range */
+    return next_random(t) < (uint64_t)percent * (UINT64_MAX / 100);
+}
+
+/* Call with schedule_lock held */
+static void update_schedule(void) {
+    atomic_store(&schedule_active,
+                 fail_nth || fail_above || recording || replaying);
+}
+
+/* Append one decision to the bitmap being recorded */
+static void record_decision(bool fail) {
+    if (bitmap_bits / 8 == bitmap_cap) {
+        size_t cap = bitmap_cap ? 2 * bitmap_cap : 4096;
+        uint8_t *b = realloc(bitmap, cap);
+        if (!b) {
+            report_event(MSG_WARN, "Out of memory recording failures");
+            recording = false;
+            update_schedule();
+            return;
+        }
+        memset(b + bitmap_cap, 0, cap - bitmap_cap);
+        bitmap = b;
+        bitmap_cap = cap;
+    }
+    if (fail)
+        bitmap[bitmap_bits / 8] |= (uint8_t)(1 << (bitmap_bits % 8));
+    bitmap_bits++;
+}
+
+/* Failure decision when a schedule, recording or replay is active */
+static bool scheduled_failure(thread_state_t *t, size_t size) {
+    bool fail;
+    pthread_mutex_lock(&schedule_lock);
+    if (replaying) {
+        fail = replay_pos < bitmap_bits &&
+               (bitmap[replay_pos / 8] >> (replay_pos % 8)) & 1;
+        replay_pos++;
+    } else {
+        fail = random_failure(t);
+        if (fail_nth && --fail_nth == 0) {
+            fail = true;
+            update_schedule();
+        }
+        if (fail_above && size > fail_above)
+            fail = true;
+    }
+    if (recording)
+        record_decision(fail);
+    pthread_mutex_unlock(&schedule_lock);
+    return fail;
+}
+
+/* Record an error of thread t for error_check */
+static void flag_error(thread_state_t *t) {
+    atomic_store_explicit(&t->error, true, memory_order_relaxed);
+    atomic_store_explicit(&any_error, true, memory_order_release);
+}
+
+/* Home slot of a page in a table of slots slots */
+static size_t live_hash(uintptr_t page, size_t slots) {
+    uint64_t h = (uint64_t)page * 0x9E3779B97F4A7C15ULL;
+    return (size_t)(h >> 32) & (slots - 1);
+}
+
+/*
+  Announce that a thread is about to use the live-block table.  Return
+  false, after waiting for it to finish, if a rebuild was under way.
+  The flag is stored before rebuilding is read and the rebuilder does the
+  opposite, so at least one of them sees the other.
+*/
+static bool table_enter(thread_state_t *t) {
+    atomic_store(&t->in_table, true);
+    if (!atomic_load(&rebuilding))
+        return true;
+    atomic_store_explicit(&t->in_table, false, memory_order_release);
+    pthread_mutex_lock(&rebuild_lock);
+    pthread_mutex_unlock(&rebuild_lock);
+    return false;
+}
+
+static void table_leave(thread_state_t *t) {
+    atomic_store_explicit(&t->in_table, false, memory_order_release);
+}
+
+/*
+  Rebuild the live-block table without its empty entries, sized for a
+  load of at most 1/4.  Called outside the table, once it is half full.
+  Return false if out of memory, keeping the old table.
+*/
+static bool live_rebuild(void) {
+    pthread_mutex_lock(&rebuild_lock);
+    if (live_slots && 2 * atomic_load(&live_pages) <= live_slots) {
+        /* Another thread got here first */
+        pthread_mutex_unlock(&rebuild_lock);
+        return true;
+    }
+    pthread_mutex_lock(&registry_lock);
+    atomic_store(&rebuilding, true);
+    for (thread_state_t *t = threads; t; t = t->next) {
+        while (atomic_load(&t->in_table))
+            sched_yield();
+    }
+
+    size_t used = 0;
+    for (size_t i = 0; i < live_slots; i++) {
+        for (size_t w = 0; w < UNITS_PER_PAGE / 64; w++) {
+            if (atomic_load_explicit(&live_table[i].bits[w],
+                                     memory_order_relaxed)) {
+                used++;
+                break;
+            }
+        }
+    }
+    size_t slots = MIN_TABLE;
+    while (slots < 4 * used)
+        slots *= 2;
+    live_page_t *table = calloc(slots, sizeof(live_page_t));
+    if (table) {
+        for (size_t i = 0; i < live_slots; i++) {
+            live_page_t *e = &live_table[i];
+            uint64_t bits[UNITS_PER_PAGE / 64];
+            bool live = false;
+            for (size_t w = 0; w < UNITS_PER_PAGE / 64; w++) {
+                bits[w] = atomic_load_explicit(&e->bits[w],
+                                               memory_order_relaxed);
+                live = live || bits[w];
+            }
+            if (!live)
+                continue;
+            uintptr_t page =
+                atomic_load_explicit(&e->page, memory_order_relaxed);
+            size_t j = live_hash(page, slots);
+            while (atomic_load_explicit(&table[j].page, memory_order_relaxed))
+                j = (j + 1) & (slots - 1);
+            atomic_store_explicit(&table[j].page, page, memory_order_relaxed);
+            for (size_t w = 0; w < UNITS_PER_PAGE / 64; w++)
+                atomic_store_explicit(&table[j].bits[w], bits[w],
+                                      memory_order_relaxed);
+        }
+        free(live_table);
+        live_table = table;
+        live_slots = slots;
+        atomic_store(&live_pages, used);
+    }
+
+    atomic_store(&rebuilding, false);
+    pthread_mutex_unlock(&registry_lock);
+    pthread_mutex_unlock(&rebuild_lock);
+    return table != NULL;
+}
+
+/* Word and bit of the live-block table entry covering p */
+static size_t unit_word(const void *p) {
+    return ((uintptr_t)p >> (UNIT_SHIFT + 6)) % (UNITS_PER_PAGE / 64);
+}
+
+static uint64_t unit_bit(const void *p) {
+    return (uint64_t)1 << (((uintptr_t)p >> UNIT_SHIFT) % 64);
+}
+
+/* Entry for page, or NULL if it has none.  Call inside the table */
+static live_page_t *live_lookup(uintptr_t page) {
+    size_t mask = live_slots - 1;
+    size_t i = live_hash(page, live_slots);
+    for (size_t n = 0; n < live_slots; n++, i = (i + 1) & mask) {
+        uintptr_t cur =
+            atomic_load_explicit(&live_table[i].page, memory_order_relaxed);
+        if (cur == page)
+            return &live_table[i];
+        if (cur == 0)
+            return NULL;
+    }
+    return NULL;
+}
+
+/*
+  Entry for page, claiming an empty slot for it if it has none.  Set
+  *full if the table needs a rebuild.  NULL if every slot is taken.
+  Call inside the table.
+*/
+static live_page_t *live_claim(uintptr_t page, bool *full) {
+    size_t mask = live_slots - 1;
+    size_t i = live_hash(page, live_slots);
+    *full = false;
+    for (size_t n = 0; n < live_slots; n++, i = (i + 1) & mask) {
+        uintptr_t cur =
+            atomic_load_explicit(&live_table[i].page, memory_order_relaxed);
+        if (cur == 0 && atomic_compare_exchange_strong_explicit(
+                            &live_table[i].page, &cur, page,
+                            memory_order_relaxed, memory_order_relaxed)) {
+            *full = 2 * (atomic_fetch_add(&live_pages, 1) + 1) > live_slots;
+            return &live_table[i];
+        }
+        /* A failed claim leaves the winner's page in cur */
+        if (cur == page)
+            return &live_table[i];
+    }
+    *full = true;
+    return NULL;
+}
+
+/* Add a payload address to the live-block table */
+static bool live_insert(thread_state_t *t, const void *p) {
+    uintptr_t page = (uintptr_t)p >> PAGE_SHIFT;
+    for (;;) {
+        if (!table_enter(t))
+            continue;
+        live_page_t *e = NULL;
+        bool full = true;
+        if (live_slots)
+            e = live_claim(page, &full);
+        if (e)
+            atomic_fetch_or_explicit(&e->bits[unit_word(p)], unit_bit(p),
+                                     memory_order_relaxed);
+        table_leave(t);
+        if (full && !live_rebuild())
+            return e != NULL;
+        if (e)
+            return true;
+    }
+}
+
+/* Remove a payload address.  Return false if it was not live */
+static bool live_remove(thread_state_t *t, const void *p) {
+    while (!table_enter(t))
+        ;
+    bool was_live = false;
+    if (live_slots) {
+        live_page_t *e = live_lookup((uintptr_t)p >> PAGE_SHIFT);
+        if (e) {
+            uint64_t bit = unit_bit(p);
+            was_live = (atomic_fetch_and_explicit(&e->bits[unit_word(p)], ~bit,
+                                                  memory_order_relaxed) &
+                        bit) != 0;
+        }
+    }
+    table_leave(t);
+    return was_live;
+}
+
+/* Bytes of a block with a payload of size bytes */
+static size_t block_bytes(size_t size) {
+    return sizeof(block_hdr_t) + size + sizeof(uint32_t);
+}
+
+static block_hdr_t *header_of(void *p) {
+    return (block_hdr_t *)p - 1;
+}
+
+static size_t page_bytes(void) {
+    return (size_t)sysconf(_SC_PAGESIZE);
+}
+
+/* Bytes between the payload of a guarded block and its guard page */
+static size_t guard_gap(const block_hdr_t *b) {
+    uintptr_t end = (uintptr_t)(b + 1) + b->size;
+    return (size_t)(-end & (page_bytes() - 1));
+}
+
+static void write_footer(block_hdr_t *b) {
+    if (b->magic == MAGICGUARD) {
+        memset((char *)(b + 1) + b->size, GAPCHAR, guard_gap(b));
+        return;
+    }
+    uint32_t footer = MAGICFOOTER;
+    memcpy((char *)(b + 1) + b->size, &footer, sizeof(footer));
+}
+
+static bool footer_ok(const block_hdr_t *b) {
+    if (b->magic == MAGICGUARD) {
+        const char *gap = (const char *)(b + 1) + b->size;
+        for (size_t i = 0; i < guard_gap(b); i++)
+            if (gap[i] != GAPCHAR)
+                return false;
+        return true;
+    }
+    uint32_t footer;
+    memcpy(&footer, (const char *)(b + 1) + b->size, sizeof(footer));
+    return footer == MAGICFOOTER;
+}
+
+/*
+  Map a block whose payload ends as close to a PROT_NONE page as 16-byte
+  alignment allows, so it ends exactly there if size is a multiple of 16.
+  Payloads must stay aligned for the live-block table.  NULL if the
+  mapping can't be made, e.g. once the kernel's limit on mappings is hit.
+*/
+static block_hdr_t *guarded_alloc(size_t size) {
+    size_t page = page_bytes();
+    size_t need = sizeof(block_hdr_t) + size + 15;
+    if (size > SIZE_MAX - 2 * page - sizeof(block_hdr_t) - 15)
+        return NULL;
+    size_t bytes = (need + page - 1) / page * page;
+    char *base = mmap(NULL, bytes + page, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED)
+        return NULL;
+    if (mprotect(base + bytes, page, PROT_NONE) != 0) {
+        munmap(base, bytes + page);
+        return NULL;
+    }
+    uintptr_t payload = ((uintptr_t)(base + bytes) - size) & ~(uintptr_t)15;
+    return (block_hdr_t *)payload - 1;
+}
+
+/*
+  Unmap a guarded block.  The header is on the mapping's first page, so
+  later reads and writes through stale pointers fault too.
+*/
+static void guarded_release(block_hdr_t *b) {
+    size_t page = page_bytes();
+    uintptr_t base = (uintptr_t)b & ~(uintptr_t)(page - 1);
+    uintptr_t end = (uintptr_t)(b + 1) + b->size + guard_gap(b);
+    munmap((void *)base, end - base + page);
+}
+
+/* Should this allocation be guarded? */
+static bool guard_next(thread_state_t *t) {
+    if (!guard_interval || ++t->since_guard < guard_interval)
+        return false;
+    t->since_guard = 0;
+    return true;
+}
+
+/*
+  Allocators that blocks get their memory from.  The bookkeeping around
+  them (headers, fill, counts, failure injection) is the same for all.
+  Requests are for whole blocks: header, payload and footer.
+*/
+typedef struct {
+    void *(*alloc)(thread_state_t *t, size_t bytes);
+    void (*release)(thread_state_t *t, void *p, size_t bytes);
+    bool huge; /* Map chunks on huge pages */
+} allocator_t;
+
+const char *const allocator_names[ALLOC_KINDS + 1] = {
+    "system", "arena", "slab", "hugepage", NULL};
+
+/* Mappings made for the current allocator, guarded by chunk_lock */
+typedef struct {
+    void *base;
+    size_t bytes;
+} mapping_t;
+
+static mapping_t *mappings = NULL;
+static size_t nmappings = 0;
+static size_t mappings_cap = 0;
+static pthread_mutex_t chunk_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+  Map bytes (a multiple of the page size, or of HUGE_PAGE_BYTES if huge)
+  of fresh memory.  Huge pages come from the reserved pool if there is
+  one, or else as transparent huge pages, which need 2 MB alignment.
+*/
+static void *map_memory(size_t bytes, bool huge) {
+    int prot = PROT_READ | PROT_WRITE;
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    if (!huge) {
+        void *p = mmap(NULL, bytes, prot, flags, -1, 0);
+        return p == MAP_FAILED ? NULL : p;
+    }
+    void *p = mmap(NULL, bytes, prot, flags | MAP_HUGETLB, -1, 0);
+    if (p != MAP_FAILED)
+        return p;
+    char *raw = mmap(NULL, bytes + HUGE_PAGE_BYTES, prot, flags, -1, 0);
+    if (raw == MAP_FAILED)
+        return NULL;
+    size_t lead = (HUGE_PAGE_BYTES - (uintptr_t)raw % HUGE_PAGE_BYTES) %
+                  HUGE_PAGE_BYTES;
+    if (lead)
+        munmap(raw, lead);
+    munmap(raw + lead + bytes, HUGE_PAGE_BYTES - lead);
+    madvise(raw + lead, bytes, MADV_HUGEPAGE);
+    return raw + lead;
+}
+
+/* Map memory for the current allocator, to be unmapped when it changes */
+static void *new_mapping(size_t bytes, bool huge) {
+    size_t unit = huge ? HUGE_PAGE_BYTES : (size_t)sysconf(_SC_PAGESIZE);
+    if (bytes > SIZE_MAX - unit)
+        return NULL;
+    bytes = (bytes + unit - 1) / unit * unit;
+    pthread_mutex_lock(&chunk_lock);
+    void *p = NULL;
+    if (nmappings == mappings_cap) {
+        size_t cap = mappings_cap ? 2 * mappings_cap : 64;
+        mapping_t *m = realloc(mappings, cap * sizeof(mapping_t));
+        if (m) {
+            mappings = m;
+            mappings_cap = cap;
+        }
+    }
+    if (nmappings < mappings_cap)
+        p = map_memory(bytes, huge);
+    if (p)
+        mappings[nmappings++] = (mapping_t){p, bytes};
+    pthread_mutex_unlock(&chunk_lock);
+    return p;
+}
+
+/* Cut bytes (a multiple of 16) from the thread's current chunk */
+static void *carve(thread_state_t *t, size_t bytes, bool huge) {
+    size_t chunk = huge ? HUGE_PAGE_BYTES : CHUNK_BYTES;
+    if (bytes > chunk / 4)
+        return new_mapping(bytes, huge);
+    if ((size_t)(t->bump_end - t->bump) < bytes) {
+        char *c = new_mapping(chunk, huge);
+        if (!c)
+            return NULL;
+        t->bump = c;
+        t->bump_end = c + chunk;
+    }
+    void *p = t->bump;
+    t->bump += bytes;
+    return p;
+}
+
+static void *system_alloc(thread_state_t *t UNUSED, size_t bytes) {
+    return malloc(bytes);
+}
+
+static void system_release(thread_state_t *t UNUSED, void *p,
+                           size_t bytes UNUSED) {
+    free(p);
+}
+
+/* Bump allocation.  Freed memory is only reclaimed by set_allocator */
+static void *arena_alloc(thread_state_t *t, size_t bytes) {
+    return carve(t, (bytes + 15) & ~(size_t)15, false);
+}
+
+static void arena_release(thread_state_t *t UNUSED, void *p UNUSED,
+                          size_t bytes UNUSED) {
+}
+
+static size_t slab_class(size_t bytes) {
+    return (bytes + 15) / 16 - 1;
+}
+
+/*
+  Size classes with a free list per thread, refilled from chunks.  A
+  block freed by another thread joins that thread's list.  Blocks above
+  SLAB_MAX come from the system allocator.
+*/
+static void *slab_alloc_from(thread_state_t *t, size_t bytes, bool huge) {
+    if (bytes > SLAB_MAX)
+        return malloc(bytes);
+    size_t c = slab_class(bytes);
+    void *p = t->slab_free[c];
+    if (p) {
+        memcpy(&t->slab_free[c], p, sizeof(void *));
+        return p;
+    }
+    return carve(t, (c + 1) * 16, huge);
+}
+
+static void slab_release(thread_state_t *t, void *p, size_t bytes) {
+    if (bytes > SLAB_MAX) {
+        free(p);
+        return;
+    }
+    size_t c = slab_class(bytes);
+    memcpy(p, &t->slab_free[c], sizeof(void *));
+    t->slab_free[c] = p;
+}
+
+static void *slab_alloc(thread_state_t *t, size_t bytes) {
+    return slab_alloc_from(t, bytes, false);
+}
+
+/* The slab allocator, with chunks on huge pages */
+static void *huge_alloc(thread_state_t *t, size_t bytes) {
+    return slab_alloc_from(t, bytes, true);
+}
+
+static const allocator_t allocators[ALLOC_KINDS] = {
+    {system_alloc, system_release, false},
+    {arena_alloc, arena_release, false},
+    {slab_alloc, slab_release, false},
+    {huge_alloc, slab_release, true},
+};
+
+static const allocator_t *allocator = &allocators[ALLOC_SYSTEM];
+
+/* Hash of a site's frames */
+static uint64_t site_hash(void *const *frames, size_t depth) {
+    uint64_t h = depth;
+    for (size_t i = 0; i < depth; i++)
+        h = (h ^ (uint64_t)(uintptr_t)frames[i]) * 0x9E3779B97F4A7C15ULL;
+    return h ^ (h >> 29);
+}
+
+/* Index slot holding the site with these frames, or the empty slot */
+static size_t site_find(void *const *frames, size_t depth) {
+    size_t i = (size_t)site_hash(frames, depth) & (site_slots - 1);
+    for (;;) {
+        uint32_t id = site_index[i];
+        if (!id)
+            return i;
+        const alloc_site_t *s = &sites[id - 1];
+        if (s->depth == depth &&
+            memcmp(s->frames, frames, depth * sizeof(void *)) == 0)
+            return i;
+        i = (i + 1) & (site_slots - 1);
+    }
+}
+
+/* Double the site index.  Call with site_lock held */
+static bool site_grow_index(void) {
+    size_t slots = site_slots ? 2 * site_slots : 256;
+    uint32_t *index = calloc(slots, sizeof(uint32_t));
+    if (!index)
+        return false;
+    free(site_index);
+    site_index = index;
+    site_slots = slots;
+    for (size_t i = 0; i < nsites; i++)
+        site_index[site_find(sites[i].frames, sites[i].depth)] =
+            (uint32_t)(i + 1);
+    return true;
+}
+
+/* Number of the site with these frames, adding it if new.  0 if that fails */
+static uint32_t intern_site(void *const *frames, size_t depth) {
+    pthread_mutex_lock(&site_lock);
+    uint32_t id = 0;
+    if (2 * (nsites + 1) <= site_slots || site_grow_index()) {
+        size_t slot = site_find(frames, depth);
+        id = site_index[slot];
+        if (!id && nsites == sites_cap && sites_cap < UINT32_MAX / 2) {
+            size_t cap = sites_cap ? 2 * sites_cap : 256;
+            alloc_site_t *s = realloc(sites, cap * sizeof(alloc_site_t));
+            if (s) {
+                sites = s;
+                sites_cap = cap;
+            }
+        }
+        if (!id && nsites < sites_cap && nsites + 1 < MAX_SITES) {
+            alloc_site_t *s = &sites[nsites++];
+            memcpy(s->frames, frames, depth * sizeof(void *));
+            s->depth = depth;
+            id = (uint32_t)nsites;
+            site_index[slot] = id;
+        }
+    }
+    pthread_mutex_unlock(&site_lock);
+    return id;
+}
+
+/*
+  Site of an allocation whose test_malloc returns to ra, with a backtrace
+  of up to site_depth frames.  The backtrace is taken from the frame that
+  returns to ra, wherever that is after inlining.
+*/
+static uint32_t traced_site(void *ra, size_t depth) {
+    void *frames[SITE_FRAMES + 8];
+    int n = backtrace(frames, SITE_FRAMES + 8);
+    for (int i = 0; i < n; i++) {
+        if (frames[i] == ra) {
+            size_t avail = (size_t)(n - i);
+            return intern_site(frames + i, depth < avail ? depth : avail);
+        }
+    }
+    return intern_site(&ra, 1);
+}
+
+/* Site of an allocation whose test_malloc returns to ra */
+static uint32_t site_of(thread_state_t *t, void *ra) {
+    size_t depth = site_depth;
+    if (depth > 1)
+        return traced_site(ra, depth);
+    size_t i = (size_t)(((uint64_t)(uintptr_t)ra * 0x9E3779B97F4A7C15ULL) >>
+                        58) %
+               SITE_CACHE;
+    if (t->site_cache[i].ra == ra)
+        return t->site_cache[i].site;
+    uint32_t site = intern_site(&ra, 1);
+    if (site) {
+        t->site_cache[i].ra = ra;
+        t->site_cache[i].site = site;
+    }
+    return site;
+}
+
+/* Describe a code address as symbol+offset, or object file+offset */
+static void describe_frame(void *addr, char *buf, size_t size) {
+    Dl_info info;
+    if (dladdr(addr, &info) && info.dli_sname)
+        snprintf(buf, size, "%s+0x%lx", info.dli_sname,
+                 (size_t)((uintptr_t)addr - (uintptr_t)info.dli_saddr));
+    else if (dladdr(addr, &info) && info.dli_fname)
+        snprintf(buf, size, "%s+0x%lx", info.dli_fname,
+                 (size_t)((uintptr_t)addr - (uintptr_t)info.dli_fbase));
+    else
+        snprintf(buf, size, "%p", addr);
+}
+
+/* Cycle counter used to time allocations */
+static uint64_t read_cycles(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+/* Nanoseconds on the monotonic clock, to calibrate the cycle counter */
+static uint64_t read_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+/*
+  Histogram bucket for a latency.  Values below LAT_SUB get a bucket
+  each; above that, every power of two is split into LAT_SUB / 2 equal
+  buckets, so a bucket is never wider than 1/16 of its values.
+*/
+static size_t latency_bucket(uint64_t cycles) {
+    if (cycles < LAT_SUB)
+        return (size_t)cycles;
+    size_t shift = (size_t)(63 - __builtin_clzll(cycles)) - LAT_SUB_BITS + 1;
+    size_t top = (size_t)(cycles >> shift);
+    return LAT_SUB + (shift - 1) * (LAT_SUB / 2) + (top - LAT_SUB / 2);
+}
+
+static void record_latency(thread_state_t *t, lat_op_t op, uint64_t cycles) {
+    lat_hist_t *h = &t->lat_hists[op];
+    h->counts[latency_bucket(cycles)]++;
+    h->count++;
+    if (cycles > h->max)
+        h->max = cycles;
+}
+
+/*
+  A thread's live bytes go negative (wrap around) when it frees more than
+  it allocated, so they are compared as signed numbers.
+*/
+static bool bytes_above(size_t a, size_t b) {
+    return (ptrdiff_t)a > (ptrdiff_t)b;
+}
+
+/* Add a successful allocation to the thread's profile */
+static void record_malloc(thread_state_t *t, size_t size) {
+    alloc_stats_t *st = &t->stats;
+    size_t class = size ? (size_t)(64 - __builtin_clzll((uint64_t)size)) : 0;
+    st->classes[class]++;
+    st->mallocs++;
+    st->total_bytes += size;
+    st->live_blocks++;
+    st->live_bytes += size;
+    if (bytes_above(st->live_bytes, st->peak_bytes))
+        st->peak_bytes = st->live_bytes;
+    if (bytes_above(st->live_bytes, st->window_peak))
+        st->window_peak = st->live_bytes;
+}
+
+/*
+  Charge an allocation to the byte budget.  Return false, charging
+  nothing, if it has to fail: always when it would go over the budget,
+  and in pressure mode with a probability rising from 0 at half the
+  budget to 1 at the full budget.
+*/
+static bool budget_charge(thread_state_t *t, size_t size) {
+    if (size > mem_budget)
+        return false;
+    size_t used = atomic_fetch_add(&budget_used, size) + size;
+    bool fail = used > mem_budget;
+    if (!fail && mem_pressure && used > mem_budget / 2) {
+        /* Fraction of the way from half the budget to all of it */
+        double x = (double)(used - mem_budget / 2) /
+                   (double)(mem_budget - mem_budget / 2);
+        fail = (double)next_random(t) < x * x * (double)UINT64_MAX;
+    }
+    if (fail)
+        atomic_fetch_sub(&budget_used, size);
+    return !fail;
+}
+
+static void budget_release(size_t size) {
+    if (mem_budget)
+        atomic_fetch_sub(&budget_used, size);
+}
+
 /* Should this allocation fail? */
-static bool fail_allocation(void) {
-    double weight = (double)rand() / RAND_MAX;
-    return (weight < 0.01 * fail_probability);
+static bool fail_allocation(thread_state_t *t, size_t size) {
+    if (__builtin_expect(
+            atomic_load_explicit(&schedule_active, memory_order_relaxed), 0))
+        return scheduled_failure(t, size);
+    return random_failure(t);
+}
+
+/* Home slot of an address in trace_ids */
+static size_t trace_home(const void *p) {
+    uint64_t h = (uint64_t)(uintptr_t)p * 0x9E3779B97F4A7C15ULL;
+    return (size_t)(h >> 32) & (trace_slots - 1);
+}
+
+/* Slot holding p in trace_ids, or the empty slot where it would go */
+static size_t trace_find(const void *p) {
+    size_t i = trace_home(p);
+    while (trace_ids[i].p && trace_ids[i].p != p)
+        i = (i + 1) & (trace_slots - 1);
+    return i;
+}
+
+/* Double trace_ids.  Call with trace_lock held */
+static bool trace_grow(void) {
+    size_t slots = trace_slots ? 2 * trace_slots : 1024;
+    trace_id_t *ids = calloc(slots, sizeof(trace_id_t));
+    if (!ids)
+        return false;
+    trace_id_t *old = trace_ids;
+    size_t old_slots = trace_slots;
+    trace_ids = ids;
+    trace_slots = slots;
+    for (size_t i = 0; i < old_slots; i++)
+        if (old[i].p)
+            trace_ids[trace_find(old[i].p)] = old[i];
+    free(old);
+    return true;
+}
+
+/* Give p a block number and remember it.  Call with trace_lock held */
+static bool trace_number(const void *p, uint32_t *id) {
+    if (2 * (trace_live + 1) > trace_slots && !trace_grow())
+        return false;
+    if (trace_nfree)
+        *id = trace_free_ids[--trace_nfree];
+    else
+        *id = trace_next_id++;
+    size_t i = trace_find(p);
+    trace_ids[i].p = p;
+    trace_ids[i].id = *id;
+    trace_live++;
+    return true;
+}
+
+/*
+  Look up and forget the number of p, putting it up for reuse.  Return
+  false if p wasn't numbered.  Call with trace_lock held.
+*/
+static bool trace_unnumber(const void *p, uint32_t *id) {
+    if (!trace_slots)
+        return false;
+    size_t i = trace_find(p);
+    if (!trace_ids[i].p)
+        return false;
+    *id = trace_ids[i].id;
+    if (trace_nfree == trace_free_cap) {
+        size_t cap = trace_free_cap ? 2 * trace_free_cap : 1024;
+        uint32_t *f = realloc(trace_free_ids, cap * sizeof(uint32_t));
+        if (f) {
+            trace_free_ids = f;
+            trace_free_cap = cap;
+        }
+    }
+    /* Without room the number is just not reused */
+    if (trace_nfree < trace_free_cap)
+        trace_free_ids[trace_nfree++] = *id;
+    trace_live--;
+
+    /* Close the hole, moving back entries that probed past it */
+    size_t j = i;
+    for (;;) {
+        j = (j + 1) & (trace_slots - 1);
+        if (!trace_ids[j].p)
+            break;
+        size_t home = trace_home(trace_ids[j].p);
+        bool stays = i <= j ? (i < home && home <= j) : (i < home || home <= j);
+        if (!stays) {
+            trace_ids[i] = trace_ids[j];
+            i = j;
+        }
+    }
+    trace_ids[i].p = NULL;
+    return true;
+}
+
+/* Append v to buf as an unsigned LEB128 number.  Return its length */
+static size_t put_leb128(uint8_t *buf, uint64_t v) {
+    size_t n = 0;
+    while (v >= 0x80) {
+        buf[n++] = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    buf[n++] = (uint8_t)v;
+    return n;
+}
+
+/* Record an event of the block at p in the allocation trace */
+static void trace_event(atrace_op_t op, const void *p, size_t size) {
+    pthread_mutex_lock(&trace_lock);
+    uint32_t id;
+    bool known = op == ATRACE_FREE ? trace_unnumber(p, &id)
+                                   : trace_number(p, &id);
+    if (trace_fp && known) {
+        uint64_t now = read_ns();
+        uint8_t rec[1 + 3 * 10];
+        size_t n = 0;
+        rec[n++] = (uint8_t)op;
+        n += put_leb128(rec + n, now - trace_last_ns);
+        n += put_leb128(rec + n, id);
+        if (op != ATRACE_FREE)
+            n += put_leb128(rec + n, size);
+        trace_last_ns = now;
+        trace_ok = fwrite(rec, 1, n, trace_fp) == n && trace_ok;
+        trace_events++;
+    } else if (trace_fp && op != ATRACE_FREE) {
+        trace_ok = false;
+    }
+    pthread_mutex_unlock(&trace_lock);
 }
 
 /*
   Implementation of application functions
  */
-void *test_malloc(size_t size) {
+/*
+  test_malloc, without latency measurement.  The payload is filled with
+  fill once, so test_calloc doesn't pay for FILLCHAR before zeroing it.
+*/
+static void *malloc_block(thread_state_t *t, size_t size, void *ra,
+                          int fill) {
     if (noallocate_mode) {
         report_event(MSG_FATAL, "Calls to malloc disallowed");
         return NULL;
     }
-    if (fail_allocation()) {
+    if (fail_allocation(t, size)) {
         report_event(MSG_WARN, "Malloc returning NULL");
+        t->stats.failures++;
+        return NULL;
+    }
+    if (mem_budget && !budget_charge(t, size)) {
+        report_event(MSG_WARN, "Malloc returning NULL (memory budget)");
+        t->stats.failures++;
         return NULL;
     }
 
-    void *p = malloc(size);
-    if (p == NULL) {
+    /* Fall back to an ordinary block if a guarded one can't be mapped */
+    block_hdr_t *b = guard_next(t) ? guarded_alloc(size) : NULL;
+    bool guarded = b != NULL;
+    /* Leave room for allocators to round up */
+    if (!b && size <= SIZE_MAX - sizeof(block_hdr_t) - sizeof(uint32_t) - 15)
+        b = allocator->alloc(t, block_bytes(size));
+    if (b == NULL) {
+        budget_release(size);
         report_event(MSG_FATAL, "Couldn't allocate any more memory");
-        error_occurred = true;
-        return p;
+        flag_error(t);
+        return NULL;
+    }
+    b->size = size;
+    b->magic = guarded ? MAGICGUARD : MAGICHEADER;
+    b->site = site_depth ? site_of(t, ra) : 0;
+    write_footer(b);
+    void *p = b + 1;
+    if (cautious_mode && !live_insert(t, p)) {
+        budget_release(size);
+        if (guarded)
+            guarded_release(b);
+        else
+            allocator->release(t, b, block_bytes(size));
+        report_event(MSG_FATAL, "Couldn't allocate any more memory");
+        flag_error(t);
+        return NULL;
     }
-    memset(p, FILLCHAR, size);
-    allocated_count++;
+    memset(p, fill, size);
+    record_malloc(t, size);
+    t->site_blocks[b->site]++;
+    t->site_bytes[b->site] += size;
+    /* Only test_calloc asks for zeros */
+    if (atomic_load_explicit(&trace_active, memory_order_relaxed))
+        trace_event(fill ? ATRACE_MALLOC : ATRACE_CALLOC, p, size);
     return p;
 }
 
-void *test_calloc(size_t num, size_t size) {
+static void *calloc_block(thread_state_t *t, size_t num, size_t size,
+                          void *ra) {
     if (num > SIZE_MAX / size) {
         return NULL;
     }
-    void *mem = test_malloc(num * size);
-    if (mem != NULL) {
-        memset(mem, 0, num * size);
-    }
-    return mem;
+    return malloc_block(t, num * size, ra, 0);
 }
 
 void *test_realloc(void *ptr UNUSED, size_t size UNUSED) {
@@ -80,7 +1249,7 @@ void *test_realloc(void *ptr UNUSED, size_t size UNUSED) {
     return NULL;
 }
 
-void test_free(void *p) {
+static void free_block(thread_state_t *t, void *p) {
     if (noallocate_mode) {
         report_event(MSG_FATAL, "Calls to free disallowed");
         return;
@@ -89,12 +1258,441 @@ void test_free(void *p) {
         return;
     }
 
-    free(p);
-    allocated_count--;
+    /*
+      In cautious mode, the pointer is taken out of the live-block table
+      before its header is read.  That catches foreign pointers and double
+      frees without touching memory we don't own, even when two threads
+      free the same block at once.  Otherwise only the header and footer
+      are checked.
+    */
+    bool was_live = cautious_mode && live_remove(t, p);
+    if (cautious_mode && !was_live) {
+        report_event(MSG_ERROR,
+                     "Attempted to free unallocated block.  Address = %p", p);
+        flag_error(t);
+        return;
+    }
+    block_hdr_t *b = header_of(p);
+    if (b->magic != MAGICHEADER && b->magic != MAGICGUARD) {
+        /* Not freed after all, so leave it in the table */
+        if (was_live)
+            live_insert(t, p);
+        report_event(MSG_ERROR,
+                     "Attempted to free unallocated or corrupted block.  "
+                     "Address = %p",
+                     p);
+        flag_error(t);
+        return;
+    }
+    if (!footer_ok(b)) {
+        report_event(MSG_ERROR,
+                     "Corruption detected in block with address %p when "
+                     "attempting to free it",
+                     p);
+        flag_error(t);
+        /* Release it anyway, so the count of live blocks stays right */
+    }
+
+    /* Recorded while p can't be handed out again, to keep the order */
+    if (atomic_load_explicit(&trace_active, memory_order_relaxed))
+        trace_event(ATRACE_FREE, p, 0);
+    bool guarded = b->magic == MAGICGUARD;
+    b->magic = MAGICFREE;
+    budget_release(b->size);
+    t->stats.live_blocks--;
+    t->stats.live_bytes -= b->size;
+    t->stats.frees++;
+    /* A corrupted header may hold any site */
+    size_t site = b->site < MAX_SITES ? b->site : 0;
+    t->site_blocks[site]--;
+    t->site_bytes[site] -= b->size;
+    if (guarded) {
+        guarded_release(b);
+        return;
+    }
+    /* Spoil the payload, so later reads through p stand out */
+    if (cautious_mode)
+        memset(p, FREECHAR, b->size);
+    allocator->release(t, b, block_bytes(b->size));
+}
+
+void *test_malloc(size_t size) {
+    thread_state_t *t = state();
+    void *ra = __builtin_return_address(0);
+    if (__builtin_expect(!latency_mode, 1))
+        return malloc_block(t, size, ra, FILLCHAR);
+    uint64_t start = read_cycles();
+    void *p = malloc_block(t, size, ra, FILLCHAR);
+    record_latency(t, LAT_MALLOC, read_cycles() - start);
+    return p;
+}
+
+void *test_calloc(size_t num, size_t size) {
+    thread_state_t *t = state();
+    void *ra = __builtin_return_address(0);
+    if (__builtin_expect(!latency_mode, 1))
+        return calloc_block(t, num, size, ra);
+    uint64_t start = read_cycles();
+    void *p = calloc_block(t, num, size, ra);
+    record_latency(t, LAT_CALLOC, read_cycles() - start);
+    return p;
+}
+
+void test_free(void *p) {
+    thread_state_t *t = state();
+    if (__builtin_expect(!latency_mode, 1)) {
+        free_block(t, p);
+        return;
+    }
+    uint64_t start = read_cycles();
+    free_block(t, p);
+    record_latency(t, LAT_FREE, read_cycles() - start);
 }
 
 size_t allocation_check(void) {
-    return allocated_count;
+    size_t live = 0;
+    pthread_mutex_lock(&registry_lock);
+    for (thread_state_t *t = threads; t; t = t->next)
+        live += t->stats.live_blocks;
+    pthread_mutex_unlock(&registry_lock);
+    return live;
+}
+
+/*
+  Peaks are kept per thread, so with several threads the sum would
+  overstate them.  Report the highest single-thread peak instead, but no
+  less than the live total.
+*/
+void allocation_stats(alloc_stats_t *st) {
+    memset(st, 0, sizeof(alloc_stats_t));
+    pthread_mutex_lock(&registry_lock);
+    for (thread_state_t *t = threads; t; t = t->next) {
+        const alloc_stats_t *ts = &t->stats;
+        st->mallocs += ts->mallocs;
+        st->frees += ts->frees;
+        st->failures += ts->failures;
+        st->live_blocks += ts->live_blocks;
+        st->live_bytes += ts->live_bytes;
+        st->total_bytes += ts->total_bytes;
+        if (bytes_above(ts->peak_bytes, st->peak_bytes))
+            st->peak_bytes = ts->peak_bytes;
+        if (bytes_above(ts->window_peak, st->window_peak))
+            st->window_peak = ts->window_peak;
+        for (size_t i = 0; i < ALLOC_CLASSES; i++)
+            st->classes[i] += ts->classes[i];
+    }
+    pthread_mutex_unlock(&registry_lock);
+    if (st->live_bytes > st->peak_bytes)
+        st->peak_bytes = st->live_bytes;
+    if (st->live_bytes > st->window_peak)
+        st->window_peak = st->live_bytes;
+}
+
+/* Leaked blocks of one site */
+typedef struct {
+    uint32_t site;
+    size_t blocks;
+    size_t bytes;
+} leak_t;
+
+/* Most bytes first */
+static int leak_cmp(const void *a, const void *b) {
+    const leak_t *x = a, *y = b;
+    if (x->bytes != y->bytes)
+        return x->bytes < y->bytes ? 1 : -1;
+    return x->site < y->site ? -1 : x->site > y->site;
+}
+
+void report_leaks(int level) {
+    pthread_mutex_lock(&site_lock);
+    leak_t *leaks = calloc(nsites + 1, sizeof(leak_t));
+    if (!leaks) {
+        pthread_mutex_unlock(&site_lock);
+        report(level, "Out of memory listing leaked blocks");
+        return;
+    }
+    for (size_t i = 0; i <= nsites; i++)
+        leaks[i].site = (uint32_t)i;
+
+    pthread_mutex_lock(&registry_lock);
+    for (thread_state_t *t = threads; t; t = t->next) {
+        for (size_t i = 0; i <= nsites; i++) {
+            leaks[i].blocks += t->site_blocks[i];
+            leaks[i].bytes += t->site_bytes[i];
+        }
+    }
+    pthread_mutex_unlock(&registry_lock);
+
+    qsort(leaks, nsites + 1, sizeof(leak_t), leak_cmp);
+    for (size_t i = 0; i <= nsites && leaks[i].blocks; i++) {
+        if (i == LEAK_SITES) {
+            size_t more = 0;
+            while (i + more <= nsites && leaks[i + more].blocks)
+                more++;
+            report(level, "  ... and %zu more sites", more);
+            break;
+        }
+        /* Innermost frame first, each called from the next */
+        char where[SITE_FRAMES * 160] = "unknown site";
+        if (leaks[i].site) {
+            const alloc_site_t *s = &sites[leaks[i].site - 1];
+            where[0] = '\0';
+            for (size_t f = 0; f < s->depth; f++) {
+                char frame[156];
+                describe_frame(s->frames[f], frame, sizeof(frame));
+                size_t len = strlen(where);
+                snprintf(where + len, sizeof(where) - len, "%s%s",
+                         f ? " < " : "", frame);
+            }
+        }
+        report(level, "  %zu blocks, %zu bytes from %s", leaks[i].blocks,
+               leaks[i].bytes, where);
+    }
+    pthread_mutex_unlock(&site_lock);
+    free(leaks);
+}
+
+void set_site_depth(size_t depth) {
+    site_depth = depth > SITE_FRAMES ? SITE_FRAMES : depth;
+}
+
+void allocation_window(void) {
+    pthread_mutex_lock(&registry_lock);
+    for (thread_state_t *t = threads; t; t = t->next)
+        t->stats.window_peak = t->stats.live_bytes;
+    pthread_mutex_unlock(&registry_lock);
+}
+
+void set_latency_mode(bool on) {
+    if (on && !latency_mode) {
+        lat_start_cycles = read_cycles();
+        lat_start_ns = read_ns();
+    }
+    latency_mode = on;
+}
+
+void latency_reset(void) {
+    pthread_mutex_lock(&registry_lock);
+    for (thread_state_t *t = threads; t; t = t->next)
+        memset(t->lat_hists, 0, sizeof(t->lat_hists));
+    pthread_mutex_unlock(&registry_lock);
+}
+
+void latency_histogram(lat_op_t op, lat_hist_t *h) {
+    memset(h, 0, sizeof(lat_hist_t));
+    pthread_mutex_lock(&registry_lock);
+    for (thread_state_t *t = threads; t; t = t->next) {
+        const lat_hist_t *th = &t->lat_hists[op];
+        h->count += th->count;
+        if (th->max > h->max)
+            h->max = th->max;
+        for (size_t i = 0; i < LAT_BUCKETS; i++)
+            h->counts[i] += th->counts[i];
+    }
+    pthread_mutex_unlock(&registry_lock);
+}
+uint64_t latency_bucket_max(size_t bucket) {
+    if (bucket < LAT_SUB)
+        return bucket;
+    size_t shift = (bucket - LAT_SUB) / (LAT_SUB / 2) + 1;
+    uint64_t top = (bucket - LAT_SUB) % (LAT_SUB / 2) + LAT_SUB / 2;
+    return ((top + 1) << shift) - 1;
+}
+
+uint64_t latency_percentile(const lat_hist_t *h, double pct) {
+    if (!h->count)
+        return 0;
+    /* Rank of the sample at this percentile, counting from 1 */
+    double rank = pct / 100.0 * (double)h->count;
+    size_t need = rank < 1 ? 1 : (size_t)rank;
+    if ((double)need < rank)
+        need++;
+    size_t seen = 0;
+    for (size_t i = 0; i < LAT_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= need) {
+            uint64_t v = latency_bucket_max(i);
+            return v < h->max ? v : h->max;
+        }
+    }
+    return h->max;
+}
+
+double latency_cycles_per_ns(void) {
+    uint64_t ns = read_ns() - lat_start_ns;
+    if (!ns)
+        return 1.0;
+    return (double)(read_cycles() - lat_start_cycles) / (double)ns;
+}
+
+void set_fail_seed(uint64_t seed) {
+    /* xorshift gets stuck on a zero state */
+    fail_seed = seed ? seed : DEFAULT_SEED;
+    state()->rng_state = fail_seed;
+}
+
+bool set_allocator(alloc_kind_t kind) {
+    if (allocator == &allocators[kind])
+        return true;
+    if (allocation_check() != 0)
+        return false;
+    pthread_mutex_lock(&registry_lock);
+    for (thread_state_t *t = threads; t; t = t->next) {
+        t->bump = NULL;
+        t->bump_end = NULL;
+        memset(t->slab_free, 0, sizeof(t->slab_free));
+    }
+    pthread_mutex_unlock(&registry_lock);
+    pthread_mutex_lock(&chunk_lock);
+    for (size_t i = 0; i < nmappings; i++)
+        munmap(mappings[i].base, mappings[i].bytes);
+    nmappings = 0;
+    pthread_mutex_unlock(&chunk_lock);
+    allocator = &allocators[kind];
+    return true;
+}
+
+void set_guard_interval(size_t n) {
+    guard_interval = n;
+}
+
+void set_mem_budget(size_t bytes, bool pressure) {
+    alloc_stats_t st;
+    allocation_stats(&st);
+    atomic_store(&budget_used, st.live_bytes);
+    mem_pressure = pressure;
+    mem_budget = bytes;
+}
+
+void set_fail_nth(size_t n) {
+    pthread_mutex_lock(&schedule_lock);
+    fail_nth = n;
+    update_schedule();
+    pthread_mutex_unlock(&schedule_lock);
+}
+
+void set_fail_above(size_t size) {
+    pthread_mutex_lock(&schedule_lock);
+    fail_above = size;
+    update_schedule();
+    pthread_mutex_unlock(&schedule_lock);
+}
+
+void fail_record_begin(void) {
+    pthread_mutex_lock(&schedule_lock);
+    replaying = false;
+    if (bitmap_cap)
+        memset(bitmap, 0, bitmap_cap);
+    bitmap_bits = 0;
+    recording = true;
+    update_schedule();
+    pthread_mutex_unlock(&schedule_lock);
+}
+
+bool fail_record_end(const char *path) {
+    pthread_mutex_lock(&schedule_lock);
+    bool ok = false;
+    FILE *fp = NULL;
+    if (recording) {
+        recording = false;
+        update_schedule();
+        fp = fopen(path, "wb");
+    }
+    if (fp) {
+        uint64_t header[2] = {BITMAP_MAGIC, bitmap_bits};
+        ok = fwrite(header, sizeof(header), 1, fp) == 1;
+        size_t bytes = (bitmap_bits + 7) / 8;
+        if (bytes)
+            ok = ok && fwrite(bitmap, 1, bytes, fp) == bytes;
+        ok = fclose(fp) == 0 && ok;
+    }
+    pthread_mutex_unlock(&schedule_lock);
+    return ok;
+}
+
+/*
+  Start replaying the bitmap file at path, or stop replaying if path is
+  NULL.  Call with schedule_lock held.
+*/
+static bool load_bitmap(const char *path) {
+    replaying = false;
+    recording = recording && !path;
+    update_schedule();
+    if (!path)
+        return true;
+    FILE *fp = fopen(path, "rb");
+    if (!fp)
+        return false;
+    uint64_t header[2];
+    bool ok = fread(header, sizeof(header), 1, fp) == 1 &&
+              header[0] == BITMAP_MAGIC && header[1] <= SIZE_MAX - 7;
+    size_t bytes = ok ? (size_t)(header[1] + 7) / 8 : 0;
+    if (ok && bytes > bitmap_cap) {
+        uint8_t *b = realloc(bitmap, bytes);
+        if (b) {
+            bitmap = b;
+            bitmap_cap = bytes;
+        }
+        ok = b != NULL;
+    }
+    ok = ok && (bytes == 0 || fread(bitmap, 1, bytes, fp) == bytes);
+    fclose(fp);
+    if (!ok)
+        return false;
+    bitmap_bits = (size_t)header[1];
+    replay_pos = 0;
+    replaying = true;
+    update_schedule();
+    return true;
+}
+
+bool fail_replay(const char *path) {
+    pthread_mutex_lock(&schedule_lock);
+    bool ok = load_bitmap(path);
+    pthread_mutex_unlock(&schedule_lock);
+    return ok;
+}
+
+/* Forget the block numbers of a trace.  Call with trace_lock held */
+static void trace_reset(void) {
+    free(trace_ids);
+    trace_ids = NULL;
+    trace_slots = 0;
+    trace_live = 0;
+    trace_nfree = 0;
+    trace_next_id = 0;
+}
+
+bool alloc_trace_begin(const char *path) {
+    size_t events;
+    alloc_trace_end(&events);
+    FILE *fp = fopen(path, "wb");
+    if (!fp)
+        return false;
+    setvbuf(fp, NULL, _IOFBF, 1 << 20);
+    pthread_mutex_lock(&trace_lock);
+    trace_reset();
+    trace_fp = fp;
+    trace_ok = fwrite(ATRACE_MAGIC, 1, 8, fp) == 8;
+    trace_last_ns = read_ns();
+    trace_events = 0;
+    atomic_store(&trace_active, true);
+    pthread_mutex_unlock(&trace_lock);
+    return true;
+}
+
+bool alloc_trace_end(size_t *events) {
+    pthread_mutex_lock(&trace_lock);
+    bool ok = trace_fp != NULL;
+    if (ok) {
+        atomic_store(&trace_active, false);
+        ok = fclose(trace_fp) == 0 && trace_ok;
+        trace_fp = NULL;
+        trace_reset();
+    }
+    *events = trace_events;
+    pthread_mutex_unlock(&trace_lock);
+    return ok;
 }
 
 /*
@@ -104,9 +1702,16 @@ size_t allocation_check(void) {
 /*
   Set/unset cautious mode.
   In this mode, makes extra sure any block to be freed is currently allocated.
+  Blocks are only entered in the table while the mode is on, so it can't
+  change while any are allocated.
 */
-void set_cautious_mode(bool cautious) {
+bool set_cautious_mode(bool cautious) {
+    if (cautious_mode == cautious)
+        return true;
+    if (allocation_check() != 0)
+        return false;
     cautious_mode = cautious;
+    return true;
 }
 
 /*
@@ -118,24 +1723,149 @@ void set_noallocate_mode(bool noallocate) {
 }
 
 /*
-  Return whether any errors have occurred since last time set error limit
+  Return whether any errors have occurred since last time set error limit,
+  in any thread
  */
 bool error_check(void) {
-    bool e = error_occurred;
-    error_occurred = false;
+    if (!atomic_load_explicit(&any_error, memory_order_relaxed))
+        return false;
+    /* Cleared first, so an error flagged during the walk isn't lost */
+    atomic_store(&any_error, false);
+    bool e = false;
+    pthread_mutex_lock(&registry_lock);
+    for (thread_state_t *t = threads; t; t = t->next)
+        e = atomic_exchange(&t->error, false) || e;
+    pthread_mutex_unlock(&registry_lock);
     return e;
 }
 
+/*
+ * Block the timeout signal in the calling thread.
+ */
+void block_timeout(void) {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGALRM);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+}
+
+/*
+ * Say which budget ran out, then let the signal end the program as the
+ * alarm used to.  SA_RESETHAND has already restored the default action,
+ * which runs once the handler returns and unblocks the signal.
+ */
+static void budget_exceeded(int sig) {
+    const char *msg = budget_message[timed_class];
+    ssize_t UNUSED n = write(STDOUT_FILENO, msg, strlen(msg));
+    raise(sig);
+}
+
+/* Build the message shown when the budget of cls runs out */
+static void set_budget_message(time_class_t cls) {
+    snprintf(budget_message[cls], sizeof(budget_message[cls]),
+             "ERROR: %s operation exceeded its %u ms time budget\n",
+             time_class_names[cls], time_budget[cls]);
+}
+
+/*
+ * Set the time budget of a class of operations.
+ */
+void set_time_budget(time_class_t cls, unsigned ms) {
+    time_budget[cls] = ms;
+    set_budget_message(cls);
+}
+
+/*
+ * Warn about operations that use more than pct percent of their budget.
+ */
+void set_time_warning(unsigned pct) {
+    time_warning = pct;
+}
+
+/*
+ * Report the share of its budget that each operation used.
+ */
+void set_time_reports(bool on) {
+    time_reports = on;
+}
+
+/*
+ * Copy the time usage of a class of operations.
+ */
+void time_usage(time_class_t cls, time_usage_t *u) {
+    *u = time_usage_of[cls];
+}
+
+/*
+ * Forget the time usage of every class.
+ */
+void time_usage_reset(void) {
+    memset(time_usage_of, 0, sizeof(time_usage_of));
+}
+
 /*
  * Arm a timeout for a tested operation.
  */
-void arm_timeout(void) {
-    alarm(time_limit);
+void arm_timeout(time_class_t cls) {
+    if (!op_timer_made) {
+        struct sigevent sev;
+        memset(&sev, 0, sizeof(sev));
+        sev.sigev_notify = SIGEV_SIGNAL;
+        sev.sigev_signo = SIGALRM;
+        if (timer_create(CLOCK_MONOTONIC, &sev, &op_timer) != 0)
+            report_event(MSG_FATAL, "Could not create operation timer");
+        for (size_t c = 0; c < TIME_CLASSES; c++)
+            if (!budget_message[c][0])
+                set_budget_message((time_class_t)c);
+        op_timer_made = true;
+    }
+
+    /* The handler resets itself, so install it for every operation */
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = budget_exceeded;
+    sa.sa_flags = (int)SA_RESETHAND;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGALRM, &sa, NULL);
+
+    unsigned ms = time_budget[cls];
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = (time_t)(ms / 1000);
+    its.it_value.tv_nsec = (long)(ms % 1000) * 1000000;
+    timed_class = (sig_atomic_t)cls;
+    timed_start_ns = read_ns();
+    timer_settime(op_timer, 0, &its, NULL);
 }
 
 /*
- * Cancel a running timeout after the tested operation is completed.
+ * Cancel a running timeout after the tested operation is completed, and
+ * record how much of its budget the operation used.
  */
 void cancel_timeout(void) {
-    alarm(0);
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    if (op_timer_made)
+        timer_settime(op_timer, 0, &its, NULL);
+    uint64_t elapsed = read_ns() - timed_start_ns;
+
+    time_class_t cls = (time_class_t)timed_class;
+    double share = (double)elapsed / (time_budget[cls] * 1e6);
+    time_usage_t *u = &time_usage_of[cls];
+    u->count++;
+    u->total_ns += elapsed;
+    if (elapsed > u->max_ns)
+        u->max_ns = elapsed;
+    if (share > u->max_share)
+        u->max_share = share;
+
+    if (time_warning && share * 100 >= time_warning)
+        report_event(MSG_WARN, "%s operation took %.3f ms, %.1f%% of its %u "
+                               "ms budget",
+                     time_class_names[cls], (double)elapsed / 1e6,
+                     share * 100, time_budget[cls]);
+    else if (time_reports)
+        report(1, "%s operation took %.3f ms, %.1f%% of its %u ms budget",
+               time_class_names[cls], (double)elapsed / 1e6, share * 100,
+               time_budget[cls]);
 }
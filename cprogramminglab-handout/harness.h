@@ -16,18 +16,203 @@ void test_free(void *p);
 
 #ifdef INTERNAL
 #include <stdbool.h>
+#include <stdint.h>
+
+/*
+  The allocation functions may be called from several threads at once.
+  Each thread keeps its own counters, random generator and error flag,
+  so they take no lock; the queries below add up every thread's share.
+  Queries and mode settings are meant for when other threads are idle,
+  e.g. after they have been joined.
+*/
 
 /* Report number of allocated blocks */
 size_t allocation_check(void);
 
-/* Probability of malloc failing, expressed as percent */
+/*
+  Allocations are counted by size class: class 0 holds zero-byte
+  requests, and class i > 0 holds sizes from 2^(i-1) to 2^i - 1.
+*/
+#define ALLOC_CLASSES 65
+
+/* Allocation profile.  Byte counts are of bytes requested by callers */
+typedef struct {
+    size_t mallocs;     /* Successful test_malloc and test_calloc calls */
+    size_t frees;       /* Blocks freed */
+    size_t failures;    /* Allocations made to fail */
+    size_t live_blocks; /* Blocks allocated and not yet freed */
+    size_t live_bytes;
+    size_t peak_bytes;  /* Highest live_bytes so far (see below) */
+    size_t window_peak; /* Highest live_bytes since allocation_window() */
+    size_t total_bytes; /* Bytes of all successful allocations */
+    size_t classes[ALLOC_CLASSES];
+} alloc_stats_t;
+
+/*
+  Copy the current allocation profile, summed over threads, into *st.
+  Peaks are tracked per thread: with several threads, they are the
+  highest peak of any one thread, or the live total if that is higher.
+*/
+void allocation_stats(alloc_stats_t *st);
+
+/* Restart tracking of window_peak from the current live bytes */
+void allocation_window(void);
+
+/*
+  List the blocks still allocated, grouped by the code that allocated
+  them, most bytes first.  Code addresses are shown as symbol+offset, or
+  as object file+offset (for addr2line) when the symbol isn't exported.
+  Blocks allocated while the depth below is 0 are listed as unknown.
+*/
+void report_leaks(int level);
+
+/* Most call frames recorded per allocation site */
+#define SITE_FRAMES 4
+
+/*
+  Record the innermost depth (up to SITE_FRAMES) frames that lead to each
+  allocation, or none if depth is 0.  Depth 1 costs a few nanoseconds per
+  allocation; deeper backtraces are much slower.
+*/
+void set_site_depth(size_t depth);
+
+/*
+  Latency histograms of the allocation functions, in cycles of the time
+  stamp counter (nanoseconds on machines without one).  Buckets are
+  log-linear: exact below LAT_SUB cycles, then LAT_SUB / 2 buckets per
+  power of two.
+*/
+#define LAT_SUB_BITS 5
+#define LAT_SUB (1 << LAT_SUB_BITS)
+#define LAT_BUCKETS (LAT_SUB + (64 - LAT_SUB_BITS) * (LAT_SUB / 2))
+
+typedef enum { LAT_MALLOC, LAT_CALLOC, LAT_FREE, LAT_OPS } lat_op_t;
+
+typedef struct {
+    size_t count; /* Calls timed */
+    uint64_t max; /* Slowest call */
+    size_t counts[LAT_BUCKETS];
+} lat_hist_t;
+
+/* Turn timing of test_malloc, test_calloc and test_free on or off */
+void set_latency_mode(bool on);
+
+/* Empty the latency histograms */
+void latency_reset(void);
+
+/* Sum of every thread's histogram for one allocation function */
+void latency_histogram(lat_op_t op, lat_hist_t *h);
+
+/* Largest latency that falls in a bucket */
+uint64_t latency_bucket_max(size_t bucket);
+
+/* Latency below which pct percent of the calls fell, to bucket precision */
+uint64_t latency_percentile(const lat_hist_t *h, double pct);
+
+/* Cycles per nanosecond since latency mode was turned on */
+double latency_cycles_per_ns(void);
+
+/* Probability of malloc failing, expressed as percent (0 to 100) */
 extern int fail_probability;
 
+/*
+  Seed the calling thread's generator that decides random allocation
+  failures.  Threads that start allocating later get generators seeded
+  from it.  The same seed and command sequence give the same failures.
+*/
+void set_fail_seed(uint64_t seed);
+
+/* Allocators that blocks can get their memory from */
+typedef enum {
+    ALLOC_SYSTEM,   /* malloc and free */
+    ALLOC_ARENA,    /* Bump allocation; freed memory isn't reused */
+    ALLOC_SLAB,     /* Per-thread free lists of 16-byte size classes */
+    ALLOC_HUGEPAGE, /* Slab allocator with memory on 2 MB huge pages */
+    ALLOC_KINDS
+} alloc_kind_t;
+
+/* Names of the allocators, indexed by alloc_kind_t, ending with NULL */
+extern const char *const allocator_names[ALLOC_KINDS + 1];
+
+/*
+  Get memory for blocks from another allocator.  Memory mapped by the
+  old one is released.  Return false if any block is still allocated.
+*/
+bool set_allocator(alloc_kind_t kind);
+
+/*
+  Guard every nth allocation of each thread (0: none) by placing it in
+  its own mapping, right before a PROT_NONE page.  Writing past the end
+  of a guarded block faults on the spot instead of being found when the
+  block is freed, and freed guarded blocks are unmapped, so using them
+  faults too.  Guarded blocks come from mmap whatever the allocator.
+*/
+void set_guard_interval(size_t n);
+
+/*
+  Make allocations fail once the bytes of live blocks would exceed bytes.
+  With pressure set, they also fail at random from half the budget on,
+  more and more often as it fills up.  A budget of 0 turns this off.
+*/
+void set_mem_budget(size_t bytes, bool pressure);
+
+/* Make the nth allocation from now on fail.  0 turns this off */
+void set_fail_nth(size_t n);
+
+/* Make every allocation of more than size bytes fail.  0 turns this off */
+void set_fail_above(size_t size);
+
+/* Start recording whether each allocation failed */
+void fail_record_begin(void);
+
+/*
+  Stop recording and write the recorded decisions to a bitmap file.
+  Return false if nothing was being recorded or the file can't be written.
+*/
+bool fail_record_end(const char *path);
+
+/*
+  Decide allocation failures by a recorded bitmap file instead of the
+  other settings, until the bitmap runs out.  NULL stops replaying.
+  Return false if the file can't be read.
+*/
+bool fail_replay(const char *path);
+
+/*
+  Allocation traces, for replaying a workload's allocations without
+  running it (see areplay.c).  A trace file starts with the 8 bytes of
+  ATRACE_MAGIC, followed by a record for each event: an atrace_op_t byte,
+  then unsigned LEB128 numbers for the nanoseconds since the previous
+  record, the block's number and, unless the event is a free, its size.
+  Numbers of freed blocks are reused, so they stay below the peak count
+  of live blocks.  Frees of blocks allocated before recording began are
+  left out.
+*/
+#define ATRACE_MAGIC "QATRACE1"
+
+typedef enum { ATRACE_MALLOC, ATRACE_CALLOC, ATRACE_FREE } atrace_op_t;
+
+/*
+  Start recording every allocation and free, from any thread, to a trace
+  file at path, ending any trace being recorded.  Return false if the
+  file can't be created.
+*/
+bool alloc_trace_begin(const char *path);
+
+/*
+  Stop recording, and set *events to the number of events recorded.
+  Return false if nothing was being recorded or the trace is incomplete.
+*/
+bool alloc_trace_end(size_t *events);
+
 /*
   Set/unset cautious mode.
-  In this mode, makes extra sure any block to be freed is currently allocated.
+  In this mode, makes extra sure any block to be freed is currently allocated,
+  by keeping a table of live blocks.  On by default; turning it off saves
+  the table updates in malloc and free.  Return false, leaving the mode as
+  it is, if any blocks are allocated.
 */
-void set_cautious_mode(bool cautious);
+bool set_cautious_mode(bool cautious);
 
 /*
   Set/unset restricted allocation mode.
@@ -41,12 +226,67 @@ void set_noallocate_mode(bool noallocate);
 bool error_check(void);
 
 /*
- * Arm a timeout for a tested operation.
+ * Block the timeout signal in the calling thread.  The timeout is a
+ * process-wide timer signal, so worker threads call this to make sure it
+ * is delivered to the thread that armed it.
+ */
+void block_timeout(void);
+
+/*
+  Classes of tested operations.  Each class has its own time budget, in
+  milliseconds of the monotonic clock; an operation that runs past it
+  ends the program with an error.
+*/
+typedef enum {
+    TIME_ALLOC,   /* new, free */
+    TIME_INSERT,  /* ih, it */
+    TIME_REMOVE,  /* rh, rhq */
+    TIME_REVERSE, /* reverse */
+    TIME_SIZE,    /* size */
+    TIME_SEARCH,  /* show, find, findp */
+    TIME_CLASSES
+} time_class_t;
+
+#define DEFAULT_BUDGET_MS 1000
+
+/* Names of the classes, indexed by time_class_t and ending in NULL */
+extern const char *const time_class_names[];
+
+/* How much of its budget a class of operations has used */
+typedef struct {
+    size_t count;      /* Operations timed */
+    uint64_t total_ns; /* Time of all of them */
+    uint64_t max_ns;   /* Slowest operation */
+    double max_share;  /* Largest fraction of its budget one operation used */
+} time_usage_t;
+
+/* Set the budget of a class of operations (at least 1 ms) */
+void set_time_budget(time_class_t cls, unsigned ms);
+
+/*
+  Warn about each operation that uses at least pct percent of its budget
+  (0: never).
+*/
+void set_time_warning(unsigned pct);
+
+/* Report the share of its budget that each operation used (default off) */
+void set_time_reports(bool on);
+
+/* Copy the time usage of a class */
+void time_usage(time_class_t cls, time_usage_t *u);
+
+/* Forget the time usage of every class */
+void time_usage_reset(void);
+
+/*
+ * Arm a timeout for a tested operation of class cls.  Only the main
+ * thread times operations.
  */
-void arm_timeout(void);
+void arm_timeout(time_class_t cls);
 
 /*
- * Cancel a running timeout after the tested operation is completed.
+ * Cancel a running timeout after the tested operation is completed, and
+ * record how much of its budget the operation used.
  */
 void cancel_timeout(void);
 
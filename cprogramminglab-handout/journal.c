@@ -0,0 +1,196 @@
+/* Write-ahead journal of queue operations */
+
+#define _XOPEN_SOURCE 700
+
+#include "journal.h"
+#include "report.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Identifies a journal file.  Written once at the start */
+static const char journal_magic[8] = {'Q', 'J', 'O', 'U', 'R', 'N', 'L', '1'};
+
+/* Records are collected here before being written */
+#define JOURNAL_BUFSIZE 65536
+
+/* Bytes in a record header: operation byte, then 32-bit string length */
+#define RECORD_HEADER 5
+
+struct journal {
+    int fd;
+    char buf[JOURNAL_BUFSIZE]; /* Records not yet written */
+    size_t len;                /* Bytes used in buf */
+    long window_us;            /* Group commit window */
+    bool pending;              /* Records logged since last fsync */
+    double pending_since;      /* Time of oldest such record */
+    size_t records;
+    size_t syncs;
+};
+
+/* Monotonic time in seconds */
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + 1.0E-9 * (double)ts.tv_nsec;
+}
+
+/* Write all of a byte range, retrying after short writes */
+static bool write_all(int fd, const char *p, size_t n) {
+    while (n > 0) {
+        ssize_t w = write(fd, p, n);
+        if (w < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        p += w;
+        n -= (size_t)w;
+    }
+    return true;
+}
+
+/* Hand buffered records to the kernel */
+static bool flush_buf(journal_t *j) {
+    bool ok = write_all(j->fd, j->buf, j->len);
+    j->len = 0;
+    return ok;
+}
+
+journal_t *journal_open(const char *path, long window_us) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return NULL;
+    journal_t *j = malloc_or_fail(sizeof(journal_t), "journal_open");
+    j->fd = fd;
+    j->len = 0;
+    j->window_us = window_us < 0 ? 0 : window_us;
+    j->pending = false;
+    j->pending_since = 0;
+    j->records = 0;
+    j->syncs = 0;
+    memcpy(j->buf, journal_magic, sizeof(journal_magic));
+    j->len = sizeof(journal_magic);
+    if (!journal_sync(j)) {
+        close(fd);
+        free(j);
+        return NULL;
+    }
+    j->syncs = 0;
+    return j;
+}
+
+bool journal_log(journal_t *j, journal_op_t op, const char *s) {
+    bool has_string = op == JOURNAL_INSERT_HEAD || op == JOURNAL_INSERT_TAIL;
+    size_t slen = has_string ? strlen(s) : 0;
+    if (slen > UINT32_MAX)
+        return false;
+    char header[RECORD_HEADER];
+    uint32_t len32 = (uint32_t)slen;
+    header[0] = (char)op;
+    memcpy(header + 1, &len32, sizeof(len32));
+
+    bool ok = true;
+    if (j->len + RECORD_HEADER + slen > JOURNAL_BUFSIZE)
+        ok = flush_buf(j);
+    if (RECORD_HEADER + slen > JOURNAL_BUFSIZE) {
+        /* Too big to buffer.  Write it directly */
+        ok = ok && write_all(j->fd, header, RECORD_HEADER) &&
+             write_all(j->fd, s, slen);
+    } else {
+        memcpy(j->buf + j->len, header, RECORD_HEADER);
+        if (slen)
+            memcpy(j->buf + j->len + RECORD_HEADER, s, slen);
+        j->len += RECORD_HEADER + slen;
+    }
+    j->records++;
+
+    double t = now();
+    if (!j->pending) {
+        j->pending = true;
+        j->pending_since = t;
+    }
+    if ((t - j->pending_since) * 1.0E6 >= (double)j->window_us)
+        ok = journal_sync(j) && ok;
+    return ok;
+}
+
+bool journal_sync(journal_t *j) {
+    bool ok = flush_buf(j);
+    ok = fsync(j->fd) == 0 && ok;
+    j->pending = false;
+    j->syncs++;
+    return ok;
+}
+
+bool journal_poll(journal_t *j, long *wait_us) {
+    *wait_us = -1;
+    if (!j->pending)
+        return true;
+    double left = (double)j->window_us - (now() - j->pending_since) * 1.0E6;
+    if (left > 0) {
+        /* Round up, so the window has passed by the next call */
+        *wait_us = (long)left + 1;
+        return true;
+    }
+    return journal_sync(j);
+}
+
+bool journal_close(journal_t *j) {
+    bool ok = journal_sync(j);
+    ok = close(j->fd) == 0 && ok;
+    free(j);
+    return ok;
+}
+
+size_t journal_records(const journal_t *j) {
+    return j->records;
+}
+
+size_t journal_syncs(const journal_t *j) {
+    return j->syncs;
+}
+
+bool journal_replay(const char *path, journal_apply_t apply, void *arg,
+                    size_t *nrecords) {
+    *nrecords = 0;
+    FILE *fp = fopen(path, "rb");
+    if (!fp)
+        return false;
+    char magic[sizeof(journal_magic)];
+    if (fread(magic, 1, sizeof(magic), fp) != sizeof(magic) ||
+        memcmp(magic, journal_magic, sizeof(magic)) != 0) {
+        report(1, "'%s' is not a journal file", path);
+        fclose(fp);
+        return false;
+    }
+
+    size_t scap = 256;
+    char *s = malloc_or_fail(scap, "journal_replay");
+    bool ok = true;
+    char header[RECORD_HEADER];
+    while (ok && fread(header, 1, RECORD_HEADER, fp) == RECORD_HEADER) {
+        uint32_t len32;
+        memcpy(&len32, header + 1, sizeof(len32));
+        size_t slen = len32;
+        if (slen + 1 > scap) {
+            scap = slen + 1;
+            s = realloc_or_fail(s, scap, "journal_replay");
+        }
+        if (fread(s, 1, slen, fp) != slen)
+            break; /* Torn final record: it was never committed */
+        s[slen] = '\0';
+        ok = apply((journal_op_t)header[0], s, arg);
+        if (ok)
+            (*nrecords)++;
+    }
+    free(s);
+    fclose(fp);
+    return ok;
+}
@@ -0,0 +1,69 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+  Write-ahead journal of queue operations.
+  Each successful operation is appended to a log file.  Records are
+  buffered and made durable together (group commit): fsync is called once
+  the oldest record not yet on disk is older than the commit window.
+  journal_log checks the window as records arrive; once they stop, the
+  owner must call journal_poll to sync the rest on time.
+  Replaying the journal onto a fresh queue recreates the logged queue.
+*/
+
+/* Kinds of journal records */
+typedef enum {
+    JOURNAL_NEW,         /* Queue replaced by a new, empty queue */
+    JOURNAL_FREE,        /* Queue freed */
+    JOURNAL_INSERT_HEAD, /* String inserted at head */
+    JOURNAL_INSERT_TAIL, /* String inserted at tail */
+    JOURNAL_REMOVE_HEAD, /* Element removed from head */
+    JOURNAL_REVERSE      /* Queue reversed */
+} journal_op_t;
+
+typedef struct journal journal_t;
+
+/* Function applying one replayed record.  Return false to stop replay */
+typedef bool (*journal_apply_t)(journal_op_t op, const char *s, void *arg);
+
+/*
+  Create (or truncate) a journal file.
+  window_us is the group commit window in microseconds; 0 syncs every record.
+  Return NULL if the file can't be opened.
+*/
+journal_t *journal_open(const char *path, long window_us);
+
+/* Append a record.  s is ignored for records without a string */
+bool journal_log(journal_t *j, journal_op_t op, const char *s);
+
+/* Write out and fsync all buffered records */
+bool journal_sync(journal_t *j);
+
+/*
+  Sync if the oldest buffered record has waited out the commit window,
+  for callers to use when no further records arrive.  *wait_us is set to
+  the microseconds left until a sync is due, or -1 if nothing is
+  buffered.  Return false if the sync failed.
+*/
+bool journal_poll(journal_t *j, long *wait_us);
+
+/* Sync and close journal.  Return false if final sync failed */
+bool journal_close(journal_t *j);
+
+/* Number of records logged and fsyncs performed so far */
+size_t journal_records(const journal_t *j);
+size_t journal_syncs(const journal_t *j);
+
+/*
+  Replay the records in a journal file through apply.
+  Stops quietly at a torn record at the end of the file.
+  Return false if the file can't be read or apply failed.
+  *nrecords is set to the number of records applied.
+*/
+bool journal_replay(const char *path, journal_apply_t apply, void *arg,
+                    size_t *nrecords);
+
+#endif /* JOURNAL_H */
@@ -0,0 +1,280 @@
+/**
+ * @file lru.c
+ * @brief Implementation of a least-recently-used string cache.
+ */
+
+#include "lru.h"
+#include "harness.h"
+#include "queue.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* Number of hash buckets a new cache starts with */
+#define MIN_BUCKETS 16
+
+/* FNV-1a hash of a string */
+static uint64_t hash_string(const char *s) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (; *s; s++) {
+        h ^= (unsigned char)*s;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/* Bytes charged to the cache for an entry */
+static size_t entry_bytes(const lru_node_t *n) {
+    return sizeof(lru_node_t) + queue_element_bytes(n->key) +
+           queue_element_bytes(n->value);
+}
+
+/* Bucket holding entries with hash h */
+static lru_node_t **bucket(const lru_t *c, uint64_t h) {
+    return &c->buckets[h & (c->nbuckets - 1)];
+}
+
+/* Find the entry for key, or NULL */
+static lru_node_t *lookup(const lru_t *c, const char *key, uint64_t h) {
+    for (lru_node_t *n = *bucket(c, h); n; n = n->chain) {
+        if (n->hash == h && strcmp(n->key->value, key) == 0)
+            return n;
+    }
+    return NULL;
+}
+
+/* Take an entry off the recency list */
+static void unlink_node(lru_t *c, lru_node_t *n) {
+    if (n->prev)
+        n->prev->next = n->next;
+    else
+        c->mru = n->next;
+    if (n->next)
+        n->next->prev = n->prev;
+    else
+        c->lru = n->prev;
+}
+
+/* Put an entry at the front of the recency list */
+static void push_front(lru_t *c, lru_node_t *n) {
+    n->prev = NULL;
+    n->next = c->mru;
+    if (c->mru)
+        c->mru->prev = n;
+    else
+        c->lru = n;
+    c->mru = n;
+}
+
+/* Take an entry off its hash chain */
+static void unchain_node(lru_t *c, lru_node_t *n) {
+    lru_node_t **pp = bucket(c, n->hash);
+    while (*pp != n)
+        pp = &(*pp)->chain;
+    *pp = n->chain;
+}
+
+/* Double the number of buckets.  Keep the old table if that fails */
+static void grow_table(lru_t *c) {
+    size_t nb = 2 * c->nbuckets;
+    lru_node_t **buckets = calloc(nb, sizeof(lru_node_t *));
+    if (!buckets)
+        return;
+    for (size_t i = 0; i < c->nbuckets; i++) {
+        lru_node_t *n = c->buckets[i];
+        while (n) {
+            lru_node_t *next = n->chain;
+            n->chain = buckets[n->hash & (nb - 1)];
+            buckets[n->hash & (nb - 1)] = n;
+            n = next;
+        }
+    }
+    free(c->buckets);
+    c->buckets = buckets;
+    c->nbuckets = nb;
+}
+
+/* Free an entry and its elements */
+static void free_node(lru_node_t *n) {
+    queue_element_free(n->key);
+    queue_element_free(n->value);
+    free(n);
+}
+
+/* True when the cache is over one of its bounds */
+static bool over_capacity(const lru_t *c) {
+    return (c->max_entries && c->size > c->max_entries) ||
+           (c->max_bytes && c->bytes > c->max_bytes);
+}
+
+/**
+ * @brief Allocates a new cache
+ *
+ * @param[in] max_entries Most entries to hold, or 0 for no limit
+ * @param[in] max_bytes   Most bytes of entries to hold, or 0 for no limit
+ *
+ * @return The new cache, or NULL if memory allocation failed
+ */
+lru_t *lru_new(size_t max_entries, size_t max_bytes) {
+    lru_t *c = malloc(sizeof(lru_t));
+    if (!c)
+        return NULL;
+    c->buckets = calloc(MIN_BUCKETS, sizeof(lru_node_t *));
+    if (!c->buckets) {
+        free(c);
+        return NULL;
+    }
+    c->nbuckets = MIN_BUCKETS;
+    c->mru = NULL;
+    c->lru = NULL;
+    c->size = 0;
+    c->bytes = 0;
+    c->max_entries = max_entries;
+    c->max_bytes = max_bytes;
+    c->hits = 0;
+    c->misses = 0;
+    c->evictions = 0;
+    return c;
+}
+
+/**
+ * @brief Frees all memory used by a cache
+ * @param[in] c The cache to free
+ */
+void lru_free(lru_t *c) {
+    if (!c)
+        return;
+
+    lru_node_t *n = c->mru;
+    while (n) {
+        lru_node_t *next = n->next;
+        free_node(n);
+        n = next;
+    }
+    free(c->buckets);
+    free(c);
+}
+
+/**
+ * @brief Looks up a key in a cache
+ *
+ * A hit moves the entry to the front of the recency list.  Either way
+ * the hit or miss counter is updated.
+ *
+ * @param[in] c   The cache to search
+ * @param[in] key Key to look for
+ *
+ * @return The cached value, valid until the entry is replaced or evicted,
+ *         or NULL on a miss
+ */
+const char *lru_get(lru_t *c, const char *key) {
+    if (!c || !key)
+        return NULL;
+
+    lru_node_t *n = lookup(c, key, hash_string(key));
+    if (!n) {
+        c->misses++;
+        return NULL;
+    }
+    c->hits++;
+    if (n != c->mru) {
+        unlink_node(c, n);
+        push_front(c, n);
+    }
+    return n->value->value;
+}
+
+/**
+ * @brief Inserts or replaces the value for a key
+ *
+ * The entry becomes the most recently used one.  Then least recently
+ * used entries are evicted until the cache is within its bounds.
+ *
+ * @param[in] c     The cache to insert into
+ * @param[in] key   Key, copied into the cache
+ * @param[in] value Value, copied into the cache
+ *
+ * @return true if the entry was stored
+ * @return false if c is NULL, memory allocation failed, or the entry on
+ *         its own is larger than the byte bound
+ */
+bool lru_put(lru_t *c, const char *key, const char *value) {
+    if (!c || !key || !value)
+        return false;
+
+    uint64_t h = hash_string(key);
+    lru_node_t *n = lookup(c, key, h);
+    if (n) {
+        list_ele_t *v = queue_element_new(value);
+        if (!v)
+            return false;
+        c->bytes -= entry_bytes(n);
+        queue_element_free(n->value);
+        n->value = v;
+        c->bytes += entry_bytes(n);
+        unlink_node(c, n);
+    } else {
+        n = malloc(sizeof(lru_node_t));
+        if (!n)
+            return false;
+        n->key = queue_element_new(key);
+        n->value = queue_element_new(value);
+        if (!n->key || !n->value) {
+            free_node(n);
+            return false;
+        }
+        n->hash = h;
+        if (c->size >= c->nbuckets)
+            grow_table(c);
+        lru_node_t **b = bucket(c, h);
+        n->chain = *b;
+        *b = n;
+        c->size++;
+        c->bytes += entry_bytes(n);
+    }
+    push_front(c, n);
+
+    while (over_capacity(c) && c->lru != n)
+        lru_evict(c);
+    if (over_capacity(c)) {
+        /* The new entry alone does not fit */
+        lru_evict(c);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Evicts the least recently used entry of a cache
+ *
+ * @param[in] c The cache to evict from
+ *
+ * @return false if c is NULL or empty
+ */
+bool lru_evict(lru_t *c) {
+    if (!c || !c->lru)
+        return false;
+
+    lru_node_t *n = c->lru;
+    unlink_node(c, n);
+    unchain_node(c, n);
+    c->size--;
+    c->bytes -= entry_bytes(n);
+    c->evictions++;
+    free_node(n);
+    return true;
+}
+
+/**
+ * @brief Returns the number of entries in a cache
+ *
+ * @param[in] c The cache to examine
+ *
+ * @return the number of entries, or 0 if c is NULL or empty
+ */
+size_t lru_size(lru_t *c) {
+    if (!c)
+        return 0;
+
+    return c->size;
+}
@@ -0,0 +1,77 @@
+/**
+ * @file lru.h
+ * @brief Least-recently-used cache mapping strings to strings.
+ *
+ * Entries are found through a chained hash table and kept on a
+ * doubly-linked recency list, most recently used first.  Lookups,
+ * insertions and evictions all take O(1) time (amortized, since the hash
+ * table doubles as it fills).  Keys and values are each copied into a
+ * queue element from queue_element_new, so they are allocated, accounted
+ * and checked by the test harness exactly like the strings of a queue.
+ *
+ * A cache can be bounded by number of entries, by bytes, or both.  Once
+ * an insertion goes over a bound, least recently used entries are evicted
+ * until the cache fits again.
+ */
+
+#ifndef LRU_H
+#define LRU_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/************** Data structure declarations ****************/
+
+struct list_ele;
+
+/**
+ * @brief Cache entry, on both a hash chain and the recency list.
+ */
+typedef struct lru_node {
+    struct list_ele *key;   /* Queue element holding the key */
+    struct list_ele *value; /* Queue element holding the value */
+    uint64_t hash;          /* Hash of key */
+    struct lru_node *chain; /* Next entry in the same hash bucket */
+    struct lru_node *prev;  /* More recently used neighbour */
+    struct lru_node *next;  /* Less recently used neighbour */
+} lru_node_t;
+
+/**
+ * @brief Cache with its hit and miss counters.
+ */
+typedef struct {
+    lru_node_t **buckets; /* Hash table, nbuckets chains */
+    size_t nbuckets;      /* Always a power of two */
+    lru_node_t *mru;      /* Most recently used entry, or NULL */
+    lru_node_t *lru;      /* Least recently used entry, or NULL */
+    size_t size;          /* Number of entries */
+    size_t bytes;         /* Bytes used by entries */
+    size_t max_entries;   /* Bound on size, or 0 for none */
+    size_t max_bytes;     /* Bound on bytes, or 0 for none */
+    size_t hits;
+    size_t misses;
+    size_t evictions;
+} lru_t;
+
+/************** Operations on cache ************************/
+
+/* Create empty cache.  A bound of 0 means unbounded. */
+lru_t *lru_new(size_t max_entries, size_t max_bytes);
+
+/* Free ALL storage used by cache. */
+void lru_free(lru_t *c);
+
+/* Look up key, marking it most recently used.  NULL on a miss. */
+const char *lru_get(lru_t *c, const char *key);
+
+/* Insert or replace the value for key, evicting entries as needed. */
+bool lru_put(lru_t *c, const char *key, const char *value);
+
+/* Evict the least recently used entry. */
+bool lru_evict(lru_t *c);
+
+/* Return number of entries in cache. */
+size_t lru_size(lru_t *c);
+
+#endif /* LRU_H */
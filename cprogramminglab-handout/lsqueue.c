@@ -0,0 +1,317 @@
+/**
+ * @file lsqueue.c
+ * @brief Implementation of a log-structured queue of strings.
+ *
+ * All elements share one circular buffer.  A record is laid out as
+ *
+ *     [ uint32 len ][ len bytes of string ][ uint32 len ]
+ *
+ * and may wrap around the end of the ring.  The buffer only grows (by
+ * doubling) when a new record does not fit; the bytes freed at the head
+ * are reused as the tail wraps around.
+ */
+
+#include "lsqueue.h"
+#include "harness.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Size of each of the two length tags framing a record */
+#define TAG_SIZE sizeof(uint32_t)
+
+/* Capacity of the ring allocated on first insertion */
+#define MIN_CAPACITY 4096
+
+/* Total bytes occupied by a record holding a string of length len */
+static size_t record_size(size_t len) {
+    return len + 2 * TAG_SIZE;
+}
+
+/* Copy n bytes into the ring starting at (unmasked) offset off */
+static void ring_write(lsq_t *q, size_t off, const void *src, size_t n) {
+    off &= q->cap - 1;
+    size_t first = q->cap - off < n ? q->cap - off : n;
+    memcpy(q->buf + off, src, first);
+    memcpy(q->buf, (const char *)src + first, n - first);
+}
+
+/* Copy n bytes out of the ring starting at (unmasked) offset off */
+static void ring_read(const lsq_t *q, size_t off, void *dst, size_t n) {
+    off &= q->cap - 1;
+    size_t first = q->cap - off < n ? q->cap - off : n;
+    memcpy(dst, q->buf + off, first);
+    memcpy((char *)dst + first, q->buf, n - first);
+}
+
+/* Read the length tag stored at offset off */
+static size_t read_tag(const lsq_t *q, size_t off) {
+    uint32_t tag;
+    ring_read(q, off, &tag, TAG_SIZE);
+    return (size_t)tag;
+}
+
+/* Write a record for string s of length len, starting at offset off */
+static void write_record(lsq_t *q, size_t off, const char *s, size_t len) {
+    uint32_t tag = (uint32_t)len;
+    ring_write(q, off, &tag, TAG_SIZE);
+    ring_write(q, off + TAG_SIZE, s, len);
+    ring_write(q, off + TAG_SIZE + len, &tag, TAG_SIZE);
+}
+
+/* Copy up to bufsize - 1 bytes of a payload into buf and terminate it */
+static void copy_out(const lsq_t *q, size_t off, size_t len, char *buf,
+                     size_t bufsize) {
+    if (!buf || !bufsize)
+        return;
+    size_t n = len < bufsize - 1 ? len : bufsize - 1;
+    ring_read(q, off, buf, n);
+    buf[n] = '\0';
+}
+
+/**
+ * @brief Makes sure the ring has room for `need` more bytes
+ *
+ * When the ring is full it is replaced by one of at least twice the size,
+ * with the live records copied to the front of the new buffer.
+ *
+ * @return false if the larger buffer could not be allocated
+ */
+static bool reserve(lsq_t *q, size_t need) {
+    if (q->cap - q->used >= need)
+        return true;
+
+    size_t newcap = q->cap ? q->cap : MIN_CAPACITY;
+    while (newcap - q->used < need) {
+        if (newcap > SIZE_MAX / 2)
+            return false;
+        newcap *= 2;
+    }
+    char *newbuf = malloc(newcap);
+    if (!newbuf)
+        return false;
+    if (q->used)
+        ring_read(q, q->head, newbuf, q->used);
+    free(q->buf);
+    q->buf = newbuf;
+    q->cap = newcap;
+    q->head = 0;
+    return true;
+}
+
+/* Append a record after the physical tail of the ring */
+static bool push_back(lsq_t *q, const char *s) {
+    size_t len = strlen(s);
+    if (len > UINT32_MAX || !reserve(q, record_size(len)))
+        return false;
+    write_record(q, q->head + q->used, s, len);
+    q->used += record_size(len);
+    q->size++;
+    return true;
+}
+
+/* Prepend a record before the physical head of the ring */
+static bool push_front(lsq_t *q, const char *s) {
+    size_t len = strlen(s);
+    if (len > UINT32_MAX || !reserve(q, record_size(len)))
+        return false;
+    q->head = (q->head - record_size(len)) & (q->cap - 1);
+    write_record(q, q->head, s, len);
+    q->used += record_size(len);
+    q->size++;
+    return true;
+}
+
+/* Remove the record at the physical head of the ring */
+static void pop_front(lsq_t *q, char *buf, size_t bufsize) {
+    size_t len = read_tag(q, q->head);
+    copy_out(q, q->head + TAG_SIZE, len, buf, bufsize);
+    q->head = (q->head + record_size(len)) & (q->cap - 1);
+    q->used -= record_size(len);
+    q->size--;
+}
+
+/* Remove the record at the physical tail of the ring */
+static void pop_back(lsq_t *q, char *buf, size_t bufsize) {
+    size_t end = q->head + q->used;
+    size_t len = read_tag(q, end - TAG_SIZE);
+    copy_out(q, end - TAG_SIZE - len, len, buf, bufsize);
+    q->used -= record_size(len);
+    q->size--;
+}
+
+/**
+ * @brief Allocates a new log-structured queue
+ *
+ * The ring itself is not allocated until the first insertion.
+ *
+ * @return The new queue, or NULL if memory allocation failed
+ */
+lsq_t *lsq_new(void) {
+    lsq_t *q = malloc(sizeof(lsq_t));
+    if (!q)
+        return NULL;
+
+    q->buf = NULL;
+    q->cap = 0;
+    q->head = 0;
+    q->used = 0;
+    q->size = 0;
+    q->reversed = false;
+
+    return q;
+}
+
+/**
+ * @brief Frees all memory used by a queue
+ * @param[in] q The queue to free
+ */
+void lsq_free(lsq_t *q) {
+    if (!q)
+        return;
+
+    free(q->buf);
+    free(q);
+}
+
+/**
+ * @brief Attempts to insert an element at head of a queue
+ *
+ * The string is copied into the ring; no memory is allocated unless the
+ * ring has to grow.
+ *
+ * @param[in] q The queue to insert into
+ * @param[in] s String to be copied and inserted into the queue
+ *
+ * @return true if insertion was successful
+ * @return false if q is NULL, or the ring could not grow
+ */
+bool lsq_insert_head(lsq_t *q, const char *s) {
+    if (!q || !s)
+        return false;
+
+    return q->reversed ? push_back(q, s) : push_front(q, s);
+}
+
+/**
+ * @brief Attempts to insert an element at tail of a queue
+ *
+ * @param[in] q The queue to insert into
+ * @param[in] s String to be copied and inserted into the queue
+ *
+ * @return true if insertion was successful
+ * @return false if q is NULL, or the ring could not grow
+ */
+bool lsq_insert_tail(lsq_t *q, const char *s) {
+    if (!q || !s)
+        return false;
+
+    return q->reversed ? push_front(q, s) : push_back(q, s);
+}
+
+/**
+ * @brief Attempts to remove an element from head of a queue
+ *
+ * If removal succeeds and `buf` is non-NULL, this function copies up to
+ * `bufsize - 1` characters from the removed string into `buf`, and writes
+ * a null terminator '\0' after the copied string.
+ *
+ * @param[in]  q       The queue to remove from
+ * @param[out] buf     Output buffer to write a string value into
+ * @param[in]  bufsize Size of the buffer `buf` points to
+ *
+ * @return true if removal succeeded
+ * @return false if q is NULL or empty
+ */
+bool lsq_remove_head(lsq_t *q, char *buf, size_t bufsize) {
+    if (!q || !q->size)
+        return false;
+
+    if (q->reversed)
+        pop_back(q, buf, bufsize);
+    else
+        pop_front(q, buf, bufsize);
+
+    /* Restart from the front of the ring once it drains */
+    if (!q->size)
+        q->head = 0;
+
+    return true;
+}
+
+/**
+ * @brief Returns the number of elements in a queue
+ *
+ * @param[in] q The queue to examine
+ *
+ * @return the number of elements in the queue, or
+ *         0 if q is NULL or empty
+ */
+size_t lsq_size(lsq_t *q) {
+    if (!q)
+        return 0;
+
+    return q->size;
+}
+
+/**
+ * @brief Reverse the elements in a queue
+ *
+ * Since every record carries its length at both ends, reversal only flips
+ * which end of the ring is treated as the head.  It runs in O(1) time and
+ * does not touch the records.
+ *
+ * @param[in] q The queue to reverse
+ */
+void lsq_reverse(lsq_t *q) {
+    if (!q)
+        return;
+
+    q->reversed = !q->reversed;
+}
+
+/**
+ * @brief Positions a cursor before the head element of a queue
+ *
+ * @param[in]  q The queue to walk
+ * @param[out] c The cursor to initialize
+ */
+void lsq_cursor_init(const lsq_t *q, lsq_cursor_t *c) {
+    c->off = q->reversed ? q->head + q->used : q->head;
+    c->left = q->size;
+}
+
+/**
+ * @brief Copies the element under a cursor and advances the cursor
+ *
+ * The element is copied into `buf` in the same way as lsq_remove_head,
+ * but stays in the queue.
+ *
+ * @param[in]     q       The queue being walked
+ * @param[in,out] c       Cursor set up by lsq_cursor_init
+ * @param[out]    buf     Output buffer to write a string value into
+ * @param[in]     bufsize Size of the buffer `buf` points to
+ *
+ * @return false once every element has been visited
+ */
+bool lsq_cursor_next(const lsq_t *q, lsq_cursor_t *c, char *buf,
+                     size_t bufsize) {
+    if (!c->left)
+        return false;
+
+    size_t start;
+    size_t len;
+    if (q->reversed) {
+        len = read_tag(q, c->off - TAG_SIZE);
+        c->off -= record_size(len);
+        start = c->off;
+    } else {
+        len = read_tag(q, c->off);
+        start = c->off;
+        c->off += record_size(len);
+    }
+    copy_out(q, start + TAG_SIZE, len, buf, bufsize);
+    c->left--;
+    return true;
+}
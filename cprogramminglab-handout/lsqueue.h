@@ -0,0 +1,71 @@
+/**
+ * @file lsqueue.h
+ * @brief Log-structured queue of strings kept in one circular byte buffer.
+ *
+ * Each element is stored as a record made of a 32-bit length tag, the
+ * string bytes (without terminator), and a second copy of the length tag.
+ * Records are appended to and consumed from a single power-of-two ring, so
+ * inserting and removing an element is a memcpy with no per-element malloc.
+ * The trailing tag lets the ring be read from either end, which is how
+ * reversal is done in O(1).
+ */
+
+#ifndef LSQUEUE_H
+#define LSQUEUE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/************** Data structure declarations ****************/
+
+/**
+ * @brief Queue whose elements live back to back in a circular buffer.
+ */
+typedef struct {
+    char *buf;     /* Ring of records, or NULL before first insert */
+    size_t cap;    /* Size of buf in bytes, always a power of two */
+    size_t head;   /* Offset of the first byte of the first record */
+    size_t used;   /* Number of bytes occupied by records */
+    size_t size;   /* Number of records in the ring */
+    bool reversed; /* When set, logical head is the physical tail */
+} lsq_t;
+
+/**
+ * @brief Position of a walk over the records of a queue.
+ */
+typedef struct {
+    size_t off;  /* Unmasked offset of the next record boundary */
+    size_t left; /* Records still to be visited */
+} lsq_cursor_t;
+
+/************** Operations on queue ************************/
+
+/* Create empty queue. */
+lsq_t *lsq_new(void);
+
+/* Free ALL storage used by queue. */
+void lsq_free(lsq_t *q);
+
+/* Attempt to insert element at head of queue. */
+bool lsq_insert_head(lsq_t *q, const char *s);
+
+/* Attempt to insert element at tail of queue. */
+bool lsq_insert_tail(lsq_t *q, const char *s);
+
+/* Attempt to remove element from head of queue. */
+bool lsq_remove_head(lsq_t *q, char *sp, size_t bufsize);
+
+/* Return number of elements in queue. */
+size_t lsq_size(lsq_t *q);
+
+/* Reverse elements in queue */
+void lsq_reverse(lsq_t *q);
+
+/* Start a walk from the head of the queue */
+void lsq_cursor_init(const lsq_t *q, lsq_cursor_t *c);
+
+/* Copy the next element into sp and advance.  False when walk is done */
+bool lsq_cursor_next(const lsq_t *q, lsq_cursor_t *c, char *sp,
+                     size_t bufsize);
+
+#endif /* LSQUEUE_H */
@@ -0,0 +1,257 @@
+/**
+ * @file multiqueue.c
+ * @brief Implementation of a sharded relaxed-FIFO queue of strings.
+ *
+ * Each shard is a singly-linked FIFO list protected by a mutex.  The
+ * stamp of a shard's head is also published in an atomic, so removal can
+ * compare two shards without taking either lock.  Stamps are assigned
+ * while the shard lock is held, which keeps every shard sorted.
+ *
+ * Unlike queue.c, this file uses the system allocator, so that mqstress
+ * times the queue rather than the test harness's bookkeeping.
+ */
+
+#include "multiqueue.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Stamp published by a shard with no elements */
+#define EMPTY_STAMP UINT64_MAX
+
+/* Size of a cache line, to keep shards from sharing one */
+#define CACHE_LINE 64
+
+/* One element of a shard */
+typedef struct mq_node {
+    struct mq_node *next;
+    uint64_t stamp; /* Position in insertion order */
+    char value[];   /* Null-terminated copy of the string */
+} mq_node_t;
+
+/* Sub-queue with its own lock */
+typedef struct {
+    _Alignas(CACHE_LINE) pthread_mutex_t lock;
+    mq_node_t *head;
+    mq_node_t *tail;
+    _Atomic uint64_t top; /* Stamp of head, or EMPTY_STAMP */
+} shard_t;
+
+struct multiqueue {
+    shard_t *shards;
+    size_t nshards;
+    _Atomic uint64_t clock; /* Next stamp to hand out */
+    atomic_size_t size;
+};
+
+/* Seeds handed to threads as they first draw a random number */
+static _Atomic uint64_t seed_counter = 0;
+
+/* State of this thread's xorshift generator, 0 until seeded */
+static _Thread_local uint64_t rng_state = 0;
+
+/* Return a random shard index below n */
+static size_t pick_shard(size_t n) {
+    if (!rng_state) {
+        /* splitmix64 spreads consecutive seeds over the whole state */
+        uint64_t z = atomic_fetch_add(&seed_counter, 1) + 1;
+        z *= 0x9E3779B97F4A7C15ULL;
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        rng_state = (z ^ (z >> 31)) | 1;
+    }
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return (size_t)(rng_state % n);
+}
+
+/**
+ * @brief Removes the head of one shard
+ *
+ * @return false if the shard turned out to be empty once locked
+ */
+static bool pop_shard(multiqueue_t *mq, shard_t *sh, char *sp,
+                      size_t bufsize, uint64_t *stamp) {
+    pthread_mutex_lock(&sh->lock);
+    mq_node_t *n = sh->head;
+    if (!n) {
+        pthread_mutex_unlock(&sh->lock);
+        return false;
+    }
+    sh->head = n->next;
+    if (!sh->head)
+        sh->tail = NULL;
+    atomic_store_explicit(&sh->top, sh->head ? sh->head->stamp : EMPTY_STAMP,
+                          memory_order_relaxed);
+    pthread_mutex_unlock(&sh->lock);
+    atomic_fetch_sub_explicit(&mq->size, 1, memory_order_relaxed);
+
+    if (sp && bufsize) {
+        strncpy(sp, n->value, bufsize - 1);
+        sp[bufsize - 1] = '\0';
+    }
+    if (stamp)
+        *stamp = n->stamp;
+    free(n);
+    return true;
+}
+
+/**
+ * @brief Allocates a new queue
+ *
+ * @param[in] nshards Number of sub-queues.  A handful per thread that
+ *                    will use the queue works well; 1 gives a strict FIFO
+ *                    queue behind a single lock.
+ *
+ * @return The new queue, or NULL if memory allocation failed
+ */
+multiqueue_t *mq_new(size_t nshards) {
+    if (nshards == 0)
+        nshards = 1;
+    multiqueue_t *mq = malloc(sizeof(multiqueue_t));
+    if (!mq)
+        return NULL;
+    size_t bytes = nshards * sizeof(shard_t);
+    mq->shards = aligned_alloc(CACHE_LINE, bytes);
+    if (!mq->shards) {
+        free(mq);
+        return NULL;
+    }
+    for (size_t i = 0; i < nshards; i++) {
+        pthread_mutex_init(&mq->shards[i].lock, NULL);
+        mq->shards[i].head = NULL;
+        mq->shards[i].tail = NULL;
+        atomic_init(&mq->shards[i].top, EMPTY_STAMP);
+    }
+    mq->nshards = nshards;
+    atomic_init(&mq->clock, 0);
+    atomic_init(&mq->size, 0);
+    return mq;
+}
+
+/**
+ * @brief Frees all memory used by a queue
+ *
+ * No other thread may be using the queue.
+ *
+ * @param[in] mq The queue to free
+ */
+void mq_free(multiqueue_t *mq) {
+    if (!mq)
+        return;
+
+    for (size_t i = 0; i < mq->nshards; i++) {
+        mq_node_t *n = mq->shards[i].head;
+        while (n) {
+            mq_node_t *next = n->next;
+            free(n);
+            n = next;
+        }
+        pthread_mutex_destroy(&mq->shards[i].lock);
+    }
+    free(mq->shards);
+    free(mq);
+}
+
+/**
+ * @brief Attempts to insert an element into a queue
+ *
+ * The element goes to the tail of a randomly chosen shard.
+ *
+ * @param[in] mq The queue to insert into
+ * @param[in] s  String to be copied and inserted into the queue
+ *
+ * @return true if insertion was successful
+ * @return false if mq is NULL or memory allocation failed
+ */
+bool mq_insert(multiqueue_t *mq, const char *s) {
+    if (!mq || !s)
+        return false;
+
+    size_t len = strlen(s);
+    mq_node_t *n = malloc(sizeof(mq_node_t) + len + 1);
+    if (!n)
+        return false;
+    memcpy(n->value, s, len + 1);
+    n->next = NULL;
+
+    shard_t *sh = &mq->shards[pick_shard(mq->nshards)];
+    pthread_mutex_lock(&sh->lock);
+    n->stamp = atomic_fetch_add_explicit(&mq->clock, 1, memory_order_relaxed);
+    if (sh->tail) {
+        sh->tail->next = n;
+    } else {
+        sh->head = n;
+        atomic_store_explicit(&sh->top, n->stamp, memory_order_relaxed);
+    }
+    sh->tail = n;
+    pthread_mutex_unlock(&sh->lock);
+    atomic_fetch_add_explicit(&mq->size, 1, memory_order_relaxed);
+    return true;
+}
+
+/**
+ * @brief Attempts to remove an element from near the head of a queue
+ *
+ * Two shards are sampled at random and the older of their heads is
+ * removed.  When both samples are empty, every shard is tried in turn so
+ * that a nearly empty queue still drains.  The removed string is copied
+ * into `sp` as in queue_remove_head.
+ *
+ * @param[in]  mq      The queue to remove from
+ * @param[out] sp      Output buffer to write a string value into
+ * @param[in]  bufsize Size of the buffer `sp` points to
+ * @param[out] stamp   If non-NULL, set to the element's insertion order
+ *
+ * @return true if removal succeeded
+ * @return false if mq is NULL or no element was found
+ */
+bool mq_remove(multiqueue_t *mq, char *sp, size_t bufsize, uint64_t *stamp) {
+    if (!mq)
+        return false;
+
+    for (;;) {
+        shard_t *a = &mq->shards[pick_shard(mq->nshards)];
+        shard_t *b = &mq->shards[pick_shard(mq->nshards)];
+        uint64_t ta = atomic_load_explicit(&a->top, memory_order_relaxed);
+        uint64_t tb = atomic_load_explicit(&b->top, memory_order_relaxed);
+        if (tb < ta) {
+            a = b;
+            ta = tb;
+        }
+        if (ta == EMPTY_STAMP)
+            break;
+        if (pop_shard(mq, a, sp, bufsize, stamp))
+            return true;
+    }
+
+    for (size_t i = 0; i < mq->nshards; i++) {
+        shard_t *sh = &mq->shards[i];
+        if (atomic_load_explicit(&sh->top, memory_order_relaxed) !=
+                EMPTY_STAMP &&
+            pop_shard(mq, sh, sp, bufsize, stamp))
+            return true;
+    }
+    return false;
+}
+
+/**
+ * @brief Returns the number of elements in a queue
+ *
+ * While other threads are inserting or removing, the count is only
+ * approximate.
+ *
+ * @param[in] mq The queue to examine
+ *
+ * @return the number of elements in the queue, or
+ *         0 if mq is NULL or empty
+ */
+size_t mq_size(multiqueue_t *mq) {
+    if (!mq)
+        return 0;
+
+    return atomic_load_explicit(&mq->size, memory_order_relaxed);
+}
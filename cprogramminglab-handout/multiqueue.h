@@ -0,0 +1,44 @@
+/**
+ * @file multiqueue.h
+ * @brief Relaxed-FIFO queue of strings sharded for many threads.
+ *
+ * A MultiQueue spreads its elements over several sub-queues ("shards"),
+ * each with its own lock, so that threads rarely contend for the same
+ * head or tail.  Every element is stamped with its insertion order.
+ * Insertion picks a random shard; removal samples two random shards and
+ * takes the head with the smaller stamp.  The result is only roughly
+ * FIFO: an element may be removed while a few older ones are still queued.
+ *
+ * All operations except mq_new and mq_free may be called from several
+ * threads at once.
+ */
+
+#ifndef MULTIQUEUE_H
+#define MULTIQUEUE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/************** Data structure declarations ****************/
+
+typedef struct multiqueue multiqueue_t;
+
+/************** Operations on queue ************************/
+
+/* Create empty queue with nshards sub-queues. */
+multiqueue_t *mq_new(size_t nshards);
+
+/* Free ALL storage used by queue. */
+void mq_free(multiqueue_t *mq);
+
+/* Attempt to insert element into queue. */
+bool mq_insert(multiqueue_t *mq, const char *s);
+
+/* Attempt to remove an element near the head of queue. */
+bool mq_remove(multiqueue_t *mq, char *sp, size_t bufsize, uint64_t *stamp);
+
+/* Return number of elements in queue. */
+size_t mq_size(multiqueue_t *mq);
+
+#endif /* MULTIQUEUE_H */
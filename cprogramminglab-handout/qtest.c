@@ -6,13 +6,25 @@
 
 #include "console.h"
 #include "harness.h"
+#include "journal.h"
+#include "lru.h"
+#include "lsqueue.h"
+#include "multiqueue.h"
 #include "queue.h"
 #include "report.h"
+#include "timerwheel.h"
 
+#include <ctype.h>
 #include <getopt.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 /* A few functions in this file intentionally don't use their
    arguments.  */
@@ -28,16 +40,150 @@
 /*
   How large is a queue before it's considered big.
   This affects how it gets printed
-  and whether cautious mode is used when freeing the list
 */
 #define BIG_QUEUE 30
 
 size_t big_queue_size = BIG_QUEUE;
 
+/***** Queue backends *****/
+
+/*
+  Each queue implementation that qtest can drive is described by a table
+  of operations with the same meaning as the queue_* functions.
+*/
+typedef struct {
+    const char *name;
+    void *(*new)(void);
+    void (*free)(void *q);
+    bool (*insert_head)(void *q, const char *s);
+    bool (*insert_tail)(void *q, const char *s);
+    bool (*remove_head)(void *q, char *sp, size_t bufsize);
+    size_t (*size)(void *q);
+    void (*reverse)(void *q);
+    /* Visit up to limit elements in order.  Return number visited */
+    size_t (*walk)(void *q, size_t limit,
+                   bool (*visit)(const char *s, void *arg), void *arg);
+    /*
+      String stored in the head element, for backends that keep each
+      element in its own allocation.  NULL if not applicable.
+    */
+    char *(*head_value)(void *q);
+} backend_t;
+
+static void *list_new(void) {
+    return queue_new();
+}
+
+static void list_free(void *lq) {
+    queue_free(lq);
+}
+
+static bool list_insert_head(void *lq, const char *s) {
+    return queue_insert_head(lq, s);
+}
+
+static bool list_insert_tail(void *lq, const char *s) {
+    return queue_insert_tail(lq, s);
+}
+
+static bool list_remove_head(void *lq, char *sp, size_t bufsize) {
+    return queue_remove_head(lq, sp, bufsize);
+}
+
+static size_t list_size(void *lq) {
+    return queue_size(lq);
+}
+
+static void list_reverse(void *lq) {
+    queue_reverse(lq);
+}
+
+static size_t list_walk(void *lq, size_t limit,
+                        bool (*visit)(const char *s, void *arg), void *arg) {
+    return queue_walk(lq, limit, visit, arg);
+}
+
+static char *list_head_value(void *lq) {
+    return ((queue_t *)lq)->head->value;
+}
+
+static const backend_t list_backend = {
+    .name = "list",
+    .new = list_new,
+    .free = list_free,
+    .insert_head = list_insert_head,
+    .insert_tail = list_insert_tail,
+    .remove_head = list_remove_head,
+    .size = list_size,
+    .reverse = list_reverse,
+    .walk = list_walk,
+    .head_value = list_head_value,
+};
+
+static void *lsq_backend_new(void) {
+    return lsq_new();
+}
+
+static void lsq_backend_free(void *lq) {
+    lsq_free(lq);
+}
+
+static bool lsq_backend_insert_head(void *lq, const char *s) {
+    return lsq_insert_head(lq, s);
+}
+
+static bool lsq_backend_insert_tail(void *lq, const char *s) {
+    return lsq_insert_tail(lq, s);
+}
+
+static bool lsq_backend_remove_head(void *lq, char *sp, size_t bufsize) {
+    return lsq_remove_head(lq, sp, bufsize);
+}
+
+static size_t lsq_backend_size(void *lq) {
+    return lsq_size(lq);
+}
+
+static void lsq_backend_reverse(void *lq) {
+    lsq_reverse(lq);
+}
+
+static size_t lsq_backend_walk(void *lq, size_t limit,
+                               bool (*visit)(const char *s, void *arg),
+                               void *arg) {
+    char sbuf[MAXSTRING + 1];
+    lsq_cursor_t c;
+    size_t cnt = 0;
+    lsq_cursor_init(lq, &c);
+    while (cnt < limit && lsq_cursor_next(lq, &c, sbuf, sizeof(sbuf)) &&
+           visit(sbuf, arg))
+        cnt++;
+    return cnt;
+}
+
+static const backend_t lsq_backend = {
+    .name = "lsq",
+    .new = lsq_backend_new,
+    .free = lsq_backend_free,
+    .insert_head = lsq_backend_insert_head,
+    .insert_tail = lsq_backend_insert_tail,
+    .remove_head = lsq_backend_remove_head,
+    .size = lsq_backend_size,
+    .reverse = lsq_backend_reverse,
+    .walk = lsq_backend_walk,
+    .head_value = NULL,
+};
+
+static const backend_t *backends[] = {&list_backend, &lsq_backend};
+#define NBACKENDS (sizeof(backends) / sizeof(backends[0]))
+
+/* Backend selected with -b */
+static const backend_t *backend = &list_backend;
+
 /******* Global variables ******/
 
 /* Queue being tested */
-queue_t *q = NULL;
+void *q = NULL;
 /* Number of elements in queue */
 size_t qcnt = 0;
 
@@ -49,6 +195,63 @@ int fail_count = 0;
 int i_string_length = MAXSTRING;
 #define string_length ((size_t)i_string_length)
 
+/* Memory budget in KB for the list queue before it spills to disk */
+int spill_kb = 0;
+
+/* Allocation failure schedule, see harness.h */
+int fail_seed = 0;
+int fail_nth = 0;
+int fail_above = 0;
+
+/* Allocator of test_malloc, an alloc_kind_t */
+int alloc_kind = ALLOC_SYSTEM;
+
+/* Guard every nth allocation with a PROT_NONE page, 0 for none */
+int guard_every = 0;
+
+/* Track live blocks, to catch double and foreign frees (0: off) */
+int cautious_on = 1;
+
+/* Live bytes in KB at which mallocs fail, and whether to fail before */
+int budget_kb = 0;
+int pressure_on = 0;
+
+/* Time every allocation and free when nonzero */
+int latency_on = 0;
+
+/* Call frames recorded per allocation, for leak reports */
+int leak_depth = 1;
+
+/* Time budget in ms of each class of operations, and percent that warns */
+int time_budget_ms[TIME_CLASSES] = {DEFAULT_BUDGET_MS, DEFAULT_BUDGET_MS,
+                                    DEFAULT_BUDGET_MS, DEFAULT_BUDGET_MS,
+                                    DEFAULT_BUDGET_MS, DEFAULT_BUDGET_MS};
+int time_warn_pct = 0;
+int time_ops = 0;
+
+/* Set while allocations are recorded to a trace file */
+static bool alloc_tracing = false;
+
+/* Journal of queue operations, or NULL when journaling is off */
+static journal_t *jnl = NULL;
+
+/* Allocation profile at the previous memstat */
+static alloc_stats_t last_stats;
+
+/* Cache exercised by the cache commands, or NULL */
+static lru_t *cache = NULL;
+
+/* Log an operation that succeeded on the queue */
+static bool journal_record(journal_op_t op, const char *s) {
+    if (!jnl || journal_log(jnl, op, s))
+        return true;
+    report(1, "ERROR:  Could not write journal record");
+    return false;
+}
+
+/* Put a freshly created list queue in spill mode if a budget is set */
+static void apply_spill_budget(void);
+
 /****** Forward declarations ******/
 static bool show_queue(int vlevel);
 bool do_new(int argc, char *argv[]);
@@ -60,12 +263,51 @@ bool do_remove_head_quiet(int argc, char *argv[]);
 bool do_reverse(int argc, char *argv[]);
 bool do_size(int argc, char *argv[]);
 bool do_show(int argc, char *argv[]);
+bool do_find(int argc, char *argv[]);
+bool do_find_prefix(int argc, char *argv[]);
+bool do_find_bench(int argc, char *argv[]);
+bool do_iter_bench(int argc, char *argv[]);
+bool do_complexity(int argc, char *argv[]);
+bool do_pmap(int argc, char *argv[]);
+bool do_spill_stat(int argc, char *argv[]);
+bool do_journal(int argc, char *argv[]);
+bool do_recover(int argc, char *argv[]);
+bool do_journal_bench(int argc, char *argv[]);
+bool do_mq_stress(int argc, char *argv[]);
+bool do_alloc_stress(int argc, char *argv[]);
+bool do_cache(int argc, char *argv[]);
+bool do_cache_get(int argc, char *argv[]);
+bool do_cache_put(int argc, char *argv[]);
+bool do_cache_replay(int argc, char *argv[]);
+bool do_cache_stat(int argc, char *argv[]);
+bool do_wheel_bench(int argc, char *argv[]);
+bool do_gen(int argc, char *argv[]);
+static void spill_changed(int oldval);
+static void fail_probability_changed(int oldval);
+static void fail_seed_changed(int oldval);
+static void fail_nth_changed(int oldval);
+static void fail_above_changed(int oldval);
+static void budget_changed(int oldval);
+static void alloc_kind_changed(int oldval);
+static void latency_changed(int oldval);
+static void leak_depth_changed(int oldval);
+static void time_budget_changed(int oldval);
+static void guard_changed(int oldval);
+static void cautious_changed(int oldval);
+static void time_warn_changed(int oldval);
+static void time_ops_changed(int oldval);
+bool do_fail_record(int argc, char *argv[]);
+bool do_fail_replay(int argc, char *argv[]);
+bool do_alloc_trace(int argc, char *argv[]);
+bool do_memstat(int argc, char *argv[]);
+bool do_latency(int argc, char *argv[]);
+bool do_timing(int argc, char *argv[]);
 
 static void queue_init(void);
 
 static void console_init(void) {
     add_cmd("new", do_new, "                | Create new queue");
-    add_cmd("free", do_free, "                | Delete queue");
+    add_cmd("free", do_free, "                | Delete queue and cache");
     add_cmd("ih", do_insert_head,
             " str [n]        | Insert string str at head of queue n times "
             "(default: n == 1)");
@@ -82,12 +324,139 @@ static void console_init(void) {
     add_cmd("size", do_size,
             " [n]            | Compute queue size n times (default: n == 1)");
     add_cmd("show", do_show, "                | Show queue contents");
+    add_cmd("find", do_find, " str            | Search queue for value str");
+    add_cmd("findp", do_find_prefix,
+            " str            | Count elements whose value starts with str");
+    add_cmd("findbench", do_find_bench,
+            " [n]            | Time searches in a fresh queue of n elements "
+            "(default: n == 1000000)");
+    add_cmd("iterbench", do_iter_bench,
+            " [n]            | Time traversals of a fresh queue of n elements "
+            "at several prefetch distances (default: n == 1000000)");
+    add_cmd("complexity", do_complexity,
+            " [n] [file]     | Fit how the cost of it, size, rh and reverse "
+            "grows with queue size, up to n elements, and flag operations "
+            "slower than their contract (default: n == 65536)");
+    add_cmd("pmap", do_pmap,
+            " fn [t]         | Apply fn (upper, lower, check) to every element "
+            "on t threads (default: t == 4)");
+    add_cmd("spillstat", do_spill_stat,
+            "                | Show bytes of queue in memory and on disk");
+    add_cmd("journal", do_journal,
+            " [file [us]]    | Journal queue operations to file, syncing "
+            "every us microseconds (default: 0).  No file: stop journaling");
+    add_cmd("recover", do_recover,
+            " file           | Rebuild queue by replaying journal file");
+    add_cmd("journalbench", do_journal_bench,
+            " file [n]       | Time n journaled inserts and removes at several "
+            "commit windows (default: n == 2000)");
+    add_cmd("mqstress", do_mq_stress,
+            " [t] [n]        | Time n removes and inserts per thread on a "
+            "sharded queue with 1, 2, 4 ... t threads (default: t == 8, "
+            "n == 100000)");
+    add_cmd("allocstress", do_alloc_stress,
+            " [t] [n]        | Allocate n blocks on each of t threads, freeing "
+            "half on another thread, and check the harness counted exactly "
+            "(default: t == 4, n == 100000)");
+    add_cmd("cache", do_cache,
+            " [n] [bytes]    | Create LRU cache holding at most n entries and "
+            "bytes bytes (default: 0 == no limit)");
+    add_cmd("cget", do_cache_get, " key            | Look up key in cache");
+    add_cmd("cput", do_cache_put,
+            " key val        | Store value val for key in cache");
+    add_cmd("creplay", do_cache_replay,
+            " file           | Look up each line of file as a key, storing "
+            "keys that miss.  Report hit rate and time per lookup");
+    add_cmd("cstat", do_cache_stat,
+            "                | Show cache size and counters");
+    add_cmd("wheelbench", do_wheel_bench,
+            " [n]            | Time n timers with random deadlines on a timing "
+            "wheel, cancelling every tenth (default: n == 1000000)");
+    add_cmd("gen", do_gen,
+            " n [mix ...]    | Run n random operations on the queue and report "
+            "throughput.  Then: mix of ih, it, rh, reverse and size such as "
+            "it:40,rh:40,ih:10,reverse:10; string length as len, lo-hi or "
+            "~mean; percent of inserts repeating a recent string; seed "
+            "(default: that mix, 1-16, 0, 1)");
+    add_cmd("failrecord", do_fail_record,
+            " [file]         | Record which allocations fail.  With file: "
+            "stop and save the record to file");
+    add_cmd("failreplay", do_fail_replay,
+            " [file]         | Fail allocations as recorded in file.  No file: "
+            "stop replaying");
+    add_cmd("alloctrace", do_alloc_trace,
+            " [file]         | Record every malloc and free to file, for "
+            "areplay.  No file: stop recording");
+    add_cmd("memstat", do_memstat,
+            " [cmd arg ...]  | Show allocation profile and change since last "
+            "memstat, or the allocations made by cmd");
+    add_cmd("latency", do_latency,
+            " [reset|file]   | Show malloc/free latency percentiles, clear "
+            "them, or save the histograms to file (see option latency)");
+    add_cmd("timing", do_timing,
+            " [reset]        | Show how much of their time budgets operations "
+            "used, or clear the record");
     add_param("length", &i_string_length, "Maximum length of displayed string",
               NULL);
     add_param("malloc", &fail_probability, "Malloc failure probability percent",
-              NULL);
+              fail_probability_changed);
     add_param("fail", &fail_limit,
               "Number of times allow queue operations to return false", NULL);
+    add_param("spill", &spill_kb,
+              "KB of queue kept in memory before spilling to disk (0: off)",
+              spill_changed);
+    add_param("seed", &fail_seed, "Seed for random malloc failures",
+              fail_seed_changed);
+    add_param("failnth", &fail_nth,
+              "Make the nth malloc from now on fail (0: off)",
+              fail_nth_changed);
+    add_param("failabove", &fail_above,
+              "Make mallocs of more than this many bytes fail (0: off)",
+              fail_above_changed);
+    add_param_choices("alloc", &alloc_kind,
+                      "Allocator behind malloc (system, arena, slab, hugepage)",
+                      alloc_kind_changed, allocator_names);
+    add_param("guard", &guard_every,
+              "Put every nth malloc right before an inaccessible page, to "
+              "fault on overruns (0: off)",
+              guard_changed);
+    add_param("cautious", &cautious_on,
+              "Track live blocks to catch double and foreign frees (0: off)",
+              cautious_changed);
+    add_param("budget", &budget_kb,
+              "Fail mallocs once live blocks would exceed this many KB (0: off)",
+              budget_changed);
+    add_param("pressure", &pressure_on,
+              "Also fail mallocs at random above half the budget (0: off)",
+              budget_changed);
+    add_param("latency", &latency_on,
+              "Record latency histograms of malloc and free (0: off)",
+              latency_changed);
+    add_param("leakdepth", &leak_depth,
+              "Call frames recorded to show where leaked blocks came from "
+              "(0: off)",
+              leak_depth_changed);
+    add_param("talloc", &time_budget_ms[TIME_ALLOC],
+              "Time budget in ms of new and free", time_budget_changed);
+    add_param("tinsert", &time_budget_ms[TIME_INSERT],
+              "Time budget in ms of ih and it", time_budget_changed);
+    add_param("tremove", &time_budget_ms[TIME_REMOVE],
+              "Time budget in ms of rh and rhq", time_budget_changed);
+    add_param("treverse", &time_budget_ms[TIME_REVERSE],
+              "Time budget in ms of reverse", time_budget_changed);
+    add_param("tsize", &time_budget_ms[TIME_SIZE],
+              "Time budget in ms of size", time_budget_changed);
+    add_param("tsearch", &time_budget_ms[TIME_SEARCH],
+              "Time budget in ms of show, find and findp",
+              time_budget_changed);
+    add_param("timewarn", &time_warn_pct,
+              "Warn when an operation uses this percent of its time budget "
+              "(0: off)",
+              time_warn_changed);
+    add_param("timeops", &time_ops,
+              "Report how much of its time budget each operation used "
+              "(0: off)",
+              time_ops_changed);
 }
 
 bool do_new(int argc, char *argv[]) {
@@ -101,10 +470,12 @@ bool do_new(int argc, char *argv[]) {
         ok = do_free(argc, argv);
     }
     error_check();
-    arm_timeout();
-    q = queue_new();
+    arm_timeout(TIME_ALLOC);
+    q = backend->new();
     cancel_timeout();
     qcnt = 0;
+    apply_spill_budget();
+    ok = journal_record(q ? JOURNAL_NEW : JOURNAL_FREE, NULL) && ok;
     show_queue(3);
     return ok && !error_check();
 }
@@ -118,19 +489,21 @@ bool do_free(int argc, char *argv[]) {
     if (q == NULL)
         report(3, "Warning: Calling free on null queue");
     error_check();
-    if (qcnt > big_queue_size)
-        set_cautious_mode(false);
-    arm_timeout();
-    queue_free(q);
+    arm_timeout(TIME_ALLOC);
+    backend->free(q);
     cancel_timeout();
-    set_cautious_mode(true);
     q = NULL;
     qcnt = 0;
+    /* Cache entries are harness blocks too */
+    lru_free(cache);
+    cache = NULL;
+    ok = journal_record(JOURNAL_FREE, NULL) && ok;
     show_queue(3);
     size_t bcnt = allocation_check();
     if (bcnt > 0) {
         report(1, "ERROR: Freed queue, but %lu blocks are still allocated",
                bcnt);
+        report_leaks(1);
         ok = false;
     }
     return ok && !error_check();
@@ -156,26 +529,30 @@ bool do_insert_head(int argc, char *argv[]) {
     if (q == NULL)
         report(3, "Warning: Calling insert head on null queue");
     error_check();
-    arm_timeout();
+    arm_timeout(TIME_INSERT);
     for (r = 0; ok && r < reps; r++) {
-        bool rval = queue_insert_head(q, inserts);
+        bool rval = backend->insert_head(q, inserts);
         if (rval) {
             qcnt++;
-            if (!q->head->value) {
+            if (!journal_record(JOURNAL_INSERT_HEAD, inserts))
+                ok = false;
+            /* Backends without head_value copy strings into shared storage */
+            char *heads = backend->head_value ? backend->head_value(q) : NULL;
+            if (backend->head_value && !heads) {
                 report(1, "ERROR: Failed to save copy of string in list");
                 ok = false;
-            } else if (r == 0 && inserts == q->head->value) {
+            } else if (heads && r == 0 && inserts == heads) {
                 report(1, "ERROR: Need to allocate and copy string for new "
                           "list element");
                 ok = false;
                 break;
-            } else if (r == 1 && lasts == q->head->value) {
+            } else if (heads && r == 1 && lasts == heads) {
                 report(1, "ERROR: Need to allocate separate string for each "
                           "list element");
                 ok = false;
                 break;
             }
-            lasts = q->head->value;
+            lasts = heads;
         } else {
             fail_count++;
             if (fail_count < fail_limit)
@@ -186,9 +563,9 @@ bool do_insert_head(int argc, char *argv[]) {
                 ok = false;
             }
         }
-        ok = ok && !error_check();
     }
     cancel_timeout();
+    ok = ok && !error_check();
     show_queue(3);
     return ok;
 }
@@ -212,12 +589,14 @@ bool do_insert_tail(int argc, char *argv[]) {
     if (q == NULL)
         report(3, "Warning: Calling insert tail on null queue");
     error_check();
-    arm_timeout();
+    arm_timeout(TIME_INSERT);
     for (r = 0; ok && r < reps; r++) {
-        bool rval = queue_insert_tail(q, inserts);
+        bool rval = backend->insert_tail(q, inserts);
         if (rval) {
             qcnt++;
-            if (!q->head->value) {
+            if (!journal_record(JOURNAL_INSERT_TAIL, inserts))
+                ok = false;
+            if (backend->head_value && !backend->head_value(q)) {
                 report(1, "ERROR: Failed to save copy of string in list");
                 ok = false;
             }
@@ -231,13 +610,26 @@ bool do_insert_tail(int argc, char *argv[]) {
                 ok = false;
             }
         }
-        ok = ok && !error_check();
     }
     cancel_timeout();
+    ok = ok && !error_check();
     show_queue(3);
     return ok;
 }
 
+/*
+  In spill mode, removing from a queue whose front is on disk needs
+  memory to read it back in.  True if a removal failed for that reason,
+  which is an allocation failure rather than an empty queue.
+*/
+static bool reload_failed(void) {
+    if (backend != &list_backend || qcnt == 0)
+        return false;
+    size_t resident, spilled, nspilled;
+    queue_spill_stats(q, &resident, &spilled, &nspilled);
+    return nspilled > 0;
+}
+
 bool do_remove_head(int argc, char *argv[]) {
     if (argc != 1 && argc != 2) {
         report(1, "%s needs 0-1 arguments", argv[0]);
@@ -269,11 +661,11 @@ bool do_remove_head(int argc, char *argv[]) {
 
     if (q == NULL)
         report(3, "Warning: Calling remove head on null queue");
-    else if (q->head == NULL)
+    else if (qcnt == 0)
         report(3, "Warning: Calling remove head on empty queue");
     error_check();
-    arm_timeout();
-    bool rval = queue_remove_head(q, removes, string_length + 1);
+    arm_timeout(TIME_REMOVE);
+    bool rval = backend->remove_head(q, removes, string_length + 1);
     cancel_timeout();
     if (rval) {
         removes[string_length + STRINGPAD] = '\0';
@@ -288,6 +680,18 @@ bool do_remove_head(int argc, char *argv[]) {
             report(2, "Removed %s from queue", removes);
         }
         qcnt--;
+        ok = journal_record(JOURNAL_REMOVE_HEAD, NULL) && ok;
+    } else if (reload_failed()) {
+        fail_count++;
+        if (fail_count < fail_limit) {
+            report(2, "Removal failed: no memory to read spilled elements");
+        } else {
+            report(1,
+                   "ERROR:  Removal failed: no memory to read spilled "
+                   "elements (%d failures total)",
+                   fail_count);
+            ok = false;
+        }
     } else {
         fail_count++;
         if (!check && fail_count < fail_limit) {
@@ -298,7 +702,7 @@ bool do_remove_head(int argc, char *argv[]) {
             ok = false;
         }
     }
-    if (ok && check && strcmp(removes, checks) != 0) {
+    if (ok && check && rval && strcmp(removes, checks) != 0) {
         report(1, "ERROR:  Removed value %s != expected value %s", removes,
                checks);
         ok = false;
@@ -317,21 +721,26 @@ bool do_remove_head_quiet(int argc, char *argv[]) {
     bool ok = true;
     if (q == NULL)
         report(3, "Warning: Calling remove head on null queue");
-    else if (q->head == NULL)
+    else if (qcnt == 0)
         report(3, "Warning: Calling remove head on empty queue");
     error_check();
-    arm_timeout();
-    bool rval = queue_remove_head(q, NULL, 0);
+    arm_timeout(TIME_REMOVE);
+    bool rval = backend->remove_head(q, NULL, 0);
     cancel_timeout();
     if (rval) {
         report(2, "Removed element from queue");
         qcnt--;
+        ok = journal_record(JOURNAL_REMOVE_HEAD, NULL) && ok;
     } else {
         fail_count++;
+        const char *why = reload_failed()
+                              ? "Removal failed: no memory to read spilled "
+                                "elements"
+                              : "Removal failed";
         if (fail_count < fail_limit)
-            report(2, "Removal failed");
+            report(2, "%s", why);
         else {
-            report(1, "ERROR: Removal failed (%d failures total)", fail_count);
+            report(1, "ERROR: %s (%d failures total)", why, fail_count);
             ok = false;
         }
     }
@@ -348,12 +757,13 @@ bool do_reverse(int argc, char *argv[]) {
         report(3, "Warning: Calling reverse on null queue");
     error_check();
     set_noallocate_mode(true);
-    arm_timeout();
-    queue_reverse(q);
+    arm_timeout(TIME_REVERSE);
+    backend->reverse(q);
     cancel_timeout();
     set_noallocate_mode(false);
     show_queue(3);
-    return !error_check();
+    bool ok = journal_record(JOURNAL_REVERSE, NULL);
+    return ok && !error_check();
 }
 
 bool do_size(int argc, char *argv[]) {
@@ -377,12 +787,11 @@ bool do_size(int argc, char *argv[]) {
     if (q == NULL)
         report(3, "Warning: Calling size on null queue");
     error_check();
-    arm_timeout();
-    for (r = 0; ok && r < reps; r++) {
-        cnt = queue_size(q);
-        ok = ok && !error_check();
-    }
+    arm_timeout(TIME_SIZE);
+    for (r = 0; r < reps; r++)
+        cnt = backend->size(q);
     cancel_timeout();
+    ok = !error_check();
     if (ok) {
         if (qcnt == cnt) {
             report(2, "Queue size = %d", cnt);
@@ -398,32 +807,41 @@ bool do_size(int argc, char *argv[]) {
     return ok && !error_check();
 }
 
+/* Progress of show_queue through the queue */
+typedef struct {
+    int vlevel;
+    size_t cnt;
+    bool ok;
+} show_state_t;
+
+static bool show_visit(const char *s, void *arg) {
+    show_state_t *st = arg;
+    if (st->cnt < qcnt && st->cnt < big_queue_size)
+        report_noreturn(st->vlevel, st->cnt == 0 ? "%s" : " %s", s);
+    st->cnt++;
+    st->ok = st->ok && !error_check();
+    return st->ok;
+}
+
 static bool show_queue(int vlevel) {
-    bool ok = true;
     if (verblevel < vlevel)
         return true;
-    size_t cnt = 0;
     if (q == NULL) {
         report(vlevel, "q = NULL");
         return true;
     }
+    show_state_t st = {vlevel, 0, true};
     report_noreturn(vlevel, "q = [");
-    arm_timeout();
-    list_ele_t *e = q->head;
-    while (ok && e && cnt < qcnt) {
-        if (cnt < big_queue_size)
-            report_noreturn(vlevel, cnt == 0 ? "%s" : " %s", e->value);
-        e = e->next;
-        cnt++;
-        ok = ok && !error_check();
-    }
+    arm_timeout(TIME_SEARCH);
+    /* Walking one element past qcnt detects cycles and miscounts */
+    backend->walk(q, qcnt + 1, show_visit, &st);
     cancel_timeout();
-    if (!ok) {
+    if (!st.ok) {
         report(vlevel, " ... ]");
         return false;
     }
-    if (e == NULL) {
-        if (cnt <= big_queue_size)
+    if (st.cnt <= qcnt) {
+        if (st.cnt <= big_queue_size)
             report(vlevel, "]");
         else
             report(vlevel, " ... ]");
@@ -433,9 +851,9 @@ static bool show_queue(int vlevel) {
             vlevel,
             "ERROR:  Either list has cycle, or queue has more than %d elements",
             qcnt);
-        ok = false;
+        return false;
     }
-    return ok;
+    return true;
 }
 
 bool do_show(int argc, char *argv[]) {
@@ -446,82 +864,1832 @@ bool do_show(int argc, char *argv[]) {
     return show_queue(0);
 }
 
-static void queue_init() {
-    fail_count = 0;
-    q = NULL;
+/* Search by comparing every string in full, as a baseline for queue_find */
+static list_ele_t *find_strcmp(queue_t *sq, const char *s) {
+    for (list_ele_t *e = sq->head; e; e = e->next) {
+        if (strcmp(e->value, s) == 0)
+            return e;
+    }
+    return NULL;
 }
 
-static bool queue_quit(int argc UNUSED, char *argv[] UNUSED) {
-    report(3, "Freeing queue");
-    if (qcnt > big_queue_size)
-        set_cautious_mode(false);
-    arm_timeout();
-    queue_free(q);
+/* Count values starting with p by comparing every string in full */
+static size_t count_prefix_strncmp(queue_t *sq, const char *p) {
+    size_t cnt = 0;
+    for (list_ele_t *e = sq->head; e; e = e->next)
+        cnt += strncmp(e->value, p, strlen(p)) == 0;
+    return cnt;
+}
+
+/* Commands that use list-specific queue functions */
+static bool need_list_backend(const char *cmd) {
+    if (backend == &list_backend)
+        return true;
+    report(1, "%s is not supported by the %s backend", cmd, backend->name);
+    return false;
+}
+
+/* Commands that hand out or rewrite elements need all of them in memory */
+static bool need_resident(const char *cmd) {
+    if (!need_list_backend(cmd))
+        return false;
+    size_t resident, spilled, nspilled;
+    queue_spill_stats(q, &resident, &spilled, &nspilled);
+    if (nspilled == 0)
+        return true;
+    report(1, "%s is not supported while %zu elements are spilled to disk",
+           cmd, nspilled);
+    return false;
+}
+
+bool do_find(int argc, char *argv[]) {
+    if (argc != 2) {
+        report(1, "%s needs 1 argument", argv[0]);
+        return false;
+    }
+    if (!need_resident(argv[0]))
+        return false;
+    if (q == NULL)
+        report(3, "Warning: Calling find on null queue");
+    error_check();
+    arm_timeout(TIME_SEARCH);
+    list_ele_t *e = queue_find(q, argv[1]);
     cancel_timeout();
-    set_cautious_mode(true);
-    size_t bcnt = allocation_check();
-    if (bcnt > 0) {
-        report(1, "ERROR: Freed queue, but %lu blocks are still allocated",
-               bcnt);
+    bool ok = true;
+    if (e && strcmp(e->value, argv[1]) != 0) {
+        report(1, "ERROR:  Search for %s returned element with value %s",
+               argv[1], e->value);
+        ok = false;
+    } else if (!e && q && find_strcmp(q, argv[1])) {
+        report(1, "ERROR:  Search for %s missed a matching element", argv[1]);
+        ok = false;
+    } else {
+        report(2, e ? "Found %s in queue" : "%s not found in queue", argv[1]);
+    }
+    return ok && !error_check();
+}
+
+/* Check each match reported by queue_find_prefix */
+static bool find_prefix_visit(const char *s, void *arg) {
+    const char *p = arg;
+    if (strncmp(s, p, strlen(p)) != 0) {
+        report(1, "ERROR:  Element %s does not start with %s", s, p);
         return false;
     }
     return true;
 }
 
-static void usage(char *cmd) {
-    printf("Usage: %s [-h] [-f IFILE][-v VLEVEL][-l LFILE]\n", cmd);
-    printf("\t-h         Print this information\n");
-    printf("\t-f IFILE   Read commands from IFILE\n");
-    printf("\t-v VLEVEL  Set verbosity level\n");
-    printf("\t-l LFILE   Echo results to LFILE\n");
-    exit(0);
+bool do_find_prefix(int argc, char *argv[]) {
+    if (argc != 2) {
+        report(1, "%s needs 1 argument", argv[0]);
+        return false;
+    }
+    if (!need_resident(argv[0]))
+        return false;
+    if (q == NULL)
+        report(3, "Warning: Calling find prefix on null queue");
+    error_check();
+    arm_timeout(TIME_SEARCH);
+    size_t cnt = queue_find_prefix(q, argv[1], find_prefix_visit, argv[1]);
+    cancel_timeout();
+    bool ok = true;
+    size_t expected = q ? count_prefix_strncmp(q, argv[1]) : 0;
+    if (cnt != expected) {
+        report(1, "ERROR:  Found %zu elements starting with %s, expected %zu",
+               cnt, argv[1], expected);
+        ok = false;
+    } else {
+        report(2, "%zu elements start with %s", cnt, argv[1]);
+    }
+    return ok && !error_check();
 }
 
-#define BUFSIZE 256
+/* Number of times each search is repeated by findbench */
+#define FIND_REPS 5
 
-int main(int argc, char *argv[]) {
-    /* To hold input file name */
-    char buf[BUFSIZE];
-    char *infile_name = NULL;
-    char lbuf[BUFSIZE];
-    char *logfile_name = NULL;
-    int level = 4;
-    int c;
+/* Build a queue of n distinct keys for a benchmark.  NULL on failure */
+static queue_t *bench_queue(int n) {
+    queue_t *bq = queue_new();
+    if (!bq) {
+        report(1, "ERROR:  Could not allocate benchmark queue");
+        return NULL;
+    }
+    char key[32];
+    for (int i = 0; i < n; i++) {
+        snprintf(key, sizeof(key), "key%07d", i);
+        if (!queue_insert_tail(bq, key)) {
+            report(1, "ERROR:  Could not build benchmark queue");
+            queue_free(bq);
+            return NULL;
+        }
+    }
+    return bq;
+}
 
-    while ((c = getopt(argc, argv, "hv:f:l:")) != -1) {
-        switch (c) {
-        case 'h':
-            usage(argv[0]);
-            break;
-        case 'f':
-            strncpy(buf, optarg, BUFSIZE);
-            buf[BUFSIZE - 1] = '\0';
-            infile_name = buf;
-            break;
-        case 'v':
-            level = atoi(optarg);
-            break;
-        case 'l':
-            strncpy(lbuf, optarg, BUFSIZE);
-            buf[BUFSIZE - 1] = '\0';
-            logfile_name = lbuf;
-            break;
-        default:
-            printf("Unknown option '%c'\n", c);
-            usage(argv[0]);
-            break;
+bool do_find_bench(int argc, char *argv[]) {
+    int n = 1000000;
+    if (argc > 2 || (argc == 2 && (!get_int(argv[1], &n) || n <= 0))) {
+        report(1, "%s takes an optional positive element count", argv[0]);
+        return false;
+    }
+    error_check();
+    queue_t *bq = bench_queue(n);
+    if (!bq)
+        return false;
+    char key[32];
+    /* Hit positions as percent of the queue; -1 is a miss */
+    static const int positions[] = {10, 25, 50, 75, 100, -1};
+    bool ok = true;
+    report(1, "Position\tprefix ns/elem\tstrcmp ns/elem");
+    for (size_t p = 0; p < sizeof(positions) / sizeof(positions[0]); p++) {
+        int idx = positions[p] < 0 ? n : (int)((long)(n - 1) * positions[p] /
+                                               100);
+        snprintf(key, sizeof(key), "key%07d", idx);
+        double t;
+        init_time(&t);
+        list_ele_t *found = NULL;
+        for (int r = 0; r < FIND_REPS; r++)
+            found = queue_find(bq, key);
+        double tfind = delta_time(&t);
+        list_ele_t *expected = NULL;
+        for (int r = 0; r < FIND_REPS; r++)
+            expected = find_strcmp(bq, key);
+        double tcmp = delta_time(&t);
+        if (found != expected) {
+            report(1, "ERROR:  queue_find disagrees with strcmp for %s", key);
+            ok = false;
         }
+        double scanned = (double)FIND_REPS * (idx < n ? idx + 1 : n);
+        if (positions[p] < 0)
+            report_noreturn(1, "miss");
+        else
+            report_noreturn(1, "%d%%", positions[p]);
+        report(1, "\t\t%.2f\t\t%.2f", 1e9 * tfind / scanned,
+               1e9 * tcmp / scanned);
+    }
+    queue_free(bq);
+    return ok && !error_check();
+}
+
+/* Number of traversals timed at each prefetch distance by iterbench */
+#define ITER_REPS 5
+
+bool do_iter_bench(int argc, char *argv[]) {
+    int n = 1000000;
+    if (argc > 2 || (argc == 2 && (!get_int(argv[1], &n) || n <= 0))) {
+        report(1, "%s takes an optional positive element count", argv[0]);
+        return false;
+    }
+    error_check();
+    queue_t *bq = bench_queue(n);
+    if (!bq)
+        return false;
+    static const size_t dists[] = {0, 1, 2, 4, 8, 16, 32};
+    bool ok = true;
+    report(1, "Distance\tns/elem");
+    for (size_t d = 0; d < sizeof(dists) / sizeof(dists[0]); d++) {
+        /* Touch each string, as show_queue and queue_free do */
+        size_t sum = 0;
+        double t;
+        init_time(&t);
+        for (int r = 0; r < ITER_REPS; r++) {
+            queue_iter_t it;
+            queue_iter_begin(bq, &it, dists[d]);
+            while (queue_iter_next(&it))
+                sum += (unsigned char)queue_iter_value(&it)[0];
+        }
+        double elapsed = delta_time(&t);
+        if (sum != (size_t)ITER_REPS * (size_t)n * 'k') {
+            report(1, "ERROR:  Traversal at distance %zu missed elements",
+                   dists[d]);
+            ok = false;
+        }
+        report(1, "%zu\t\t%.2f", dists[d],
+               1e9 * elapsed / ((double)ITER_REPS * n));
+    }
+    queue_free(bq);
+    return ok && !error_check();
+}
+
+/* Queue sizes timed by complexity start here and double up to the limit */
+#define CX_MIN_SIZE 1024
+#define CX_MAX_SIZES 24
+/* Calls per timed batch of a constant-time operation, at most */
+#define CX_CALLS 1024
+/* Calls per timed batch of reverse */
+#define CX_REVERSE_CALLS 4
+/* Batches timed per size; the fastest one counts */
+#define CX_TRIALS 5
+/* How far a fitted exponent may exceed its contract */
+#define CX_SLACK 0.3
+
+typedef enum { CX_IT, CX_SIZE, CX_RH, CX_REVERSE, CX_OPS } cx_op_t;
+
+static const struct {
+    const char *name;
+    int contract; /* Exponent of n in the cost of one call */
+} cx_ops[CX_OPS] = {{"it", 0}, {"size", 0}, {"rh", 0}, {"reverse", 1}};
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + 1e-9 * (double)ts.tv_nsec;
+}
+
+/*
+  Seconds per call of one operation on bq, which holds n elements, from
+  the fastest of CX_TRIALS batches.  Elements inserted or removed by a
+  batch are removed or put back before the next.  Negative on failure.
+*/
+static double cx_time_op(void *bq, size_t n, cx_op_t op) {
+    size_t calls = op == CX_REVERSE ? CX_REVERSE_CALLS
+                   : n / 2 < CX_CALLS ? n / 2
+                                      : CX_CALLS;
+    volatile size_t sink = 0;
+    double best = -1;
+    for (int trial = 0; trial < CX_TRIALS; trial++) {
+        bool ok = true;
+        double start = now_seconds();
+        for (size_t i = 0; i < calls; i++) {
+            switch (op) {
+            case CX_IT:
+                ok = backend->insert_tail(bq, "complexity") && ok;
+                break;
+            case CX_SIZE:
+                sink += backend->size(bq);
+                break;
+            case CX_RH:
+                ok = backend->remove_head(bq, NULL, 0) && ok;
+                break;
+            default:
+                backend->reverse(bq);
+                break;
+            }
+        }
+        double elapsed = (now_seconds() - start) / (double)calls;
+        for (size_t i = 0; ok && op == CX_IT && i < calls; i++)
+            ok = backend->remove_head(bq, NULL, 0);
+        for (size_t i = 0; ok && op == CX_RH && i < calls; i++)
+            ok = backend->insert_tail(bq, "complexity");
+        if (!ok)
+            return -1;
+        if (best < 0 || elapsed < best)
+            best = elapsed;
+    }
+    return best;
+}
+
+/* Least-squares slope of log(y) against log(x) */
+static double cx_fit_exponent(const double *x, const double *y, size_t k) {
+    double sx = 0, sy = 0, sxx = 0, sxy = 0;
+    for (size_t i = 0; i < k; i++) {
+        double lx = log(x[i]);
+        double ly = log(y[i] > 1e-12 ? y[i] : 1e-12);
+        sx += lx;
+        sy += ly;
+        sxx += lx * lx;
+        sxy += lx * ly;
+    }
+    double d = (double)k * sxx - sx * sx;
+    return d > 0 ? ((double)k * sxy - sx * sy) / d : 0;
+}
+
+bool do_complexity(int argc, char *argv[]) {
+    if (argc > 3) {
+        report(1, "%s takes 0-2 arguments", argv[0]);
+        return false;
+    }
+    int maxn = 65536;
+    if (argc >= 2 && (!get_int(argv[1], &maxn) || maxn < 4 * CX_MIN_SIZE)) {
+        report(1, "Largest queue size must be at least %d", 4 * CX_MIN_SIZE);
+        return false;
+    }
+    FILE *fp = NULL;
+    if (argc == 3 && !(fp = fopen(argv[2], "w"))) {
+        report(1, "Could not open '%s' for writing", argv[2]);
+        return false;
+    }
+    error_check();
+
+    double sizes[CX_MAX_SIZES];
+    double secs[CX_OPS][CX_MAX_SIZES];
+    size_t k = 0;
+    bool ok = true;
+    char key[32];
+    for (size_t n = CX_MIN_SIZE; ok && n <= (size_t)maxn && k < CX_MAX_SIZES;
+         n *= 2, k++) {
+        void *bq = backend->new();
+        ok = bq != NULL;
+        for (size_t i = 0; ok && i < n; i++) {
+            snprintf(key, sizeof(key), "key%07zu", i);
+            ok = backend->insert_tail(bq, key);
+        }
+        for (size_t op = 0; ok && op < CX_OPS; op++) {
+            secs[op][k] = cx_time_op(bq, n, (cx_op_t)op);
+            ok = secs[op][k] >= 0;
+        }
+        backend->free(bq);
+        if (!ok)
+            report(1, "ERROR:  Could not time operations on a queue of %zu "
+                      "elements",
+                   n);
+        sizes[k] = (double)n;
+    }
+
+    if (ok && fp)
+        fprintf(fp, "# time op n ns_per_call\n"
+                    "# fit op contract_exponent fitted_exponent ok|slow\n");
+    if (ok)
+        report(1, "Op\tContract\tExponent\tns/call at n == %.0f .. %.0f",
+               sizes[0], sizes[k - 1]);
+    for (size_t op = 0; ok && op < CX_OPS; op++) {
+        double e = cx_fit_exponent(sizes, secs[op], k);
+        bool fine = e <= cx_ops[op].contract + CX_SLACK;
+        report(1, "%s\tO(%s)\t\t%.2f\t\t%.1f .. %.1f%s", cx_ops[op].name,
+               cx_ops[op].contract ? "n" : "1", e, 1e9 * secs[op][0],
+               1e9 * secs[op][k - 1], fine ? "" : "\tTOO SLOW");
+        if (!fine) {
+            report(1, "ERROR:  Cost of %s grows as n^%.2f", cx_ops[op].name,
+                   e);
+            ok = false;
+        }
+        for (size_t i = 0; fp && i < k; i++)
+            fprintf(fp, "time %s %.0f %.2f\n", cx_ops[op].name, sizes[i],
+                    1e9 * secs[op][i]);
+        if (fp)
+            fprintf(fp, "fit %s %d %.3f %s\n", cx_ops[op].name,
+                    cx_ops[op].contract, e, fine ? "ok" : "slow");
+    }
+    if (fp && fclose(fp) != 0) {
+        report(1, "Could not write '%s'", argv[2]);
+        ok = false;
+    }
+    return ok && !error_check();
+}
+
+/* Built-in element transforms for pmap */
+static void fold_upper(char *s, void *arg UNUSED) {
+    for (; *s; s++)
+        *s = (char)toupper((unsigned char)*s);
+}
+
+static void fold_lower(char *s, void *arg UNUSED) {
+    for (; *s; s++)
+        *s = (char)tolower((unsigned char)*s);
+}
+
+/* Count strings holding non-printable characters */
+static void check_printable(char *s, void *arg) {
+    for (; *s; s++) {
+        if (!isprint((unsigned char)*s)) {
+            atomic_fetch_add((atomic_size_t *)arg, 1);
+            return;
+        }
+    }
+}
+
+static const struct {
+    const char *name;
+    void (*fn)(char *s, void *arg);
+} transforms[] = {
+    {"upper", fold_upper},
+    {"lower", fold_lower},
+    {"check", check_printable},
+};
+
+bool do_pmap(int argc, char *argv[]) {
+    if (argc != 2 && argc != 3) {
+        report(1, "%s needs 1-2 arguments", argv[0]);
+        return false;
+    }
+    size_t f = 0;
+    while (f < sizeof(transforms) / sizeof(transforms[0]) &&
+           strcmp(argv[1], transforms[f].name) != 0)
+        f++;
+    if (f == sizeof(transforms) / sizeof(transforms[0])) {
+        report(1, "Unknown transform '%s'", argv[1]);
+        return false;
+    }
+    int nthreads = 4;
+    if (argc == 3 && (!get_int(argv[2], &nthreads) || nthreads <= 0)) {
+        report(1, "Invalid number of threads '%s'", argv[2]);
+        return false;
+    }
+    if (!need_resident(argv[0]))
+        return false;
+    if (q == NULL)
+        report(3, "Warning: Calling pmap on null queue");
+    error_check();
+
+    /* A single thread does the same work as the baseline */
+    atomic_size_t seq_bad = 0;
+    atomic_size_t par_bad = 0;
+    double t;
+    set_noallocate_mode(true);
+    init_time(&t);
+    queue_parallel_for_each(q, transforms[f].fn, &seq_bad, 1);
+    double tseq = delta_time(&t);
+    queue_parallel_for_each(q, transforms[f].fn, &par_bad, (size_t)nthreads);
+    double tpar = delta_time(&t);
+    set_noallocate_mode(false);
+
+    bool ok = true;
+    if (seq_bad != par_bad) {
+        report(1,
+               "ERROR:  Parallel walk found %zu bad strings, sequential %zu",
+               (size_t)par_bad, (size_t)seq_bad);
+        ok = false;
+    } else if (transforms[f].fn == check_printable) {
+        report(2, "%zu strings with non-printable characters",
+               (size_t)par_bad);
+    }
+    report(2, "Sequential %.3f s, %d threads %.3f s, speedup %.2f", tseq,
+           nthreads, tpar, tpar > 0 ? tseq / tpar : 0.0);
+    show_queue(3);
+    return ok && !error_check();
+}
+
+/* Elements in a multi-queue before the stress threads start */
+#define MQ_PREFILL 4096
+
+/* Work of one stress thread */
+typedef struct {
+    multiqueue_t *mq;
+    size_t ops;
+    uint64_t *order;     /* Stamps of removed elements, in removal order */
+    atomic_size_t *next; /* Next free slot of order */
+    bool ok;
+} mq_stress_t;
+
+/* Remove an element and put a new one back, ops times */
+static void *mq_stress_worker(void *varg) {
+    mq_stress_t *w = varg;
+    block_timeout();
+    w->ok = true;
+    for (size_t i = 0; i < w->ops; i++) {
+        uint64_t stamp;
+        if (!mq_remove(w->mq, NULL, 0, &stamp) ||
+            !mq_insert(w->mq, "mqstress")) {
+            w->ok = false;
+            return NULL;
+        }
+        w->order[atomic_fetch_add(w->next, 1)] = stamp;
+    }
+    return NULL;
+}
+
+/*
+  Run nthreads stress threads on a fresh queue with nshards shards.
+  order receives the stamps of the nthreads * ops removed elements.
+  Return elapsed seconds, or a negative value on failure.
+*/
+static double mq_stress_run(size_t nshards, size_t nthreads, size_t ops,
+                            uint64_t *order) {
+    multiqueue_t *mq = mq_new(nshards);
+    bool ok = mq != NULL;
+    for (size_t i = 0; ok && i < MQ_PREFILL; i++)
+        ok = mq_insert(mq, "mqstress");
+    if (!ok) {
+        mq_free(mq);
+        return -1;
+    }
+
+    mq_stress_t *w = malloc_or_fail(nthreads * sizeof(mq_stress_t),
+                                    "mq_stress_run");
+    pthread_t *tids = malloc_or_fail(nthreads * sizeof(pthread_t),
+                                     "mq_stress_run");
+    atomic_size_t next = 0;
+    double t;
+    init_time(&t);
+    size_t started = 0;
+    for (; started < nthreads; started++) {
+        w[started] = (mq_stress_t){mq, ops, order, &next, false};
+        if (pthread_create(&tids[started], NULL, mq_stress_worker,
+                           &w[started]) != 0)
+            break;
+    }
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(tids[i], NULL);
+        ok = ok && w[i].ok;
+    }
+    double elapsed = delta_time(&t);
+    free(tids);
+    free(w);
+    mq_free(mq);
+    return ok && started == nthreads ? elapsed : -1;
+}
+
+/*
+  Rank error of each removal: how many older elements were still queued.
+  Stamps below s were all inserted before s, so the error is s minus the
+  number of them already removed, counted with a Fenwick tree.
+*/
+static void mq_rank_error(const uint64_t *order, size_t n, size_t nstamps,
+                          double *mean, uint64_t *max) {
+    size_t *tree = calloc_or_fail(nstamps + 1, sizeof(size_t),
+                                  "mq_rank_error");
+    double sum = 0;
+    *max = 0;
+    for (size_t i = 0; i < n; i++) {
+        uint64_t s = order[i];
+        size_t removed = 0;
+        for (size_t k = (size_t)s; k > 0; k -= k & -k)
+            removed += tree[k];
+        uint64_t err = s - removed;
+        sum += (double)err;
+        if (err > *max)
+            *max = err;
+        for (size_t k = (size_t)s + 1; k <= nstamps; k += k & -k)
+            tree[k]++;
+    }
+    *mean = n ? sum / (double)n : 0;
+    free(tree);
+}
+
+bool do_mq_stress(int argc, char *argv[]) {
+    if (argc > 3) {
+        report(1, "%s takes 0-2 arguments", argv[0]);
+        return false;
+    }
+    int maxthreads = 8;
+    int ops = 100000;
+    if (argc >= 2 && (!get_int(argv[1], &maxthreads) || maxthreads <= 0)) {
+        report(1, "Invalid number of threads '%s'", argv[1]);
+        return false;
+    }
+    if (argc == 3 && (!get_int(argv[2], &ops) || ops <= 0)) {
+        report(1, "Invalid number of operations '%s'", argv[2]);
+        return false;
+    }
+    error_check();
+
+    size_t total = (size_t)maxthreads * (size_t)ops;
+    uint64_t *order = malloc_or_fail(total * sizeof(uint64_t), "do_mq_stress");
+    bool ok = true;
+    report(1, "Threads\t1 shard ops/s\tShards\tops/s\t\tMean rank err\t"
+              "Max rank err");
+    for (size_t t = 1; ok && t <= (size_t)maxthreads; t *= 2) {
+        size_t n = t * (size_t)ops;
+        double locked = mq_stress_run(1, t, (size_t)ops, order);
+        double sharded = mq_stress_run(2 * t, t, (size_t)ops, order);
+        if (locked < 0 || sharded < 0) {
+            report(1, "ERROR:  Multi-queue stress run failed");
+            ok = false;
+            break;
+        }
+        double mean;
+        uint64_t max;
+        mq_rank_error(order, n, MQ_PREFILL + n, &mean, &max);
+        report(1, "%zu\t%.0f\t\t%zu\t%.0f\t\t%.2f\t\t%zu", t,
+               (double)n / locked, 2 * t, (double)n / sharded, mean,
+               (size_t)max);
+    }
+    free(order);
+    return ok && !error_check();
+}
+
+/* Work of one allocation stress thread */
+typedef struct {
+    void **blocks; /* Blocks allocated by this thread */
+    void **other;  /* Blocks of the next thread, freed by this one */
+    size_t ops;
+    uint64_t seed;
+    atomic_size_t *allocating; /* Threads not yet done allocating */
+    size_t mallocs;            /* Successful allocations */
+    size_t bytes;              /* Bytes of them */
+} alloc_stress_t;
+
+/*
+  Allocate ops blocks of random size, freeing every other one at once.
+  Once all threads are done allocating, free what is left of the next
+  thread's blocks.
+*/
+static void *alloc_stress_worker(void *varg) {
+    alloc_stress_t *w = varg;
+    block_timeout();
+    uint64_t x = w->seed;
+    for (size_t i = 0; i < w->ops; i++) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        size_t size = 1 + (size_t)(x % 256);
+        w->blocks[i] = test_malloc(size);
+        if (w->blocks[i]) {
+            w->mallocs++;
+            w->bytes += size;
+        }
+        if (i % 2) {
+            test_free(w->blocks[i - 1]);
+            w->blocks[i - 1] = NULL;
+        }
+    }
+    atomic_fetch_sub(w->allocating, 1);
+    while (atomic_load(w->allocating))
+        sched_yield();
+    for (size_t i = 0; i < w->ops; i++) {
+        test_free(w->other[i]);
+        w->other[i] = NULL;
+    }
+    return NULL;
+}
+
+bool do_alloc_stress(int argc, char *argv[]) {
+    if (argc > 3) {
+        report(1, "%s takes 0-2 arguments", argv[0]);
+        return false;
+    }
+    int nthreads = 4;
+    int ops = 100000;
+    if (argc >= 2 && (!get_int(argv[1], &nthreads) || nthreads <= 0)) {
+        report(1, "Invalid number of threads '%s'", argv[1]);
+        return false;
+    }
+    if (argc == 3 && (!get_int(argv[2], &ops) || ops <= 0)) {
+        report(1, "Invalid number of operations '%s'", argv[2]);
+        return false;
+    }
+    error_check();
+
+    size_t t = (size_t)nthreads;
+    size_t n = (size_t)ops;
+    alloc_stress_t *w = calloc_or_fail(t, sizeof(alloc_stress_t),
+                                       "do_alloc_stress");
+    void **blocks = calloc_or_fail(t * n, sizeof(void *), "do_alloc_stress");
+    pthread_t *tids = malloc_or_fail(t * sizeof(pthread_t), "do_alloc_stress");
+    atomic_size_t allocating = t;
+    alloc_stats_t before, after;
+    allocation_stats(&before);
+
+    double elapsed;
+    init_time(&elapsed);
+    size_t started = 0;
+    for (; started < t; started++) {
+        w[started].blocks = blocks + started * n;
+        w[started].other = blocks + (started + 1) % t * n;
+        w[started].ops = n;
+        w[started].seed = 0x9E3779B97F4A7C15ULL * (started + 1);
+        w[started].allocating = &allocating;
+        if (pthread_create(&tids[started], NULL, alloc_stress_worker,
+                           &w[started]) != 0)
+            break;
+    }
+    /* Let the started threads go on without the rest */
+    atomic_fetch_sub(&allocating, t - started);
+    for (size_t i = 0; i < started; i++)
+        pthread_join(tids[i], NULL);
+    elapsed = delta_time(&elapsed);
+    /* Blocks whose freeing thread never started */
+    for (size_t i = 0; i < t * n; i++)
+        test_free(blocks[i]);
+    allocation_stats(&after);
+
+    bool ok = started == t;
+    if (!ok)
+        report(1, "ERROR:  Could only start %zu of %zu threads", started, t);
+    size_t mallocs = 0, bytes = 0;
+    for (size_t i = 0; i < started; i++) {
+        mallocs += w[i].mallocs;
+        bytes += w[i].bytes;
+    }
+    size_t failures = started * n - mallocs;
+    size_t counted[4] = {after.mallocs - before.mallocs,
+                         after.frees - before.frees,
+                         after.failures - before.failures,
+                         after.total_bytes - before.total_bytes};
+    size_t expected[4] = {mallocs, mallocs, failures, bytes};
+    static const char *const names[4] = {"allocations", "frees", "failures",
+                                         "bytes"};
+    for (size_t i = 0; i < 4; i++) {
+        if (counted[i] != expected[i]) {
+            report(1, "ERROR:  Harness counted %zu %s, expected %zu",
+                   counted[i], names[i], expected[i]);
+            ok = false;
+        }
+    }
+    if (after.live_blocks != before.live_blocks) {
+        report(1, "ERROR:  %zu blocks live after stress, %zu before",
+               after.live_blocks, before.live_blocks);
+        ok = false;
+    }
+    report(1, "%zu threads: %zu allocations, %zu frees, %zu failures, "
+              "%.0f ops/s",
+           started, mallocs, mallocs, failures,
+           elapsed > 0 ? (double)(2 * mallocs) / elapsed : 0.0);
+    free(tids);
+    free(blocks);
+    free(w);
+    return ok && !error_check();
+}
+
+/* Check that a cache command has a cache to work on */
+static bool need_cache(const char *cmd) {
+    if (cache)
+        return true;
+    report(1, "%s needs a cache.  Create one with the cache command", cmd);
+    return false;
+}
+
+bool do_cache(int argc, char *argv[]) {
+    if (argc > 3) {
+        report(1, "%s takes 0-2 arguments", argv[0]);
+        return false;
+    }
+    int entries = 0;
+    int bytes = 0;
+    if (argc >= 2 && (!get_int(argv[1], &entries) || entries < 0)) {
+        report(1, "Invalid number of entries '%s'", argv[1]);
+        return false;
+    }
+    if (argc == 3 && (!get_int(argv[2], &bytes) || bytes < 0)) {
+        report(1, "Invalid number of bytes '%s'", argv[2]);
+        return false;
+    }
+    error_check();
+    lru_free(cache);
+    cache = lru_new((size_t)entries, (size_t)bytes);
+    if (!cache)
+        report(1, "Could not create cache");
+    return cache != NULL && !error_check();
+}
+
+bool do_cache_get(int argc, char *argv[]) {
+    if (argc != 2) {
+        report(1, "%s needs 1 argument", argv[0]);
+        return false;
+    }
+    if (!need_cache(argv[0]))
+        return false;
+    error_check();
+    const char *v = lru_get(cache, argv[1]);
+    if (v)
+        report(1, "Hit: %s = %s", argv[1], v);
+    else
+        report(1, "Miss: %s", argv[1]);
+    return !error_check();
+}
+
+bool do_cache_put(int argc, char *argv[]) {
+    if (argc != 3) {
+        report(1, "%s needs 2 arguments", argv[0]);
+        return false;
+    }
+    if (!need_cache(argv[0]))
+        return false;
+    error_check();
+    bool ok = lru_put(cache, argv[1], argv[2]);
+    if (!ok)
+        report(1, "Could not store %s in cache", argv[1]);
+    return ok && !error_check();
+}
+
+bool do_cache_replay(int argc, char *argv[]) {
+    if (argc != 2) {
+        report(1, "%s needs 1 argument", argv[0]);
+        return false;
+    }
+    if (!need_cache(argv[0]))
+        return false;
+    FILE *fp = fopen(argv[1], "r");
+    if (!fp) {
+        report(1, "Could not open key file '%s'", argv[1]);
+        return false;
+    }
+
+    /* Load every key first, so that file reading is not timed */
+    size_t nkeys = 0;
+    size_t cap = 1024;
+    char **keys = malloc_or_fail(cap * sizeof(char *), "do_cache_replay");
+    char *line = NULL;
+    size_t linecap = 0;
+    ssize_t len;
+    while ((len = getline(&line, &linecap, fp)) >= 0) {
+        while (len > 0 && isspace((unsigned char)line[len - 1]))
+            line[--len] = '\0';
+        if (len == 0)
+            continue;
+        if (nkeys == cap) {
+            cap *= 2;
+            keys = realloc_or_fail(keys, cap * sizeof(char *),
+                                   "do_cache_replay");
+        }
+        keys[nkeys++] = strsave_or_fail(line, "do_cache_replay");
+    }
+    free(line);
+    fclose(fp);
+
+    error_check();
+    size_t hits0 = cache->hits;
+    bool ok = true;
+    size_t done = 0;
+    double t;
+    init_time(&t);
+    for (; ok && done < nkeys; done++) {
+        if (!lru_get(cache, keys[done]))
+            ok = lru_put(cache, keys[done], keys[done]);
+    }
+    double elapsed = delta_time(&t);
+    if (!ok)
+        report(1, "ERROR:  Could not store key in cache");
+    size_t hits = cache->hits - hits0;
+    report(1, "%zu lookups, %zu hits (%.2f%%), %.1f ns per lookup", done,
+           hits, done ? 100.0 * (double)hits / (double)done : 0.0,
+           done ? 1.0E9 * elapsed / (double)done : 0.0);
+    for (size_t i = 0; i < nkeys; i++)
+        free(keys[i]);
+    free(keys);
+    return ok && !error_check();
+}
+
+bool do_cache_stat(int argc, char *argv[]) {
+    if (argc != 1) {
+        report(1, "%s takes no arguments", argv[0]);
+        return false;
+    }
+    if (!need_cache(argv[0]))
+        return false;
+    size_t lookups = cache->hits + cache->misses;
+    report(1, "%zu entries, %zu bytes", lru_size(cache), cache->bytes);
+    report(1, "%zu hits, %zu misses (hit rate %.2f%%), %zu evictions",
+           cache->hits, cache->misses,
+           lookups ? 100.0 * (double)cache->hits / (double)lookups : 0.0,
+           cache->evictions);
+    return true;
+}
+
+/* Checks made on timers as a wheel expires them */
+typedef struct {
+    tw_t *w;
+    uint64_t last; /* Deadline of previous expired timer */
+    size_t bad;    /* Timers expired on the wrong tick */
+} wheel_check_t;
+
+static void wheel_expire(const char *value UNUSED, uint64_t deadline,
+                         void *arg) {
+    wheel_check_t *c = arg;
+    if (deadline != c->w->now || deadline < c->last)
+        c->bad++;
+    c->last = deadline;
+}
+
+bool do_wheel_bench(int argc, char *argv[]) {
+    int n = 1000000;
+    if (argc > 2) {
+        report(1, "%s takes 0-1 arguments", argv[0]);
+        return false;
+    }
+    if (argc == 2 && (!get_int(argv[1], &n) || n <= 0)) {
+        report(1, "Invalid number of timers '%s'", argv[1]);
+        return false;
+    }
+    error_check();
+    size_t ntimers = (size_t)n;
+    uint64_t span = 4 * (uint64_t)ntimers;
+    tw_timer_t **handles =
+        malloc_or_fail(ntimers * sizeof(tw_timer_t *), "do_wheel_bench");
+    tw_t *w = tw_new(0);
+    if (!w) {
+        report(1, "ERROR:  Could not create timing wheel");
+        free(handles);
+        return false;
+    }
+
+    bool ok = true;
+    uint64_t rng = 88172645463325252ULL;
+    double t;
+    init_time(&t);
+    for (size_t i = 0; ok && i < ntimers; i++) {
+        rng ^= rng << 13;
+        rng ^= rng >> 7;
+        rng ^= rng << 17;
+        handles[i] = tw_add(w, 1 + rng % span, NULL);
+        ok = handles[i] != NULL;
+    }
+    double tinsert = delta_time(&t);
+    size_t ncancel = 0;
+    for (size_t i = 0; ok && i < ntimers; i += 10) {
+        tw_cancel(w, handles[i]);
+        ncancel++;
+    }
+    double tcancel = delta_time(&t);
+    wheel_check_t check = {w, 0, 0};
+    size_t expired = ok ? tw_advance(w, span, wheel_expire, &check) : 0;
+    double tadvance = delta_time(&t);
+
+    if (!ok) {
+        report(1, "ERROR:  Could not add timer");
+    } else if (expired != ntimers - ncancel || tw_size(w) != 0) {
+        report(1, "ERROR:  %zu timers expired, expected %zu", expired,
+               ntimers - ncancel);
+        ok = false;
+    } else if (check.bad) {
+        report(1, "ERROR:  %zu timers expired on the wrong tick", check.bad);
+        ok = false;
+    } else {
+        report(1, "Insert:  %.0f timers/s", (double)ntimers / tinsert);
+        report(1, "Cancel:  %.0f timers/s", (double)ncancel / tcancel);
+        report(1, "Advance: %.0f ticks/s, %.0f expiries/s",
+               (double)span / tadvance, (double)expired / tadvance);
+    }
+    tw_free(w);
+    free(handles);
+    return ok && !error_check();
+}
+
+/***** Workload generator *****/
+
+typedef enum {
+    GEN_IH,
+    GEN_IT,
+    GEN_RH,
+    GEN_REVERSE,
+    GEN_SIZE,
+    GEN_OPS
+} gen_op_t;
+
+static const char *const gen_op_names[GEN_OPS] = {"ih", "it", "rh", "reverse",
+                                                  "size"};
+
+/* Recent strings that gen may insert again */
+#define GEN_KEYS 4096
+/* Operations between checks for errors found by the harness */
+#define GEN_CHECK_EVERY 4096
+
+typedef struct {
+    int weight[GEN_OPS]; /* Relative frequency of each operation */
+    int total;
+    size_t min_len; /* Uniform string lengths, unless mean_len > 0 */
+    size_t max_len;
+    double mean_len; /* Mean of geometric string lengths */
+    int dup_pct;     /* Percent of insertions that repeat a recent string */
+    uint64_t rng;
+    char *keys; /* GEN_KEYS strings of up to max_len characters */
+    size_t nkeys;
+    size_t next_key;
+} gen_t;
+
+static uint64_t gen_random(gen_t *g) {
+    g->rng ^= g->rng << 13;
+    g->rng ^= g->rng >> 7;
+    g->rng ^= g->rng << 17;
+    return g->rng;
+}
+
+/* Parse a mix of operations such as "it:40,rh:40,ih:10,reverse:10" */
+static bool gen_parse_mix(gen_t *g, const char *spec) {
+    char *copy = strsave_or_fail(spec, "gen_parse_mix");
+    char *save = NULL;
+    bool ok = true;
+    g->total = 0;
+    for (char *tok = strtok_r(copy, ",", &save); ok && tok;
+         tok = strtok_r(NULL, ",", &save)) {
+        char *colon = strchr(tok, ':');
+        int w = 0;
+        size_t op = 0;
+        if (colon)
+            *colon = '\0';
+        while (op < GEN_OPS && strcmp(tok, gen_op_names[op]) != 0)
+            op++;
+        ok = colon && op < GEN_OPS && get_int(colon + 1, &w) && w >= 0 &&
+             w <= INT_MAX - g->total;
+        if (ok) {
+            g->weight[op] += w;
+            g->total += w;
+        }
+    }
+    free(copy);
+    return ok && g->total > 0;
+}
+
+/*
+  Parse a distribution of string lengths: "n" for n characters, "lo-hi"
+  for uniform lengths from lo to hi, or "~mean" for geometric lengths
+*/
+static bool gen_parse_len(gen_t *g, const char *spec) {
+    char *end = NULL;
+    if (spec[0] == '~') {
+        g->mean_len = strtod(spec + 1, &end);
+        g->min_len = 1;
+        g->max_len = MAXSTRING;
+        return end != spec + 1 && *end == '\0' && g->mean_len >= 1 &&
+               g->mean_len <= MAXSTRING;
+    }
+    if (!isdigit((unsigned char)spec[0]))
+        return false;
+    unsigned long lo = strtoul(spec, &end, 10), hi = lo;
+    if (*end == '-' && isdigit((unsigned char)end[1]))
+        hi = strtoul(end + 1, &end, 10);
+    g->mean_len = 0;
+    g->min_len = lo;
+    g->max_len = hi;
+    return *end == '\0' && lo >= 1 && lo <= hi && hi <= MAXSTRING;
+}
+
+static size_t gen_length(gen_t *g) {
+    if (g->mean_len > 0) {
+        /* Uniform in (0, 1], inverted through the geometric CDF */
+        double u = (double)((gen_random(g) >> 11) + 1) * 0x1.0p-53;
+        double p = 1 / g->mean_len;
+        size_t len = p >= 1 ? 1 : 1 + (size_t)(log(u) / log1p(-p));
+        return len < MAXSTRING ? len : MAXSTRING;
+    }
+    return g->min_len + gen_random(g) % (g->max_len - g->min_len + 1);
+}
+
+/* String for the next insertion: a recent one again, or a new one */
+static const char *gen_key(gen_t *g) {
+    size_t stride = g->max_len + 1;
+    if (g->nkeys > 0 && gen_random(g) % 100 < (uint64_t)g->dup_pct)
+        return g->keys + gen_random(g) % g->nkeys * stride;
+    char *key = g->keys + g->next_key * stride;
+    size_t len = gen_length(g);
+    uint64_t bits = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (i % 8 == 0)
+            bits = gen_random(g);
+        key[i] = (char)('a' + (bits & 0xff) % 26);
+        bits >>= 8;
+    }
+    key[len] = '\0';
+    g->next_key = (g->next_key + 1) % GEN_KEYS;
+    if (g->nkeys < GEN_KEYS)
+        g->nkeys++;
+    return key;
+}
+
+/* Count a failed operation as ih and rh do.  False once past the limit */
+static bool gen_failed(const char *what) {
+    fail_count++;
+    if (fail_count < fail_limit) {
+        report(2, "%s failed", what);
+        return true;
+    }
+    report(1, "ERROR: %s failed (%d failures total)", what, fail_count);
+    return false;
+}
+
+bool do_gen(int argc, char *argv[]) {
+    int n = 0;
+    int seed = 1;
+    gen_t g = {{0}, 0, 0, 0, 0, 0, 0, NULL, 0, 0};
+    if (argc < 2 || argc > 6) {
+        report(1, "%s needs 1-5 arguments", argv[0]);
+        return false;
+    }
+    if (!get_int(argv[1], &n) || n < 0) {
+        report(1, "Invalid number of operations '%s'", argv[1]);
+        return false;
+    }
+    const char *mix = argc > 2 ? argv[2] : "it:40,rh:40,ih:10,reverse:10";
+    if (!gen_parse_mix(&g, mix)) {
+        report(1, "Invalid operation mix '%s'", mix);
+        return false;
+    }
+    const char *len = argc > 3 ? argv[3] : "1-16";
+    if (!gen_parse_len(&g, len)) {
+        report(1, "Invalid string lengths '%s'", len);
+        return false;
+    }
+    if (argc > 4 && (!get_int(argv[4], &g.dup_pct) || g.dup_pct < 0 ||
+                     g.dup_pct > 100)) {
+        report(1, "Invalid percent of repeated strings '%s'", argv[4]);
+        return false;
+    }
+    if (argc > 5 && !get_int(argv[5], &seed)) {
+        report(1, "Invalid seed '%s'", argv[5]);
+        return false;
+    }
+    if (q == NULL) {
+        report(1, "%s needs a queue.  Use new first", argv[0]);
+        return false;
+    }
+    /* Spread seeds over the state space.  xorshift needs it nonzero */
+    g.rng = 88172645463325252ULL + 0x9e3779b97f4a7c15ULL * (unsigned)seed;
+    g.rng |= 1;
+    g.keys = malloc_or_fail(GEN_KEYS * (g.max_len + 1), "do_gen");
+    char *removes = malloc_or_fail(string_length + 1, "do_gen");
+
+    size_t counts[GEN_OPS] = {0};
+    size_t empty = 0;
+    size_t done = 0;
+    bool ok = true;
+    error_check();
+    double t;
+    init_time(&t);
+    for (; ok && done < (size_t)n; done++) {
+        uint64_t r = gen_random(&g) % (uint64_t)g.total;
+        size_t op = 0;
+        while (r >= (uint64_t)g.weight[op])
+            r -= (uint64_t)g.weight[op++];
+        counts[op]++;
+        switch ((gen_op_t)op) {
+        case GEN_IH:
+        case GEN_IT: {
+            const char *key = gen_key(&g);
+            bool head = op == GEN_IH;
+            if (head ? backend->insert_head(q, key)
+                     : backend->insert_tail(q, key)) {
+                qcnt++;
+                ok = journal_record(
+                    head ? JOURNAL_INSERT_HEAD : JOURNAL_INSERT_TAIL, key);
+            } else {
+                ok = gen_failed("Insertion");
+            }
+            break;
+        }
+        case GEN_RH:
+            if (qcnt == 0) {
+                empty++;
+            } else if (backend->remove_head(q, removes, string_length + 1)) {
+                qcnt--;
+                ok = journal_record(JOURNAL_REMOVE_HEAD, NULL);
+            } else {
+                ok = gen_failed("Removal");
+            }
+            break;
+        case GEN_REVERSE:
+            set_noallocate_mode(true);
+            backend->reverse(q);
+            set_noallocate_mode(false);
+            ok = journal_record(JOURNAL_REVERSE, NULL);
+            break;
+        case GEN_SIZE: {
+            size_t cnt = backend->size(q);
+            if (cnt != qcnt) {
+                report(1, "ERROR: Computed queue size as %zu, but correct "
+                          "value is %zu",
+                       cnt, qcnt);
+                ok = false;
+            }
+            break;
+        }
+        default:
+            break;
+        }
+        if (done % GEN_CHECK_EVERY == GEN_CHECK_EVERY - 1)
+            ok = ok && !error_check();
+    }
+    double elapsed = delta_time(&t);
+    free(g.keys);
+    free(removes);
+
+    report(1, "%zu operations in %.3f s: %.0f ops/s", done, elapsed,
+           elapsed > 0 ? (double)done / elapsed : 0);
+    for (size_t op = 0; op < GEN_OPS; op++) {
+        if (counts[op] == 0)
+            continue;
+        if (op == GEN_RH && empty > 0)
+            report(1, "  %-8s %zu (%zu on empty queue)", gen_op_names[op],
+                   counts[op], empty);
+        else
+            report(1, "  %-8s %zu", gen_op_names[op], counts[op]);
+    }
+    report(1, "Queue has %zu elements", qcnt);
+    show_queue(3);
+    return ok && !error_check();
+}
+
+/* Show the allocations made between two profiles */
+static void report_alloc_delta(int vlevel, const alloc_stats_t *before,
+                               const alloc_stats_t *after) {
+    report(vlevel, "%zu mallocs (%zu bytes), %zu frees, %zu failed",
+           after->mallocs - before->mallocs,
+           after->total_bytes - before->total_bytes,
+           after->frees - before->frees, after->failures - before->failures);
+    report(vlevel, "Live blocks %+ld, live bytes %+ld",
+           (long)after->live_blocks - (long)before->live_blocks,
+           (long)after->live_bytes - (long)before->live_bytes);
+}
+
+/* Show an allocation profile, with its size histogram at vlevel + 1 */
+static void report_alloc_stats(int vlevel, const alloc_stats_t *st) {
+    report(vlevel, "%zu mallocs (%zu bytes), %zu frees, %zu failed",
+           st->mallocs, st->total_bytes, st->frees, st->failures);
+    report(vlevel, "%zu blocks live (%zu bytes), peak %zu bytes",
+           st->live_blocks, st->live_bytes, st->peak_bytes);
+    if (q && qcnt && backend->head_value)
+        report(vlevel, "%.1f bytes per queue element",
+               (double)st->live_bytes / (double)qcnt);
+    for (size_t i = 0; i < ALLOC_CLASSES; i++) {
+        if (!st->classes[i])
+            continue;
+        size_t lo = i ? (size_t)1 << (i - 1) : 0;
+        size_t hi = i ? lo * 2 - 1 : 0;
+        report(vlevel + 1, "  %zu to %zu bytes: %zu allocations", lo, hi,
+               st->classes[i]);
+    }
+}
+
+bool do_memstat(int argc, char *argv[]) {
+    alloc_stats_t before;
+    allocation_stats(&before);
+    if (argc == 1) {
+        report_alloc_stats(1, &before);
+        report(1, "Since last memstat:");
+        report_alloc_delta(1, &last_stats, &before);
+        last_stats = before;
+        return true;
+    }
+
+    allocation_window();
+    bool ok = interpret_cmda(argc - 1, argv + 1);
+    alloc_stats_t after;
+    allocation_stats(&after);
+    report_alloc_delta(1, &before, &after);
+    report(1, "Peak %zu bytes above starting live bytes",
+           after.window_peak - before.live_bytes);
+    return ok;
+}
+
+static void latency_changed(int oldval UNUSED) {
+    set_latency_mode(latency_on != 0);
+}
+
+static void leak_depth_changed(int oldval) {
+    if (leak_depth < 0 || leak_depth > SITE_FRAMES) {
+        report(1, "Call frames must be between 0 and %d", SITE_FRAMES);
+        leak_depth = oldval;
+        return;
+    }
+    set_site_depth((size_t)leak_depth);
+}
+
+static void guard_changed(int oldval) {
+    if (guard_every < 0) {
+        report(1, "Guard interval must not be negative");
+        guard_every = oldval;
+        return;
+    }
+    set_guard_interval((size_t)guard_every);
+}
+
+static void cautious_changed(int oldval) {
+    if (!set_cautious_mode(cautious_on != 0)) {
+        report(1, "Cannot change cautious mode while %zu blocks are allocated",
+               allocation_check());
+        cautious_on = oldval;
+    }
+}
+
+/* Only the budget that changed can be invalid */
+static void time_budget_changed(int oldval) {
+    for (size_t c = 0; c < TIME_CLASSES; c++) {
+        if (time_budget_ms[c] < 1) {
+            report(1, "Time budget must be at least 1 ms");
+            time_budget_ms[c] = oldval;
+        }
+        set_time_budget((time_class_t)c, (unsigned)time_budget_ms[c]);
+    }
+}
+
+static void time_warn_changed(int oldval) {
+    if (time_warn_pct < 0) {
+        report(1, "Warning percent must not be negative");
+        time_warn_pct = oldval;
+        return;
+    }
+    set_time_warning((unsigned)time_warn_pct);
+}
+
+static void time_ops_changed(int oldval UNUSED) {
+    set_time_reports(time_ops != 0);
+}
+
+static void report_timing(int vlevel) {
+    report(vlevel, "%-8s%10s %10s %12s %12s %10s", "", "budget ms", "ops",
+           "mean ms", "max ms", "max used");
+    for (size_t c = 0; c < TIME_CLASSES; c++) {
+        time_usage_t u;
+        time_usage((time_class_t)c, &u);
+        if (!u.count)
+            continue;
+        report(vlevel, "%-8s%10d %10zu %12.3f %12.3f %9.1f%%",
+               time_class_names[c], time_budget_ms[c], u.count,
+               (double)u.total_ns / (double)u.count / 1e6,
+               (double)u.max_ns / 1e6, u.max_share * 100);
+    }
+}
+
+bool do_timing(int argc, char *argv[]) {
+    if (argc > 2) {
+        report(1, "%s takes 0-1 arguments", argv[0]);
+        return false;
+    }
+    if (argc == 1) {
+        report_timing(1);
+        return true;
+    }
+    if (strcmp(argv[1], "reset") != 0) {
+        report(1, "Unknown argument '%s'", argv[1]);
+        return false;
+    }
+    time_usage_reset();
+    return true;
+}
+
+static const char *const latency_names[LAT_OPS] = {"malloc", "calloc",
+                                                    "free"};
+
+/* Show percentiles of each latency histogram that has samples */
+static void report_latency(int vlevel) {
+    double per_ns = latency_cycles_per_ns();
+    report(vlevel, "Latency in cycles (ns):");
+    report(vlevel, "%-8s%10s %18s %18s %18s %22s", "", "calls", "p50", "p99",
+           "p99.9", "max");
+    for (size_t op = 0; op < LAT_OPS; op++) {
+        lat_hist_t h;
+        latency_histogram((lat_op_t)op, &h);
+        if (!h.count)
+            continue;
+        static const double pcts[] = {50, 99, 99.9};
+        char cols[4][32];
+        for (size_t i = 0; i < 4; i++) {
+            uint64_t c = i < 3 ? latency_percentile(&h, pcts[i]) : h.max;
+            snprintf(cols[i], sizeof(cols[i]), "%zu (%.0f)", (size_t)c,
+                     (double)c / per_ns);
+        }
+        report(vlevel, "%-8s%10zu %18s %18s %18s %22s", latency_names[op],
+               h.count, cols[0], cols[1], cols[2], cols[3]);
+    }
+}
+
+bool do_latency(int argc, char *argv[]) {
+    if (argc > 2) {
+        report(1, "%s takes 0-1 arguments", argv[0]);
+        return false;
+    }
+    if (argc == 1) {
+        if (!latency_on)
+            report(1, "Latency recording is off.  Use 'option latency 1'");
+        report_latency(1);
+        return true;
+    }
+    if (strcmp(argv[1], "reset") == 0) {
+        latency_reset();
+        return true;
+    }
+
+    FILE *fp = fopen(argv[1], "w");
+    if (!fp) {
+        report(1, "Could not open '%s' for writing", argv[1]);
+        return false;
+    }
+    fprintf(fp, "# op bucket_max_cycles count (%.3f cycles/ns)\n",
+            latency_cycles_per_ns());
+    for (size_t op = 0; op < LAT_OPS; op++) {
+        lat_hist_t h;
+        latency_histogram((lat_op_t)op, &h);
+        for (size_t i = 0; i < LAT_BUCKETS; i++) {
+            if (h.counts[i])
+                fprintf(fp, "%s %zu %zu\n", latency_names[op],
+                        (size_t)latency_bucket_max(i), h.counts[i]);
+        }
+    }
+    if (fclose(fp) != 0) {
+        report(1, "Could not write '%s'", argv[1]);
+        return false;
+    }
+    return true;
+}
+
+static void apply_spill_budget(void) {
+    if (q && spill_kb > 0 && backend == &list_backend &&
+        !queue_set_spill(q, (size_t)spill_kb * 1024))
+        report(2, "Could not put queue in spill mode");
+}
+
+static void fail_probability_changed(int oldval UNUSED) {
+    if (fail_probability < 0 || fail_probability > 100) {
+        fail_probability = fail_probability < 0 ? 0 : 100;
+        report(1, "Malloc failure probability is a percentage, using %d",
+               fail_probability);
+    }
+}
+
+static void fail_seed_changed(int oldval UNUSED) {
+    set_fail_seed((uint64_t)(unsigned)fail_seed);
+}
+
+static void fail_nth_changed(int oldval) {
+    if (fail_nth < 0) {
+        report(1, "Allocation number must not be negative");
+        fail_nth = oldval;
+        return;
+    }
+    set_fail_nth((size_t)fail_nth);
+}
+
+static void fail_above_changed(int oldval) {
+    if (fail_above < 0) {
+        report(1, "Allocation size must not be negative");
+        fail_above = oldval;
+        return;
+    }
+    set_fail_above((size_t)fail_above);
+}
+
+static void alloc_kind_changed(int oldval) {
+    if (alloc_kind < 0 || alloc_kind >= ALLOC_KINDS) {
+        report(1, "Unknown allocator %d", alloc_kind);
+        alloc_kind = oldval;
+        return;
+    }
+    if (!set_allocator((alloc_kind_t)alloc_kind)) {
+        report(1, "Cannot change allocator while %zu blocks are allocated",
+               allocation_check());
+        alloc_kind = oldval;
+    }
+}
+
+/* Apply a new memory budget or pressure setting */
+static void budget_changed(int oldval) {
+    if (budget_kb < 0) {
+        report(1, "Memory budget must not be negative");
+        budget_kb = oldval;
+        return;
+    }
+    set_mem_budget((size_t)budget_kb * 1024, pressure_on != 0);
+}
+
+bool do_fail_record(int argc, char *argv[]) {
+    if (argc > 2) {
+        report(1, "%s takes 0-1 arguments", argv[0]);
+        return false;
+    }
+    if (argc == 1) {
+        fail_record_begin();
+        return true;
+    }
+    if (!fail_record_end(argv[1])) {
+        report(1, "Could not save allocation record to '%s'", argv[1]);
+        return false;
+    }
+    return true;
+}
+
+bool do_fail_replay(int argc, char *argv[]) {
+    if (argc > 2) {
+        report(1, "%s takes 0-1 arguments", argv[0]);
+        return false;
+    }
+    if (!fail_replay(argc == 2 ? argv[1] : NULL)) {
+        report(1, "Could not read allocation record '%s'", argv[1]);
+        return false;
+    }
+    return true;
+}
+
+/* Stop recording allocations, if recording */
+static bool stop_alloc_trace(void) {
+    if (!alloc_tracing)
+        return true;
+    alloc_tracing = false;
+    size_t events;
+    bool ok = alloc_trace_end(&events);
+    if (ok)
+        report(2, "Recorded %zu allocation events", events);
+    else
+        report(1, "ERROR: Could not write all of the allocation trace");
+    return ok;
+}
+
+bool do_alloc_trace(int argc, char *argv[]) {
+    if (argc > 2) {
+        report(1, "%s takes 0-1 arguments", argv[0]);
+        return false;
+    }
+    bool ok = stop_alloc_trace();
+    if (argc == 2) {
+        alloc_tracing = alloc_trace_begin(argv[1]);
+        if (!alloc_tracing) {
+            report(1, "Could not open '%s' for writing", argv[1]);
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+/* Apply a new spill budget to the current queue */
+static void spill_changed(int oldval) {
+    if (spill_kb < 0) {
+        report(1, "Spill budget must not be negative");
+        spill_kb = oldval;
+        return;
+    }
+    if (backend != &list_backend) {
+        if (spill_kb > 0)
+            report(1, "Spill mode is not supported by the %s backend",
+                   backend->name);
+        return;
+    }
+    if (q && !queue_set_spill(q, (size_t)spill_kb * 1024)) {
+        report(1, "Cannot change spill mode of current queue");
+        spill_kb = oldval;
+    }
+}
+
+bool do_spill_stat(int argc, char *argv[]) {
+    if (argc != 1) {
+        report(1, "%s takes no arguments", argv[0]);
+        return false;
+    }
+    if (!need_list_backend(argv[0]))
+        return false;
+    size_t resident, spilled, nspilled;
+    queue_spill_stats(q, &resident, &spilled, &nspilled);
+    report(1, "Resident %zu bytes, spilled %zu bytes in %zu elements",
+           resident, spilled, nspilled);
+    return true;
+}
+
+/* Log one element of the queue as part of a journal snapshot */
+static bool journal_snapshot_visit(const char *s, void *arg UNUSED) {
+    return journal_record(JOURNAL_INSERT_TAIL, s);
+}
+
+bool do_journal(int argc, char *argv[]) {
+    if (argc > 3) {
+        report(1, "%s takes 0-2 arguments", argv[0]);
+        return false;
+    }
+    int window_us = 0;
+    if (argc == 3 && (!get_int(argv[2], &window_us) || window_us < 0)) {
+        report(1, "Invalid commit window '%s'", argv[2]);
+        return false;
+    }
+    bool ok = true;
+    if (jnl) {
+        report(2, "Journal closed after %zu records and %zu syncs",
+               journal_records(jnl), journal_syncs(jnl));
+        if (!journal_close(jnl)) {
+            report(1, "ERROR:  Could not sync journal");
+            ok = false;
+        }
+        jnl = NULL;
+    } else if (argc == 1) {
+        report(2, "Journaling is off");
+    }
+    if (argc == 1)
+        return ok;
+
+    jnl = journal_open(argv[1], window_us);
+    if (!jnl) {
+        report(1, "Could not open journal file '%s'", argv[1]);
+        return false;
+    }
+    /* Start with the current contents, so replay rebuilds them */
+    if (q) {
+        ok = journal_record(JOURNAL_NEW, NULL) && ok;
+        if (backend->walk(q, qcnt, journal_snapshot_visit, NULL) != qcnt)
+            ok = false;
+        if (backend->head_value == NULL && qcnt)
+            report(2, "Journal snapshot keeps at most %d characters of each "
+                      "element",
+                   MAXSTRING);
+    }
+    return ok;
+}
+
+/* Apply one journal record to the queue */
+static bool recover_apply(journal_op_t op, const char *s, void *arg UNUSED) {
+    switch (op) {
+    case JOURNAL_NEW:
+        backend->free(q);
+        q = backend->new();
+        qcnt = 0;
+        apply_spill_budget();
+        return q != NULL;
+    case JOURNAL_FREE:
+        backend->free(q);
+        q = NULL;
+        qcnt = 0;
+        return true;
+    case JOURNAL_INSERT_HEAD:
+        if (!backend->insert_head(q, s))
+            return false;
+        qcnt++;
+        return true;
+    case JOURNAL_INSERT_TAIL:
+        if (!backend->insert_tail(q, s))
+            return false;
+        qcnt++;
+        return true;
+    case JOURNAL_REMOVE_HEAD:
+        if (!backend->remove_head(q, NULL, 0))
+            return false;
+        qcnt--;
+        return true;
+    case JOURNAL_REVERSE:
+        backend->reverse(q);
+        return true;
+    }
+    report(1, "ERROR:  Unknown journal record type %d", (int)op);
+    return false;
+}
+
+bool do_recover(int argc, char *argv[]) {
+    if (argc != 2) {
+        report(1, "%s needs 1 argument", argv[0]);
+        return false;
+    }
+    if (jnl) {
+        report(1, "Stop journaling before recovering a queue");
+        return false;
+    }
+    error_check();
+    backend->free(q);
+    q = NULL;
+    qcnt = 0;
+    size_t nrec;
+    bool ok = journal_replay(argv[1], recover_apply, NULL, &nrec);
+    if (!ok)
+        report(1, "ERROR:  Could not replay journal '%s' (stopped after %zu "
+                  "records)",
+               argv[1], nrec);
+    else
+        report(2, "Replayed %zu records, queue has %zu elements", nrec, qcnt);
+    show_queue(3);
+    return ok && !error_check();
+}
+
+bool do_journal_bench(int argc, char *argv[]) {
+    int n = 2000;
+    if (argc != 2 && argc != 3) {
+        report(1, "%s needs 1-2 arguments", argv[0]);
+        return false;
+    }
+    if (argc == 3 && (!get_int(argv[2], &n) || n <= 0)) {
+        report(1, "Invalid number of operations '%s'", argv[2]);
+        return false;
+    }
+    static const long windows[] = {0, 100, 1000, 10000, 100000};
+    bool ok = true;
+    error_check();
+    report(1, "Window (us)\tops/s\t\tfsyncs");
+    for (size_t w = 0; ok && w < sizeof(windows) / sizeof(windows[0]); w++) {
+        journal_t *bj = journal_open(argv[1], windows[w]);
+        queue_t *bq = queue_new();
+        if (!bj || !bq) {
+            report(1, "ERROR:  Could not set up journal benchmark");
+            if (bj)
+                journal_close(bj);
+            queue_free(bq);
+            return false;
+        }
+        double t;
+        init_time(&t);
+        for (int i = 0; ok && i < n; i++)
+            ok = queue_insert_tail(bq, "bench") &&
+                 journal_log(bj, JOURNAL_INSERT_TAIL, "bench");
+        for (int i = 0; ok && i < n; i++)
+            ok = queue_remove_head(bq, NULL, 0) &&
+                 journal_log(bj, JOURNAL_REMOVE_HEAD, NULL);
+        ok = journal_sync(bj) && ok;
+        size_t syncs = journal_syncs(bj);
+        ok = journal_close(bj) && ok;
+        double elapsed = delta_time(&t);
+        queue_free(bq);
+        if (!ok)
+            report(1, "ERROR:  Journaled operation failed");
+        else
+            report(1, "%ld\t\t%.0f\t\t%zu", windows[w],
+                   2.0 * n / elapsed, syncs);
+    }
+    return ok && !error_check();
+}
+
+static void queue_init() {
+    fail_count = 0;
+    q = NULL;
+}
+
+/* Console idle helper: sync journal records whose window has passed */
+static long journal_idle(void) {
+    long wait_us = -1;
+    if (jnl && !journal_poll(jnl, &wait_us))
+        report(1, "ERROR:  Could not sync journal");
+    return wait_us;
+}
+
+static bool queue_quit(int argc UNUSED, char *argv[] UNUSED) {
+    if (jnl && !journal_close(jnl))
+        report(1, "ERROR:  Could not sync journal");
+    jnl = NULL;
+    lru_free(cache);
+    cache = NULL;
+    report(3, "Freeing queue");
+    arm_timeout(TIME_ALLOC);
+    backend->free(q);
+    cancel_timeout();
+    q = NULL;
+    qcnt = 0;
+    bool ok = stop_alloc_trace();
+    alloc_stats_t st;
+    allocation_stats(&st);
+    report(2, "Allocation summary:");
+    report_alloc_stats(2, &st);
+    if (latency_on)
+        report_latency(1);
+    size_t bcnt = allocation_check();
+    if (bcnt > 0) {
+        report(1, "ERROR: Freed queue, but %lu blocks are still allocated",
+               bcnt);
+        report_leaks(1);
+        return false;
+    }
+    return ok;
+}
+
+/* Choose the queue implementation by name */
+static bool select_backend(const char *name) {
+    for (size_t i = 0; i < NBACKENDS; i++) {
+        if (strcmp(name, backends[i]->name) == 0) {
+            backend = backends[i];
+            return true;
+        }
+    }
+    return false;
+}
+
+static void usage(char *cmd) {
+    printf("Usage: %s [-h] [-b BACKEND][-f IFILE][-v VLEVEL][-l LFILE]"
+           "[-c CFILE]\n",
+           cmd);
+    printf("\t-h         Print this information\n");
+    printf("\t-b BACKEND Queue implementation to test:");
+    for (size_t i = 0; i < NBACKENDS; i++)
+        printf(" %s", backends[i]->name);
+    printf(" (default: %s)\n", backends[0]->name);
+    printf("\t-f IFILE   Read commands from IFILE\n");
+    printf("\t-v VLEVEL  Set verbosity level\n");
+    printf("\t-l LFILE   Echo results to LFILE\n");
+    printf("\t-c CFILE   Compile IFILE to CFILE instead of running it.  "
+           "qtest -f CFILE runs it faster\n");
+    exit(0);
+}
+
+#define BUFSIZE 256
+
+int main(int argc, char *argv[]) {
+    /* To hold input file name */
+    char buf[BUFSIZE];
+    char *infile_name = NULL;
+    char lbuf[BUFSIZE];
+    char *logfile_name = NULL;
+    char *compiled_name = NULL;
+    int level = 4;
+    int c;
+
+    while ((c = getopt(argc, argv, "hb:v:f:l:c:")) != -1) {
+        switch (c) {
+        case 'h':
+            usage(argv[0]);
+            break;
+        case 'b':
+            if (!select_backend(optarg)) {
+                printf("Unknown backend '%s'\n", optarg);
+                usage(argv[0]);
+            }
+            break;
+        case 'f':
+            strncpy(buf, optarg, BUFSIZE);
+            buf[BUFSIZE - 1] = '\0';
+            infile_name = buf;
+            break;
+        case 'v':
+            level = atoi(optarg);
+            break;
+        case 'l':
+            strncpy(lbuf, optarg, BUFSIZE);
+            buf[BUFSIZE - 1] = '\0';
+            logfile_name = lbuf;
+            break;
+        case 'c':
+            compiled_name = optarg;
+            break;
+        default:
+            printf("Unknown option '%c'\n", c);
+            usage(argv[0]);
+            break;
+        }
+    }
+    queue_init();
+    init_cmd();
+    console_init();
+    set_verblevel(level);
+    if (compiled_name) {
+        if (!infile_name) {
+            printf("Option -c needs a trace to compile (-f)\n");
+            usage(argv[0]);
+        }
+        return compile_cmd_file(infile_name, compiled_name) ? 0 : 1;
     }
-    queue_init();
-    init_cmd();
-    console_init();
-    set_verblevel(level);
     if (level > 1) {
         set_echo(true);
     }
     if (logfile_name)
         set_logfile(logfile_name);
     add_quit_helper(queue_quit);
+    set_idle_helper(journal_idle);
     bool ok = true;
     ok = ok && run_console(infile_name);
     ok = ok && finish_cmd();
@@ -15,9 +15,436 @@
 #include "queue.h"
 #include "harness.h"
 
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+/* Number of leading string bytes cached in each element */
+#define PREFIX_LEN sizeof(uint64_t)
+
+/* Largest number of threads queue_parallel_for_each will use */
+#define MAX_THREADS 64
+
+/**
+ * @brief Run of consecutive elements handed to one worker thread
+ */
+typedef struct {
+    list_ele_t *first;              /* First element of the run */
+    size_t count;                   /* Number of elements in the run */
+    void (*fn)(char *s, void *arg); /* Function to apply */
+    void *arg;                      /* Extra argument for fn */
+} run_t;
+
+/**
+ * @brief List element together with the cached prefix of its value
+ *
+ * list_ele_t is part of the lab's interface and stays as it is, so the
+ * search prefix lives in this wrapper, which queue.c allocates for every
+ * element.  The element comes first, so a list_ele_t pointer is also a
+ * pointer to its node, and freeing the element frees the node.
+ */
+typedef struct {
+    list_ele_t ele;  /* The element handed out to callers */
+    uint64_t prefix; /* First PREFIX_LEN bytes of ele.value, zero padded */
+} node_t;
+
+/* Return the node holding element e */
+static node_t *node_of(list_ele_t *e) {
+    return (node_t *)e;
+}
+
+/**
+ * @brief Packs the first PREFIX_LEN bytes of a string into a word
+ *
+ * Byte i of the string goes to bits 8i to 8i+7.  Bytes past the end of
+ * the string are zero, so two strings shorter than PREFIX_LEN are equal
+ * exactly when their prefix words are.  The bytes are packed one at a
+ * time rather than copied with strncpy, which is much slower under the
+ * sanitizers and runs on every insertion.
+ *
+ * @param[in]  s   The string to pack
+ * @param[out] lenp If non-NULL, receives the number of string bytes packed
+ *
+ * @return the packed prefix
+ */
+static uint64_t string_prefix(const char *s, size_t *lenp) {
+    uint64_t prefix = 0;
+    size_t len = 0;
+    while (len < PREFIX_LEN && s[len]) {
+        prefix |= (uint64_t)(unsigned char)s[len] << (8 * len);
+        len++;
+    }
+    if (lenp)
+        *lenp = len;
+    return prefix;
+}
+
+/*
+ * Spill-to-disk mode.
+ *
+ * Once the elements of a queue take more than the budget, the queue is
+ * kept in three parts:
+ *
+ *     front list (q->head..q->tail) | segments on disk | back list
+ *
+ * Insertions at the tail go to the back list, whose oldest elements are
+ * written out as new segments whenever the budget is exceeded.  When the
+ * front list drains, the first segment is read back in one sequential read
+ * to become the new front list.  Each segment is an unnamed temporary file
+ * of [uint32 length][bytes] records, so it disappears when closed.
+ */
+
+/* Bytes of records written to a single segment */
+#define SPILL_CHUNK (1 << 20)
+
+/* Size of the stdio buffer used while writing a segment */
+#define SPILL_IO_SIZE (1 << 16)
+
+/**
+ * @brief Run of elements written out to a temporary file
+ */
+typedef struct segment {
+    FILE *fp;             /* Temporary file holding the records */
+    size_t bytes;         /* Bytes of records in the file */
+    size_t count;         /* Number of records in the file */
+    bool reversed;        /* Records are stored in reverse queue order */
+    struct segment *prev; /* Segment holding the preceding elements */
+    struct segment *next; /* Segment holding the following elements */
+} segment_t;
+
+struct spill {
+    size_t budget;          /* Bytes of elements to keep in memory */
+    size_t resident;        /* Bytes of elements in memory */
+    size_t spilled;         /* Bytes of records in segments */
+    size_t nspilled;        /* Number of elements in segments */
+    segment_t *first;       /* Segments in queue order, or NULL */
+    segment_t *last;        /* Last segment, or NULL */
+    list_ele_t *back_head;  /* Elements following the last segment */
+    list_ele_t *back_tail;  /* Last element of the queue, when spilled */
+};
+
+/* Memory accounted to an element holding string s */
+static size_t element_bytes(const char *s) {
+    return sizeof(node_t) + strlen(s) + 1;
+}
+
+/* Allocate an element holding a copy of the len bytes at s */
+static list_ele_t *new_element(const char *s, size_t len) {
+    list_ele_t *e = malloc(sizeof(node_t));
+    if (!e)
+        return NULL;
+    e->value = malloc(len + 1);
+    if (!e->value) {
+        free(e);
+        return NULL;
+    }
+    memcpy(e->value, s, len);
+    e->value[len] = '\0';
+    node_of(e)->prefix = string_prefix(e->value, NULL);
+    e->next = NULL;
+    return e;
+}
+
+/* Reverse the list from *headp to *tailp in place */
+static void reverse_run(list_ele_t **headp, list_ele_t **tailp) {
+    list_ele_t *pre = NULL;
+    list_ele_t *curr = *headp;
+    *tailp = curr;
+    while (curr) {
+        list_ele_t *next = curr->next;
+        curr->next = pre;
+        pre = curr;
+        curr = next;
+    }
+    *headp = pre;
+}
+
+/**
+ * @brief Writes elements starting at *headp to a new segment
+ *
+ * Up to SPILL_CHUNK bytes of records (but at least one element) are
+ * written.  Only once the segment is complete are the written elements
+ * freed and *headp moved past them.
+ *
+ * @return the new segment, or NULL if it could not be written
+ */
+static segment_t *write_segment(struct spill *sp, list_ele_t **headp) {
+    FILE *fp = tmpfile();
+    if (!fp)
+        return NULL;
+    segment_t *seg = malloc(sizeof(segment_t));
+    if (!seg) {
+        fclose(fp);
+        return NULL;
+    }
+    setvbuf(fp, NULL, _IOFBF, SPILL_IO_SIZE);
+
+    list_ele_t *e = *headp;
+    size_t bytes = 0;
+    size_t count = 0;
+    while (e && (count == 0 || bytes < SPILL_CHUNK)) {
+        size_t len = strlen(e->value);
+        uint32_t tag = (uint32_t)len;
+        if (len > UINT32_MAX || fwrite(&tag, sizeof(tag), 1, fp) != 1 ||
+            fwrite(e->value, 1, len, fp) != len) {
+            fclose(fp);
+            free(seg);
+            return NULL;
+        }
+        bytes += sizeof(tag) + len;
+        count++;
+        e = e->next;
+    }
+    if (fflush(fp) != 0) {
+        fclose(fp);
+        free(seg);
+        return NULL;
+    }
+
+    while (*headp != e) {
+        list_ele_t *pt = *headp;
+        *headp = pt->next;
+        sp->resident -= element_bytes(pt->value);
+        free(pt->value);
+        free(pt);
+    }
+    seg->fp = fp;
+    seg->bytes = bytes;
+    seg->count = count;
+    seg->reversed = false;
+    seg->prev = NULL;
+    seg->next = NULL;
+    sp->spilled += bytes;
+    sp->nspilled += count;
+    return seg;
+}
+
+/* Link seg into the segment list just before `before` (NULL: at the end) */
+static void link_segment(struct spill *sp, segment_t *seg, segment_t *before) {
+    seg->next = before;
+    seg->prev = before ? before->prev : sp->last;
+    if (seg->prev)
+        seg->prev->next = seg;
+    else
+        sp->first = seg;
+    if (before)
+        before->prev = seg;
+    else
+        sp->last = seg;
+}
+
+/* Unlink, close and free a segment */
+static void drop_segment(struct spill *sp, segment_t *seg) {
+    if (seg->prev)
+        seg->prev->next = seg->next;
+    else
+        sp->first = seg->next;
+    if (seg->next)
+        seg->next->prev = seg->prev;
+    else
+        sp->last = seg->prev;
+    sp->spilled -= seg->bytes;
+    sp->nspilled -= seg->count;
+    fclose(seg->fp);
+    free(seg);
+}
+
+/**
+ * @brief Moves elements to disk until the queue is within its budget
+ *
+ * The oldest elements of the back list go first, since they are the
+ * furthest from either end of the queue.  If that is not enough (the
+ * queue was filled from the head), the front list is cut to half the
+ * budget and the rest of it is written out ahead of the other segments.
+ * Write errors leave the remaining elements in memory.
+ */
+static void spill_excess(queue_t *q) {
+    struct spill *sp = q->spill;
+    while (sp->resident > sp->budget && sp->back_head) {
+        segment_t *seg = write_segment(sp, &sp->back_head);
+        if (!seg)
+            return;
+        link_segment(sp, seg, NULL);
+    }
+    if (!sp->back_head)
+        sp->back_tail = NULL;
+    if (sp->resident <= sp->budget || !q->head)
+        return;
+
+    list_ele_t *keep = q->head;
+    size_t kept = element_bytes(keep->value);
+    while (keep->next && kept + element_bytes(keep->next->value) <=
+                             sp->budget / 2) {
+        keep = keep->next;
+        kept += element_bytes(keep->value);
+    }
+    list_ele_t *rest = keep->next;
+    segment_t *before = sp->first;
+    while (rest) {
+        segment_t *seg = write_segment(sp, &rest);
+        if (!seg)
+            break;
+        link_segment(sp, seg, before);
+    }
+    keep->next = rest;
+    if (!rest)
+        q->tail = keep;
+}
+
+/**
+ * @brief Reads the first segment back in as the front list
+ *
+ * Must only be called while the front list is empty.
+ *
+ * @return false if the segment could not be read or allocated
+ */
+static bool load_segment(queue_t *q) {
+    struct spill *sp = q->spill;
+    segment_t *seg = sp->first;
+    char *buf = malloc(seg->bytes);
+    if (!buf)
+        return false;
+    rewind(seg->fp);
+    if (fread(buf, 1, seg->bytes, seg->fp) != seg->bytes) {
+        free(buf);
+        return false;
+    }
+
+    list_ele_t *head = NULL;
+    list_ele_t *tail = NULL;
+    size_t bytes = 0;
+    size_t off = 0;
+    for (size_t i = 0; i < seg->count; i++) {
+        uint32_t tag;
+        memcpy(&tag, buf + off, sizeof(tag));
+        off += sizeof(tag);
+        list_ele_t *e = new_element(buf + off, tag);
+        if (!e) {
+            while (head) {
+                list_ele_t *pt = head;
+                head = head->next;
+                free(pt->value);
+                free(pt);
+            }
+            free(buf);
+            return false;
+        }
+        off += tag;
+        bytes += element_bytes(e->value);
+        if (seg->reversed) {
+            e->next = head;
+            head = e;
+            if (!tail)
+                tail = e;
+        } else {
+            if (tail)
+                tail->next = e;
+            else
+                head = e;
+            tail = e;
+        }
+    }
+    free(buf);
+
+    q->head = head;
+    q->tail = tail;
+    sp->resident += bytes;
+    drop_segment(sp, seg);
+    return true;
+}
+
+/**
+ * @brief Makes sure the front list is not empty while the queue is not
+ *
+ * Reads in the first segment, or once no segments are left, takes over
+ * the back list.
+ *
+ * @return false if the front list is still empty
+ */
+static bool refill_front(queue_t *q) {
+    struct spill *sp = q->spill;
+    if (q->head)
+        return true;
+    if (sp->first && !load_segment(q))
+        return false;
+    if (!sp->first && sp->back_head) {
+        if (q->tail)
+            q->tail->next = sp->back_head;
+        else
+            q->head = sp->back_head;
+        q->tail = sp->back_tail;
+        sp->back_head = NULL;
+        sp->back_tail = NULL;
+    }
+    return q->head != NULL;
+}
+
+/* Insertion at the tail while part of the queue is on disk */
+static bool spill_insert_tail(queue_t *q, const char *s) {
+    struct spill *sp = q->spill;
+    if (!refill_front(q))
+        return false;
+    list_ele_t *e = new_element(s, strlen(s));
+    if (!e)
+        return false;
+    if (sp->first) {
+        if (sp->back_tail)
+            sp->back_tail->next = e;
+        else
+            sp->back_head = e;
+        sp->back_tail = e;
+    } else {
+        /* Everything was read back in by refill_front */
+        q->tail->next = e;
+        q->tail = e;
+    }
+    sp->resident += element_bytes(e->value);
+    q->size++;
+    spill_excess(q);
+    return true;
+}
+
+/* Reversal while part of the queue is on disk */
+static void spill_reverse(queue_t *q) {
+    struct spill *sp = q->spill;
+    list_ele_t *fhead = q->head;
+    list_ele_t *ftail = NULL;
+    list_ele_t *bhead = sp->back_head;
+    list_ele_t *btail = NULL;
+    reverse_run(&fhead, &ftail);
+    reverse_run(&bhead, &btail);
+    q->head = bhead;
+    q->tail = btail;
+    sp->back_head = fhead;
+    sp->back_tail = ftail;
+
+    segment_t *seg = sp->first;
+    sp->first = sp->last;
+    sp->last = seg;
+    while (seg) {
+        segment_t *next = seg->next;
+        seg->next = seg->prev;
+        seg->prev = next;
+        seg->reversed = !seg->reversed;
+        seg = next;
+    }
+}
+
+/* Free everything held by spill mode other than the front list */
+static void spill_free(struct spill *sp) {
+    while (sp->back_head) {
+        list_ele_t *pt = sp->back_head;
+        sp->back_head = pt->next;
+        free(pt->value);
+        free(pt);
+    }
+    while (sp->first)
+        drop_segment(sp, sp->first);
+    free(sp);
+}
+
 /**
  * @brief Allocates a new queue
  * @return The new queue, or NULL if memory allocation failed
@@ -31,6 +458,7 @@ queue_t *queue_new(void) {
     q->head = NULL;
     q->tail = NULL;
     q->size = 0;
+    q->spill = NULL;
 
     return q;
 }
@@ -46,20 +474,59 @@ void queue_free(queue_t *q) {
     if (!q)
         return;
 
-    /* Need another pseudo pointer */
-    list_ele_t *pt;
-
-    while (q->head) {
-        pt = q->head;
-        q->head = q->head->next;
+    /* The iterator has already moved past each element it hands back */
+    queue_iter_t it;
+    queue_iter_begin(q, &it, QUEUE_ITER_AHEAD);
+    while (queue_iter_next(&it)) {
+        list_ele_t *pt = queue_iter_element(&it);
         free(pt->value);
         free(pt);
     }
+    if (q->spill)
+        spill_free(q->spill);
 
     /* Free queue structure */
     free(q);
 }
 
+/**
+ * @brief Allocates an element holding a copy of a string
+ *
+ * The element is not linked into any queue.  It is allocated the way the
+ * insert functions allocate theirs, so other modules can build their own
+ * lists out of queue elements.
+ *
+ * @param[in] s String to be copied into the element
+ *
+ * @return The new element, or NULL if s is NULL or memory allocation failed
+ */
+list_ele_t *queue_element_new(const char *s) {
+    if (!s)
+        return NULL;
+
+    return new_element(s, strlen(s));
+}
+
+/**
+ * @brief Frees an element and its string
+ * @param[in] e Element from queue_element_new that is in no queue, or NULL
+ */
+void queue_element_free(list_ele_t *e) {
+    if (!e)
+        return;
+
+    free(e->value);
+    free(e);
+}
+
+/**
+ * @brief Returns the memory used by an element and its string
+ * @param[in] e The element to examine
+ */
+size_t queue_element_bytes(const list_ele_t *e) {
+    return element_bytes(e->value);
+}
+
 /**
  * @brief Attempts to insert an element at head of a queue
  *
@@ -78,7 +545,7 @@ bool queue_insert_head(queue_t *q, const char *s) {
     if (!q || !s)
         return false;
 
-    newh = malloc(sizeof(list_ele_t));
+    newh = malloc(sizeof(node_t));
     if (!newh)
         return false;
     /* Don't forget to allocate space for the string and copy it */
@@ -91,6 +558,7 @@ bool queue_insert_head(queue_t *q, const char *s) {
     }
     strcpy(str, s);
     newh->value = str;
+    node_of(newh)->prefix = string_prefix(s, NULL);
 
     newh->next = q->head;
     q->head = newh;
@@ -102,6 +570,11 @@ bool queue_insert_head(queue_t *q, const char *s) {
     /* increment the size */
     q->size++;
 
+    if (q->spill) {
+        q->spill->resident += element_bytes(str);
+        spill_excess(q);
+    }
+
     return true;
 }
 
@@ -123,8 +596,12 @@ bool queue_insert_tail(queue_t *q, const char *s) {
     if (!q || !s)
         return false;
 
+    /* Part of the queue is on disk, so the tail is not q->tail */
+    if (q->spill && (q->spill->first || q->spill->back_head))
+        return spill_insert_tail(q, s);
+
     list_ele_t *newt;
-    newt = malloc(sizeof(list_ele_t));
+    newt = malloc(sizeof(node_t));
     if (!newt)
         return false;
 
@@ -137,6 +614,7 @@ bool queue_insert_tail(queue_t *q, const char *s) {
     }
     strcpy(str, s);
     newt->value = str;
+    node_of(newt)->prefix = string_prefix(s, NULL);
 
     /* newt is the new tail so set next to null */
     newt->next = NULL;
@@ -150,6 +628,11 @@ bool queue_insert_tail(queue_t *q, const char *s) {
     }
 
     q->size++;
+
+    if (q->spill) {
+        q->spill->resident += element_bytes(str);
+        spill_excess(q);
+    }
     return true;
 }
 
@@ -172,6 +655,8 @@ bool queue_insert_tail(queue_t *q, const char *s) {
  */
 bool queue_remove_head(queue_t *q, char *buf, size_t bufsize) {
     /* You need to fix up this code. ok*/
+    if (q && q->spill && !refill_front(q))
+        return false;
     if (!q || !q->head)
         return false;
 
@@ -190,6 +675,8 @@ bool queue_remove_head(queue_t *q, char *buf, size_t bufsize) {
         q->tail = NULL;
     }
 
+    if (q->spill)
+        q->spill->resident -= element_bytes(pt->value);
     free(pt->value);
     free(pt);
     q->size--;
@@ -230,18 +717,390 @@ void queue_reverse(queue_t *q) {
     if (!q || q->size <= 1)
         return;
 
-    /*make some tempory pointers */
+    if (q->spill && q->spill->first) {
+        spill_reverse(q);
+        return;
+    }
+
+    /* The iterator saves each successor before we relink the element */
     list_ele_t *pre = NULL;
-    list_ele_t *curr = q->head;
-    list_ele_t *next = NULL;
+    queue_iter_t it;
+    queue_iter_begin(q, &it, QUEUE_ITER_AHEAD);
 
     q->tail = q->head;
-    while (curr) {
-        next = curr->next;
+    while (queue_iter_next(&it)) {
+        list_ele_t *curr = queue_iter_element(&it);
         curr->next = pre;
         pre = curr;
-        curr = next;
     }
 
     q->head = pre;
 }
+
+/**
+ * @brief Starts a walk over the elements of a queue
+ *
+ * Walking a linked list stalls on every `next` pointer.  The iterator
+ * keeps a second pointer `dist` elements ahead of the walk and prefetches
+ * that element and its string, so by the time the walk reaches them they
+ * are already in cache.
+ *
+ * @param[in]  q    The queue to walk, may be NULL
+ * @param[out] it   The iterator to initialize
+ * @param[in]  dist How many elements ahead to prefetch, 0 for none
+ */
+void queue_iter_begin(queue_t *q, queue_iter_t *it, size_t dist) {
+    it->cur = NULL;
+    it->next = q ? q->head : NULL;
+    it->front = dist ? it->next : NULL;
+    for (size_t i = 0; it->front && i < dist; i++) {
+        it->front = it->front->next;
+        __builtin_prefetch(it->front);
+    }
+}
+
+/**
+ * @brief Advances an iterator to the next element
+ *
+ * @param[in,out] it Iterator set up by queue_iter_begin
+ *
+ * @return false once every element has been visited
+ */
+bool queue_iter_next(queue_iter_t *it) {
+    if (!it->next)
+        return false;
+
+    it->cur = it->next;
+    it->next = it->cur->next;
+    if (it->front) {
+        /* front was prefetched on the previous step */
+        __builtin_prefetch(it->front->value);
+        it->front = it->front->next;
+        __builtin_prefetch(it->front);
+    }
+    return true;
+}
+
+/**
+ * @brief Returns the string value of the element under an iterator
+ * @param[in] it Iterator on which queue_iter_next returned true
+ */
+char *queue_iter_value(const queue_iter_t *it) {
+    return it->cur->value;
+}
+
+/**
+ * @brief Returns the element under an iterator
+ * @param[in] it Iterator on which queue_iter_next returned true
+ */
+list_ele_t *queue_iter_element(const queue_iter_t *it) {
+    return it->cur;
+}
+
+/* Apply a run's function to each of its elements */
+static void *run_worker(void *vrun) {
+    run_t *run = vrun;
+    /* View of the run as a queue, so it can be walked with an iterator */
+    queue_t view = {run->first, NULL, run->count, NULL};
+    queue_iter_t it;
+    queue_iter_begin(&view, &it, QUEUE_ITER_AHEAD);
+    for (size_t i = 0; i < run->count && queue_iter_next(&it); i++) {
+        list_ele_t *e = queue_iter_element(&it);
+        run->fn(e->value, run->arg);
+        /* fn may have rewritten the string, so refresh its cached prefix */
+        node_of(e)->prefix = string_prefix(e->value, NULL);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Applies a function to every value of a queue using several threads
+ *
+ * One walk over the list finds the starting element of `nthreads` runs of
+ * equal length.  Each run but the last is handed to a new thread, and the
+ * calling thread processes the last run itself.  If a thread cannot be
+ * started, its run is processed by the calling thread instead.
+ *
+ * `fn` may modify a string in place, but must not change its length or
+ * allocate memory, and must be safe to call from several threads at once.
+ * The cached prefix of each element is recomputed after `fn` returns.
+ *
+ * In spill mode only the elements held in memory at the front of the
+ * queue are visited; those in segments and in the back list are not.
+ *
+ * @param[in] q        The queue to process
+ * @param[in] fn       Function applied to each value
+ * @param[in] arg      Extra argument passed through to `fn`
+ * @param[in] nthreads Number of threads to use, including the caller
+ */
+void queue_parallel_for_each(queue_t *q, void (*fn)(char *s, void *arg),
+                             void *arg, size_t nthreads) {
+    if (!q || !fn || !q->head)
+        return;
+
+    /* In spill mode q->size also counts elements not in the list */
+    size_t n = q->size;
+    if (q->spill) {
+        n = 0;
+        for (list_ele_t *e = q->head; e; e = e->next)
+            n++;
+    }
+
+    if (nthreads > MAX_THREADS)
+        nthreads = MAX_THREADS;
+    if (nthreads > n)
+        nthreads = n;
+    if (nthreads == 0)
+        nthreads = 1;
+
+    run_t runs[MAX_THREADS];
+    pthread_t tids[MAX_THREADS];
+    bool started[MAX_THREADS];
+
+    /* Split the list into runs whose lengths differ by at most one */
+    list_ele_t *e = q->head;
+    for (size_t t = 0; t < nthreads; t++) {
+        size_t count = n / nthreads + (t < n % nthreads);
+        runs[t].first = e;
+        runs[t].count = count;
+        runs[t].fn = fn;
+        runs[t].arg = arg;
+        for (size_t i = 0; t + 1 < nthreads && i < count; i++)
+            e = e->next;
+    }
+
+    for (size_t t = 0; t + 1 < nthreads; t++)
+        started[t] =
+            pthread_create(&tids[t], NULL, run_worker, &runs[t]) == 0;
+    run_worker(&runs[nthreads - 1]);
+    for (size_t t = 0; t + 1 < nthreads; t++) {
+        if (started[t])
+            pthread_join(tids[t], NULL);
+        else
+            run_worker(&runs[t]);
+    }
+}
+
+/**
+ * @brief Sets how much memory the elements of a queue may use
+ *
+ * Once the elements take more than `budget` bytes, elements away from the
+ * head and tail of the queue are moved to temporary files and read back
+ * in large sequential chunks as the head drains.  A budget of 0 turns
+ * spill mode off again, which is only possible while nothing is on disk.
+ *
+ * @param[in] q      The queue to configure
+ * @param[in] budget Bytes of elements to keep in memory, or 0
+ *
+ * @return false if q is NULL, memory allocation failed, or spill mode
+ *         cannot be turned off because elements are on disk
+ */
+bool queue_set_spill(queue_t *q, size_t budget) {
+    if (!q)
+        return false;
+
+    if (!budget) {
+        if (q->spill && (q->spill->first || q->spill->back_head))
+            return false;
+        free(q->spill);
+        q->spill = NULL;
+        return true;
+    }
+
+    if (!q->spill) {
+        struct spill *sp = malloc(sizeof(struct spill));
+        if (!sp)
+            return false;
+        sp->resident = 0;
+        sp->spilled = 0;
+        sp->nspilled = 0;
+        sp->first = NULL;
+        sp->last = NULL;
+        sp->back_head = NULL;
+        sp->back_tail = NULL;
+        for (list_ele_t *e = q->head; e; e = e->next)
+            sp->resident += element_bytes(e->value);
+        q->spill = sp;
+    }
+    q->spill->budget = budget;
+    spill_excess(q);
+    return true;
+}
+
+/**
+ * @brief Reports where the elements of a queue are stored
+ *
+ * All outputs are 0 if the queue is not in spill mode, in which case
+ * nothing is on disk but resident bytes are not tracked either.
+ *
+ * @param[in]  q        The queue to examine
+ * @param[out] resident Bytes of elements held in memory
+ * @param[out] spilled  Bytes of records held in segment files
+ * @param[out] nspilled Number of elements held in segment files
+ */
+void queue_spill_stats(queue_t *q, size_t *resident, size_t *spilled,
+                       size_t *nspilled) {
+    struct spill *sp = q ? q->spill : NULL;
+    *resident = sp ? sp->resident : 0;
+    *spilled = sp ? sp->spilled : 0;
+    *nspilled = sp ? sp->nspilled : 0;
+}
+
+/*
+  Visit up to limit values of a segment in queue order.  The segment is
+  read into one buffer, and each record is turned into a C string in
+  place by moving its bytes over its length tag.  Set *stopped if the
+  walk ended before the last value, or the segment could not be read.
+*/
+static size_t walk_segment(segment_t *seg, size_t limit,
+                           bool (*visit)(const char *s, void *arg), void *arg,
+                           bool *stopped) {
+    *stopped = true;
+    char *buf = malloc(seg->bytes);
+    char **vals = malloc(seg->count * sizeof(char *));
+    size_t cnt = 0;
+    rewind(seg->fp);
+    if (buf && vals && fread(buf, 1, seg->bytes, seg->fp) == seg->bytes) {
+        size_t off = 0;
+        for (size_t i = 0; i < seg->count; i++) {
+            uint32_t tag;
+            memcpy(&tag, buf + off, sizeof(tag));
+            memmove(buf + off, buf + off + sizeof(tag), tag);
+            buf[off + tag] = '\0';
+            vals[seg->reversed ? seg->count - 1 - i : i] = buf + off;
+            off += sizeof(tag) + tag;
+        }
+        while (cnt < limit && cnt < seg->count && visit(vals[cnt], arg))
+            cnt++;
+        *stopped = cnt < seg->count;
+    }
+    free(vals);
+    free(buf);
+    return cnt;
+}
+
+/*
+  Visit up to limit values of the list starting at e.  Set *stopped if
+  the walk ended before the end of the list.
+*/
+static size_t walk_list(list_ele_t *e, size_t limit,
+                        bool (*visit)(const char *s, void *arg), void *arg,
+                        bool *stopped) {
+    queue_t view = {e, NULL, 0, NULL};
+    size_t cnt = 0;
+    queue_iter_t it;
+    queue_iter_begin(&view, &it, QUEUE_ITER_AHEAD);
+    *stopped = false;
+    while (queue_iter_next(&it)) {
+        if (cnt == limit || !visit(queue_iter_value(&it), arg)) {
+            *stopped = true;
+            break;
+        }
+        cnt++;
+    }
+    return cnt;
+}
+
+/**
+ * @brief Visits the values of a queue in order, including spilled ones
+ *
+ * Spilled elements are read back one segment at a time into a temporary
+ * buffer, leaving the queue as it is.  The walk stops early if `visit`
+ * returns false, or if a segment cannot be read or allocated.
+ *
+ * @param[in] q     The queue to walk
+ * @param[in] limit Largest number of values to visit
+ * @param[in] visit Function called with each value
+ * @param[in] arg   Extra argument passed through to `visit`
+ *
+ * @return the number of values for which `visit` returned true
+ */
+size_t queue_walk(queue_t *q, size_t limit,
+                  bool (*visit)(const char *s, void *arg), void *arg) {
+    if (!q || !visit)
+        return 0;
+
+    bool stopped;
+    size_t cnt = walk_list(q->head, limit, visit, arg, &stopped);
+    struct spill *sp = q->spill;
+    if (!sp || !sp->first)
+        return cnt;
+    for (segment_t *seg = sp->first; seg && !stopped; seg = seg->next)
+        cnt += walk_segment(seg, limit - cnt, visit, arg, &stopped);
+    if (!stopped)
+        cnt += walk_list(sp->back_head, limit - cnt, visit, arg, &stopped);
+    return cnt;
+}
+
+/**
+ * @brief Finds the first element of a queue with a given value
+ *
+ * Elements are first compared through their cached prefix word, so the
+ * string of an element is only read when its first bytes already match.
+ * The prefix is cached when the value is stored, so a value rewritten in
+ * place other than by queue_parallel_for_each may no longer be found.
+ *
+ * @param[in] q The queue to search
+ * @param[in] s The value to look for
+ *
+ * @return the first matching element, or
+ *         NULL if q or s is NULL, or no element matches
+ */
+list_ele_t *queue_find(queue_t *q, const char *s) {
+    if (!q || !s)
+        return NULL;
+
+    size_t len;
+    uint64_t key = string_prefix(s, &len);
+    queue_iter_t it;
+    queue_iter_begin(q, &it, QUEUE_ITER_AHEAD);
+    while (queue_iter_next(&it)) {
+        list_ele_t *e = queue_iter_element(&it);
+        if (node_of(e)->prefix != key)
+            continue;
+        /* Short strings are fully contained in the prefix */
+        if (len < PREFIX_LEN || strcmp(e->value + PREFIX_LEN, s + len) == 0)
+            return e;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Visits every element of a queue whose value starts with a prefix
+ *
+ * The walk stops early if `visit` returns false.
+ *
+ * @param[in] q     The queue to search
+ * @param[in] p     The prefix to look for
+ * @param[in] visit Function called with the value of each match
+ * @param[in] arg   Extra argument passed through to `visit`
+ *
+ * @return the number of matching elements visited
+ */
+size_t queue_find_prefix(queue_t *q, const char *p,
+                         bool (*visit)(const char *s, void *arg), void *arg) {
+    if (!q || !p || !visit)
+        return 0;
+
+    size_t len;
+    uint64_t key = string_prefix(p, &len);
+    size_t rest = strlen(p + len);
+    /* Only compare as many prefix bytes as p supplies */
+    uint64_t mask =
+        len == PREFIX_LEN ? UINT64_MAX : ((uint64_t)1 << (8 * len)) - 1;
+
+    size_t cnt = 0;
+    queue_iter_t it;
+    queue_iter_begin(q, &it, QUEUE_ITER_AHEAD);
+    while (queue_iter_next(&it)) {
+        list_ele_t *e = queue_iter_element(&it);
+        if ((node_of(e)->prefix & mask) != key)
+            continue;
+        if (rest && strncmp(e->value + PREFIX_LEN, p + len, rest) != 0)
+            continue;
+        cnt++;
+        if (!visit(e->value, arg))
+            break;
+    }
+    return cnt;
+}
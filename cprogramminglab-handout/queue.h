@@ -46,8 +46,36 @@ typedef struct {
     list_ele_t *tail; /* added field to point to the last element in queue */
 
     size_t size; /* added field to keep track of elements in queue */
+
+    /**
+     * @brief Spill-to-disk state, or NULL if every element is kept in
+     *        the linked list.
+     *
+     * In spill mode the list from head to tail only holds the resident
+     * front of the queue, while size counts every element.  Iterators,
+     * queue_find, queue_find_prefix and queue_parallel_for_each visit
+     * just the elements in that list; queue_walk visits them all.
+     */
+    struct spill *spill;
 } queue_t;
 
+/**
+ * @brief Default number of elements an iterator prefetches ahead
+ */
+#define QUEUE_ITER_AHEAD 8
+
+/**
+ * @brief Position of a walk over the elements of a queue.
+ *
+ * The iterator remembers the successor of the current element, so the
+ * caller may free or relink the current element before advancing.
+ */
+typedef struct {
+    list_ele_t *cur;   /* Element the iterator is on, NULL before first */
+    list_ele_t *next;  /* Element that follows cur */
+    list_ele_t *front; /* Element being prefetched, `dist` past next */
+} queue_iter_t;
+
 /************** Operations on queue ************************/
 
 /* Create empty queue. */
@@ -56,6 +84,15 @@ queue_t *queue_new(void);
 /* Free ALL storage used by queue. */
 void queue_free(queue_t *q);
 
+/* Allocate an element holding a copy of s, not linked into any queue. */
+list_ele_t *queue_element_new(const char *s);
+
+/* Free an element made by queue_element_new, and its string. */
+void queue_element_free(list_ele_t *e);
+
+/* Return bytes used by an element and its string. */
+size_t queue_element_bytes(const list_ele_t *e);
+
 /* Attempt to insert element at head of queue. */
 bool queue_insert_head(queue_t *q, const char *s);
 
@@ -70,3 +107,37 @@ size_t queue_size(queue_t *q);
 
 /* Reverse elements in queue */
 void queue_reverse(queue_t *q);
+
+/* Start a walk, prefetching dist elements ahead. */
+void queue_iter_begin(queue_t *q, queue_iter_t *it, size_t dist);
+
+/* Advance to the next element.  False once the walk is done. */
+bool queue_iter_next(queue_iter_t *it);
+
+/* Return value of the current element. */
+char *queue_iter_value(const queue_iter_t *it);
+
+/* Return the current element itself. */
+list_ele_t *queue_iter_element(const queue_iter_t *it);
+
+/* Apply fn to every value, splitting the queue across nthreads threads. */
+void queue_parallel_for_each(queue_t *q, void (*fn)(char *s, void *arg),
+                             void *arg, size_t nthreads);
+
+/* Keep about budget bytes of elements in memory, the rest on disk. */
+bool queue_set_spill(queue_t *q, size_t budget);
+
+/* Report bytes held in memory and on disk, and elements on disk. */
+void queue_spill_stats(queue_t *q, size_t *resident, size_t *spilled,
+                       size_t *nspilled);
+
+/* Call visit on up to limit values in order, spilled ones included. */
+size_t queue_walk(queue_t *q, size_t limit,
+                  bool (*visit)(const char *s, void *arg), void *arg);
+
+/* Return first element whose value equals s, or NULL. */
+list_ele_t *queue_find(queue_t *q, const char *s);
+
+/* Call visit on each element whose value starts with p. */
+size_t queue_find_prefix(queue_t *q, const char *p,
+                         bool (*visit)(const char *s, void *arg), void *arg);
@@ -0,0 +1,239 @@
+/**
+ * @file timerwheel.c
+ * @brief Implementation of a hierarchical timing wheel.
+ *
+ * A timer with deadline d is placed relative to the current tick `now` by
+ * the highest bit in which d and now differ: if it falls in the bits
+ * decoded by level l, the timer goes to slot (d >> (l * WHEEL_BITS)) of
+ * level l.  That slot is emptied when `now` next becomes a multiple of
+ * WHEEL_SLOTS^l with the same digit, at which point d and now agree on
+ * every bit from level l up and the timer lands on a lower level.
+ */
+
+#include "timerwheel.h"
+#include "harness.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define SLOT_MASK (WHEEL_SLOTS - 1)
+
+/* Append a timer to the tail of a slot */
+static void slot_append(tw_slot_t *s, tw_timer_t *t) {
+    t->slot = s;
+    t->next = NULL;
+    t->prev = s->tail;
+    if (s->tail)
+        s->tail->next = t;
+    else
+        s->head = t;
+    s->tail = t;
+    s->size++;
+}
+
+/* Unlink a timer from its slot */
+static void slot_remove(tw_slot_t *s, tw_timer_t *t) {
+    if (t->prev)
+        t->prev->next = t->next;
+    else
+        s->head = t->next;
+    if (t->next)
+        t->next->prev = t->prev;
+    else
+        s->tail = t->prev;
+    s->size--;
+}
+
+/* Take every timer out of a slot, returning them as a list */
+static tw_timer_t *slot_take(tw_slot_t *s) {
+    tw_timer_t *list = s->head;
+    s->head = NULL;
+    s->tail = NULL;
+    s->size = 0;
+    return list;
+}
+
+/* Put a timer in the slot for its deadline.  Requires deadline >= now */
+static void place(tw_t *w, tw_timer_t *t) {
+    uint64_t diff = t->deadline ^ w->now;
+    size_t level = 0;
+    if (diff)
+        level = (size_t)(63 - __builtin_clzll(diff)) / WHEEL_BITS;
+    size_t index = (size_t)(t->deadline >> (level * WHEEL_BITS)) & SLOT_MASK;
+    slot_append(&w->slots[level][index], t);
+}
+
+/* Free a timer and its label */
+static void free_timer(tw_timer_t *t) {
+    free(t->value);
+    free(t);
+}
+
+/**
+ * @brief Allocates a new timing wheel
+ *
+ * @param[in] now Tick the wheel's clock starts at
+ *
+ * @return The new wheel, or NULL if memory allocation failed
+ */
+tw_t *tw_new(uint64_t now) {
+    tw_t *w = malloc(sizeof(tw_t));
+    if (!w)
+        return NULL;
+
+    w->now = now;
+    w->size = 0;
+    for (size_t l = 0; l < WHEEL_LEVELS; l++) {
+        for (size_t i = 0; i < WHEEL_SLOTS; i++) {
+            w->slots[l][i].head = NULL;
+            w->slots[l][i].tail = NULL;
+            w->slots[l][i].size = 0;
+        }
+    }
+    return w;
+}
+
+/**
+ * @brief Frees a wheel and every timer still pending on it
+ * @param[in] w The wheel to free
+ */
+void tw_free(tw_t *w) {
+    if (!w)
+        return;
+
+    for (size_t l = 0; l < WHEEL_LEVELS; l++) {
+        for (size_t i = 0; i < WHEEL_SLOTS; i++) {
+            tw_timer_t *t = w->slots[l][i].head;
+            while (t) {
+                tw_timer_t *next = t->next;
+                free_timer(t);
+                t = next;
+            }
+        }
+    }
+    free(w);
+}
+
+/**
+ * @brief Adds a timer to a wheel
+ *
+ * A deadline that is not in the future expires on the next tick.  Timers
+ * with the same deadline expire in the order they were added.
+ *
+ * @param[in] w        The wheel to add to
+ * @param[in] deadline Tick on which the timer expires
+ * @param[in] value    Label copied into the timer, or NULL
+ *
+ * @return Handle for tw_cancel, valid until the timer expires or is
+ *         cancelled, or NULL if w is NULL or memory allocation failed
+ */
+tw_timer_t *tw_add(tw_t *w, uint64_t deadline, const char *value) {
+    if (!w)
+        return NULL;
+
+    tw_timer_t *t = malloc(sizeof(tw_timer_t));
+    if (!t)
+        return NULL;
+    t->value = NULL;
+    if (value) {
+        size_t len = strlen(value);
+        t->value = malloc(len + 1);
+        if (!t->value) {
+            free(t);
+            return NULL;
+        }
+        memcpy(t->value, value, len);
+        t->value[len] = '\0';
+    }
+    t->deadline = deadline > w->now ? deadline : w->now + 1;
+    place(w, t);
+    w->size++;
+    return t;
+}
+
+/**
+ * @brief Cancels a pending timer
+ *
+ * @param[in] w The wheel holding the timer
+ * @param[in] t Handle returned by tw_add
+ */
+void tw_cancel(tw_t *w, tw_timer_t *t) {
+    if (!w || !t)
+        return;
+
+    slot_remove(t->slot, t);
+    w->size--;
+    free_timer(t);
+}
+
+/**
+ * @brief Advances the clock of a wheel
+ *
+ * For each tick, slots of higher levels whose range begins at the new
+ * time are cascaded down, highest level first, and then every timer in
+ * the current level 0 slot expires.  `expire` is called on each expired
+ * timer, which is freed afterwards.  `expire` may add timers, but must
+ * not cancel any.
+ *
+ * @param[in] w      The wheel to advance
+ * @param[in] ticks  Number of ticks to advance by
+ * @param[in] expire Function called on each expired timer, or NULL
+ * @param[in] arg    Extra argument passed through to `expire`
+ *
+ * @return the number of timers that expired
+ */
+size_t tw_advance(tw_t *w, uint64_t ticks, tw_expire_t expire, void *arg) {
+    if (!w)
+        return 0;
+
+    size_t expired = 0;
+    for (; ticks > 0; ticks--) {
+        if (!w->size) {
+            /* Nothing can expire.  Jump to the end */
+            w->now += ticks;
+            break;
+        }
+        w->now++;
+
+        /* Find the highest level whose slot boundary was just crossed */
+        size_t top = 0;
+        while (top + 1 < WHEEL_LEVELS &&
+               ((w->now >> (top * WHEEL_BITS)) & SLOT_MASK) == 0)
+            top++;
+        for (size_t l = top; l > 0; l--) {
+            size_t index = (size_t)(w->now >> (l * WHEEL_BITS)) & SLOT_MASK;
+            tw_timer_t *t = slot_take(&w->slots[l][index]);
+            while (t) {
+                tw_timer_t *next = t->next;
+                place(w, t);
+                t = next;
+            }
+        }
+
+        tw_timer_t *t = slot_take(&w->slots[0][w->now & SLOT_MASK]);
+        while (t) {
+            tw_timer_t *next = t->next;
+            w->size--;
+            expired++;
+            if (expire)
+                expire(t->value, t->deadline, arg);
+            free_timer(t);
+            t = next;
+        }
+    }
+    return expired;
+}
+
+/**
+ * @brief Returns the number of pending timers of a wheel
+ *
+ * @param[in] w The wheel to examine
+ *
+ * @return the number of pending timers, or 0 if w is NULL
+ */
+size_t tw_size(tw_t *w) {
+    if (!w)
+        return 0;
+
+    return w->size;
+}
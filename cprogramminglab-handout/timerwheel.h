@@ -0,0 +1,83 @@
+/**
+ * @file timerwheel.h
+ * @brief Hierarchical timing wheel for large numbers of timeouts.
+ *
+ * Time is counted in integer ticks.  The wheel has WHEEL_LEVELS levels of
+ * WHEEL_SLOTS slots; a slot on level l covers WHEEL_SLOTS^l ticks.  A
+ * timer is kept on the lowest level whose slot range still separates its
+ * deadline from the current time.  As time passes, the slots of higher
+ * levels are emptied into lower ones ("cascading"), so each timer moves
+ * at most WHEEL_LEVELS - 1 times before it expires.
+ *
+ * Each slot is a FIFO list like queue_t, with back links so that a timer
+ * can be cancelled in O(1) through the handle returned when it was added.
+ */
+
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Bits of the deadline decoded by each level */
+#define WHEEL_BITS 8
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+/* Enough levels to cover every 64-bit deadline */
+#define WHEEL_LEVELS (64 / WHEEL_BITS)
+
+/************** Data structure declarations ****************/
+
+/**
+ * @brief Pending timer.  Returned by tw_add as a handle for tw_cancel.
+ */
+typedef struct tw_timer {
+    uint64_t deadline;     /* Tick on which the timer expires */
+    char *value;           /* Copy of the timer's label, or NULL */
+    struct tw_timer *prev; /* Neighbours in the slot list */
+    struct tw_timer *next;
+    struct tw_slot *slot; /* Slot holding the timer */
+} tw_timer_t;
+
+/**
+ * @brief FIFO list of timers.
+ */
+typedef struct tw_slot {
+    tw_timer_t *head;
+    tw_timer_t *tail;
+    size_t size;
+} tw_slot_t;
+
+/**
+ * @brief Timing wheel
+ */
+typedef struct {
+    uint64_t now; /* Current tick */
+    size_t size;  /* Number of pending timers */
+    tw_slot_t slots[WHEEL_LEVELS][WHEEL_SLOTS];
+} tw_t;
+
+/* Function called on each expired timer */
+typedef void (*tw_expire_t)(const char *value, uint64_t deadline, void *arg);
+
+/************** Operations on wheel ************************/
+
+/* Create empty wheel whose clock reads now. */
+tw_t *tw_new(uint64_t now);
+
+/* Free ALL storage used by wheel, including pending timers. */
+void tw_free(tw_t *w);
+
+/* Add a timer expiring on tick deadline.  Return handle, or NULL. */
+tw_timer_t *tw_add(tw_t *w, uint64_t deadline, const char *value);
+
+/* Cancel a pending timer.  Its handle is no longer valid. */
+void tw_cancel(tw_t *w, tw_timer_t *t);
+
+/* Advance clock by ticks, expiring due timers.  Return number expired. */
+size_t tw_advance(tw_t *w, uint64_t ticks, tw_expire_t expire, void *arg);
+
+/* Return number of pending timers. */
+size_t tw_size(tw_t *w);
+
+#endif /* TIMERWHEEL_H */
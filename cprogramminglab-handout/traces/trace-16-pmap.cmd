@@ -0,0 +1,19 @@
+# Test of searches after pmap rewrites strings in place
+option fail 0
+option malloc 0
+new
+ih abc
+ih hello
+it abcdefghijk
+it HELLO_WORLD
+pmap upper 2
+find ABC
+find ABCDEFGHIJK
+findp HE
+findp ABCDEFGHI
+pmap lower 2
+find abc
+find hello_world
+findp he
+free
+quit